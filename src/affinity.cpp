@@ -0,0 +1,170 @@
+#include "affinity.h"
+
+// memory policies of mbind(), see numaif.h
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+
+// the largest number of nodes handled
+#define MAX_NODES 64
+
+int cpu_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : (int)n;
+}
+
+int cpu_node(int cpu) {
+    // /sys/devices/system/cpu/cpuN has a link named nodeM
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node < MAX_NODES ? node : 0;
+}
+
+int node_count() {
+    int count = 0;
+    while (count < MAX_NODES) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", count);
+        if (access(path, F_OK) != 0) {
+            break;
+        }
+        ++count;
+    }
+    return count < 1 ? 1 : count;
+}
+
+bool pin_thread(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+int parse_cpu_list(const char *list, int *cpus, int max) {
+    int count = 0;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && count < max; ++cpu) {
+            cpus[count++] = (int)cpu;
+        }
+        if (*p == ',') {
+            ++p;
+        } else if (*p) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+bool bind_to_node(void *addr, size_t len, int node) {
+    if (node_count() == 1) {
+        return true;
+    }
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, addr, len, MPOL_BIND, &mask, MAX_NODES + 1, 0) == 0;
+}
+
+bool interleave_nodes(void *addr, size_t len) {
+    int nodes = node_count();
+    if (nodes == 1) {
+        return true;
+    }
+    unsigned long mask = (nodes >= MAX_NODES) ? ~0UL : (1UL << nodes) - 1;
+    return syscall(SYS_mbind, addr, len, MPOL_INTERLEAVE, &mask, MAX_NODES + 1, 0) == 0;
+}
+
+Node_buffers::Node_buffers(size_t size) {
+    // keep the buffers on their own cache lines
+    m_size = (size + 63) & ~(size_t)63;
+    if (m_size > CHUNK_SIZE) {
+        throw std::exception();
+    }
+
+    m_node_count = node_count();
+    m_nodes = new Node[m_node_count];
+    for (int i = 0; i < m_node_count; ++i) {
+        m_nodes[i].free_list = NULL;
+        m_nodes[i].chunk = NULL;
+        m_nodes[i].chunk_left = 0;
+    }
+}
+
+Node_buffers::~Node_buffers() {
+    // the chunks live as long as the process
+    delete[] m_nodes;
+}
+
+char* Node_buffers::alloc(int node) {
+    if (node < 0 || node >= m_node_count) {
+        node = 0;
+    }
+    Node& n = m_nodes[node];
+
+    n.locker.lock();
+    char *buf = n.free_list;
+    if (buf) {
+        n.free_list = *(char**)buf;
+        n.locker.unlock();
+        return buf;
+    }
+
+    if (n.chunk_left < m_size) {
+        // the pages of the chunk are allocated on node when they are first touched
+        void *chunk = mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            n.locker.unlock();
+            return NULL;
+        }
+        bind_to_node(chunk, CHUNK_SIZE, node);
+        n.chunk = (char*)chunk;
+        n.chunk_left = CHUNK_SIZE;
+    }
+
+    buf = n.chunk;
+    n.chunk += m_size;
+    n.chunk_left -= m_size;
+    n.locker.unlock();
+    return buf;
+}
+
+void Node_buffers::free(char *buf, int node) {
+    if (!buf) {
+        return;
+    }
+    if (node < 0 || node >= m_node_count) {
+        node = 0;
+    }
+    Node& n = m_nodes[node];
+
+    n.locker.lock();
+    *(char**)buf = n.free_list;
+    n.free_list = buf;
+    n.locker.unlock();
+}
@@ -0,0 +1,76 @@
+#ifndef __AFFINITY__H
+#define __AFFINITY__H
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "locker.h"
+
+// placement of threads and memory on cpus and NUMA nodes
+// the NUMA policy is set with the raw mbind syscall, so libnuma is not needed
+
+// number of online cpus
+int cpu_count();
+
+// NUMA node of cpu, 0 if the machine has no NUMA information
+int cpu_node(int cpu);
+
+// number of NUMA nodes
+int node_count();
+
+// pin thread to cpu
+bool pin_thread(pthread_t thread, int cpu);
+
+// parse a list like "0-3,8,10-11" into cpus, return the number of cpus or -1 if the list is invalid
+int parse_cpu_list(const char *list, int *cpus, int max);
+
+// place the pages of [addr, addr + len) on node when they are touched
+bool bind_to_node(void *addr, size_t len, int node);
+
+// spread the pages of [addr, addr + len) over all nodes
+bool interleave_nodes(void *addr, size_t len);
+
+// class Node_buffers hands out buffers of one size whose pages are on a given NUMA node
+// the buffers are carved from chunks bound to the node, a freed buffer goes back to the list of its node
+class Node_buffers
+{
+public:
+    // size of the chunks buffers are carved from
+    static const size_t CHUNK_SIZE = 2 * 1024 * 1024;
+
+    Node_buffers(size_t size);
+
+    ~Node_buffers();
+
+    // a buffer on node
+    char* alloc(int node);
+
+    // give back a buffer from alloc(node)
+    void free(char *buf, int node);
+
+private:
+    struct Node
+    {
+        // freed buffers, each one keeps the next one in its first bytes
+        char *free_list;
+
+        // unused part of the current chunk
+        char *chunk;
+        size_t chunk_left;
+
+        Locker locker;
+    };
+
+    size_t m_size;
+    int m_node_count;
+    Node *m_nodes;
+};
+
+#endif
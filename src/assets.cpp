@@ -0,0 +1,491 @@
+#include "assets.h"
+
+// size of a huge page on x86-64
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+// resident memory of the process in kB
+static long resident_kb() {
+    long size = 0;
+    long resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp) {
+        return 0;
+    }
+    if (fscanf(fp, "%ld %ld", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(fp);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+Asset_store::Asset_store() :
+m_files(NULL),
+m_file_count(0),
+m_file_capacity(0),
+m_region(NULL),
+m_region_len(0),
+m_backing("none"),
+m_slots(NULL),
+m_mask(0) {}
+
+Asset_store::~Asset_store() {
+    for (int i = 0; i < m_file_count && m_files; ++i) {
+        free(m_files[i].path);
+    }
+    free(m_files);
+    if (m_region) {
+        munmap(m_region, m_region_len);
+    }
+    delete[] m_slots;
+}
+
+// FNV-1a
+uint64_t Asset_store::hash_path(const char *path, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool Asset_store::load(const char *doc_root) {
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    long rss_before = resident_kb();
+
+    char dir[PATH_MAX];
+    int root_len = strlen(doc_root);
+    if (root_len >= PATH_MAX) {
+        return false;
+    }
+    strcpy(dir, doc_root);
+    if (!walk(dir, root_len, root_len, 0)) {
+        return false;
+    }
+
+    // each file takes its path, its headers and its content, the headers are what do_request() sends
+    size_t total = 0;
+    for (int i = 0; i < m_file_count; ++i) {
+        total += strlen(m_files[i].path) + 1;
+        total += snprintf(NULL, 0, "Content-Length: %zu\r\nContent-Type:%s\r\n\r\n", m_files[i].size, "text/html");
+        total += m_files[i].size;
+    }
+
+    m_region = map_region(total > 0 ? total : 1);
+    if (!m_region) {
+        printf("preload: cannot map %zu bytes\n", total);
+        return false;
+    }
+
+    uint64_t capacity = 16;
+    while (capacity < (uint64_t)m_file_count * 2) {
+        capacity *= 2;
+    }
+    m_slots = new Slot[capacity];
+    memset(m_slots, 0, sizeof(Slot) * capacity);
+    m_mask = capacity - 1;
+
+    char *p = m_region;
+    int loaded = 0;
+    for (int i = 0; i < m_file_count; ++i) {
+        File& file = m_files[i];
+        int path_len = strlen(file.path);
+        char *path = p;
+        memcpy(path, file.path, path_len + 1);
+        p += path_len + 1;
+
+        char *data = p;
+        p += sprintf(p, "Content-Length: %zu\r\nContent-Type:%s\r\n\r\n", file.size, "text/html");
+
+        // the path is relative to doc_root, the region is filled in the order of the walk
+        snprintf(dir + root_len, PATH_MAX - root_len, "%s", file.path);
+        int fd = open(dir, O_RDONLY);
+        size_t done = 0;
+        while (fd >= 0 && done < file.size) {
+            ssize_t n = read(fd, p + done, file.size - done);
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        p += file.size;
+        if (done != file.size) {
+            // changed while it was loaded, it is served from the filesystem
+            printf("preload: cannot read %s\n", dir);
+            free(file.path);
+            continue;
+        }
+
+        uint64_t hash = hash_path(path, path_len);
+        uint64_t index = hash & m_mask;
+        while (m_slots[index].path) {
+            index = (index + 1) & m_mask;
+        }
+        Slot& slot = m_slots[index];
+        slot.hash = hash;
+        slot.path = path;
+        slot.path_len = path_len;
+        slot.asset.data = data;
+        slot.asset.len = p - data;
+        slot.asset.etag = NULL;
+        slot.asset.etag_len = 0;
+        ++loaded;
+
+        free(file.path);
+    }
+    free(m_files);
+    m_files = NULL;
+
+    // nothing writes the responses any more
+    mprotect(m_region, m_region_len, PROT_READ);
+
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_usec - start.tv_usec) / 1000.0;
+    printf("preload: %d files, %zu bytes in %.1f ms, %s, rss %ld kB -> %ld kB\n",
+           loaded, total, ms, m_backing, rss_before, resident_kb());
+    return true;
+}
+
+bool Asset_store::walk(char *dir, int dir_len, int url_start, int depth) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        printf("preload: cannot open %s\n", dir);
+        return false;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        int len = snprintf(dir + dir_len, PATH_MAX - dir_len, "/%s", entry->d_name);
+        if (len >= PATH_MAX - dir_len) {
+            continue;
+        }
+
+        // symbolic links are followed, as stat() in do_request() does
+        struct stat st;
+        if (stat(dir, &st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (depth < MAX_DEPTH && !walk(dir, dir_len + len, url_start, depth + 1)) {
+                closedir(d);
+                return false;
+            }
+        } else if (S_ISREG(st.st_mode) && (st.st_mode & S_IROTH)) {
+            if (m_file_count == m_file_capacity) {
+                m_file_capacity = m_file_capacity ? m_file_capacity * 2 : 64;
+                m_files = (File*)realloc(m_files, sizeof(File) * m_file_capacity);
+            }
+            m_files[m_file_count].path = strdup(dir + url_start);
+            m_files[m_file_count].size = st.st_size;
+            ++m_file_count;
+        }
+    }
+    dir[dir_len] = '\0';
+    closedir(d);
+    return true;
+}
+
+char* Asset_store::map_region(size_t len) {
+    size_t huge_len = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+    // reserved huge pages first, they exist only when /proc/sys/vm/nr_hugepages is set
+    void *p = mmap(NULL, huge_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        m_region_len = huge_len;
+        m_backing = "hugetlb pages";
+        return (char*)p;
+    }
+
+    // then transparent huge pages, which need a region aligned to them
+    p = mmap(NULL, huge_len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    char *begin = (char*)p;
+    char *aligned = (char*)(((uintptr_t)begin + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if (aligned > begin) {
+        munmap(begin, aligned - begin);
+    }
+    munmap(aligned + huge_len, begin + HUGE_PAGE_SIZE - aligned);
+
+    m_region_len = huge_len;
+    m_backing = (madvise(aligned, huge_len, MADV_HUGEPAGE) == 0) ? "transparent huge pages" : "small pages";
+    return aligned;
+}
+
+bool Asset_store::find(const char *url, Asset *asset) const {
+    if (!m_slots) {
+        return false;
+    }
+    int len = strlen(url);
+    uint64_t hash = hash_path(url, len);
+    uint64_t index = hash & m_mask;
+    while (m_slots[index].path) {
+        const Slot& slot = m_slots[index];
+        if (slot.hash == hash && slot.path_len == len && memcmp(slot.path, url, len) == 0) {
+            *asset = slot.asset;
+            return true;
+        }
+        index = (index + 1) & m_mask;
+    }
+    return false;
+}
+
+// the bodies of a bundle start on this boundary
+#define BUNDLE_ALIGN 4096
+
+const char Asset_bundle::MAGIC[8] = {'W', 'S', 'B', 'U', 'N', 'D', 'L', 'E'};
+
+// the order of the index, the one find() searches with
+static int compare_path(const char *a, int a_len, const char *b, int b_len) {
+    int ret = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (ret != 0) {
+        return ret;
+    }
+    return a_len - b_len;
+}
+
+static int compare_file(const void *a, const void *b) {
+    const char *pa = *(char* const*)a;
+    const char *pb = *(char* const*)b;
+    return compare_path(pa, strlen(pa), pb, strlen(pb));
+}
+
+static bool write_at(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+Asset_bundle::Asset_bundle() :
+m_base(NULL),
+m_size(0),
+m_index(NULL),
+m_count(0) {}
+
+Asset_bundle::~Asset_bundle() {
+    if (m_base) {
+        munmap((void*)m_base, m_size);
+    }
+}
+
+const char* Asset_bundle::mime_type(const char *path) {
+    static const char *types[][2] = {
+        {".html", "text/html"}, {".htm", "text/html"}, {".css", "text/css"},
+        {".js", "application/javascript"}, {".json", "application/json"}, {".txt", "text/plain"},
+        {".xml", "application/xml"}, {".svg", "image/svg+xml"}, {".png", "image/png"},
+        {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"}, {".gif", "image/gif"},
+        {".webp", "image/webp"}, {".ico", "image/x-icon"}, {".woff2", "font/woff2"},
+        {".pdf", "application/pdf"}, {".mp4", "video/mp4"},
+    };
+    const char *dot = strrchr(path, '.');
+    if (dot && !strchr(dot, '/')) {
+        for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+            if (strcasecmp(dot, types[i][0]) == 0) {
+                return types[i][1];
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+bool Asset_bundle::pack(const char *doc_root, const char *path) {
+    Asset_store store;
+    char dir[PATH_MAX];
+    int root_len = strlen(doc_root);
+    if (root_len >= PATH_MAX) {
+        return false;
+    }
+    strcpy(dir, doc_root);
+    if (!store.walk(dir, root_len, root_len, 0)) {
+        return false;
+    }
+    int count = store.m_file_count;
+    Asset_store::File *files = store.m_files;
+    qsort(files, count, sizeof(files[0]), compare_file);
+
+    // the bundle is written aside and renamed, a server mapping the old one keeps reading it
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return false;
+    }
+    int fd = ::open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("pack: cannot create %s\n", tmp);
+        return false;
+    }
+
+    Bundle_entry *index = (Bundle_entry*)calloc(count > 0 ? count : 1, sizeof(Bundle_entry));
+    uint64_t offset = sizeof(Bundle_header) + sizeof(Bundle_entry) * count;
+    for (int i = 0; i < count; ++i) {
+        index[i].path_offset = offset;
+        index[i].path_len = strlen(files[i].path);
+        offset += index[i].path_len;
+    }
+
+    bool ok = true;
+    for (int i = 0; i < count && ok; ++i) {
+        Bundle_entry& entry = index[i];
+        if (!write_at(fd, files[i].path, entry.path_len, entry.path_offset)) {
+            ok = false;
+            break;
+        }
+
+        // the entity tag is the hash of the content, so packing the same files again keeps it
+        snprintf(dir + root_len, PATH_MAX - root_len, "%s", files[i].path);
+        int file_fd = ::open(dir, O_RDONLY);
+        struct stat st;
+        if (file_fd < 0 || fstat(file_fd, &st) < 0) {
+            printf("pack: cannot read %s\n", dir);
+            if (file_fd >= 0) {
+                close(file_fd);
+            }
+            ok = false;
+            break;
+        }
+        size_t size = st.st_size;
+        char *body = (char*)malloc(size > 0 ? size : 1);
+        size_t done = 0;
+        while (body && done < size) {
+            ssize_t n = read(file_fd, body + done, size - done);
+            if (n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        close(file_fd);
+        if (!body || done != size) {
+            printf("pack: cannot read %s\n", dir);
+            free(body);
+            ok = false;
+            break;
+        }
+
+        char head[512];
+        int head_len = snprintf(head, sizeof(head), "Content-Length: %zu\r\nContent-Type:%s\r\nETag: ",
+                                size, mime_type(files[i].path));
+        entry.etag_offset = head_len;
+        head_len += snprintf(head + head_len, sizeof(head) - head_len, "\"%016llx\"",
+                             (unsigned long long)Asset_store::hash_path(body, size));
+        entry.etag_len = head_len - entry.etag_offset;
+        head_len += snprintf(head + head_len, sizeof(head) - head_len, "\r\n\r\n");
+
+        // the headers end right where the page of the body starts
+        uint64_t body_offset = (offset + head_len + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+        entry.head_len = head_len;
+        entry.data_offset = body_offset - head_len;
+        entry.body_len = size;
+        ok = write_at(fd, head, head_len, entry.data_offset) && write_at(fd, body, size, body_offset);
+        offset = body_offset + size;
+        free(body);
+    }
+
+    Bundle_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.count = count;
+    header.index_offset = sizeof(Bundle_header);
+    header.size = offset;
+    ok = ok && write_at(fd, index, sizeof(Bundle_entry) * count, header.index_offset)
+            && write_at(fd, &header, sizeof(header), 0)
+            && ftruncate(fd, offset) == 0 && fsync(fd) == 0;
+    free(index);
+    if (close(fd) < 0) {
+        ok = false;
+    }
+    if (!ok || rename(tmp, path) < 0) {
+        printf("pack: cannot write %s\n", path);
+        unlink(tmp);
+        return false;
+    }
+    printf("pack: %d files, %llu bytes in %s\n", count, (unsigned long long)offset, path);
+    return true;
+}
+
+bool Asset_bundle::open(const char *path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("bundle: cannot open %s\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Bundle_header)) {
+        printf("bundle: %s is not a bundle\n", path);
+        close(fd);
+        return false;
+    }
+
+    // the pages are read when they are first sent, nothing else is read now
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        printf("bundle: cannot map %s\n", path);
+        return false;
+    }
+    m_base = (const char*)p;
+    m_size = st.st_size;
+
+    const Bundle_header *header = (const Bundle_header*)m_base;
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION || header->size != m_size
+        || header->index_offset % sizeof(uint64_t) != 0 || header->index_offset > m_size
+        || header->count > (m_size - header->index_offset) / sizeof(Bundle_entry)) {
+        printf("bundle: %s is not a bundle of version %u\n", path, VERSION);
+        return false;
+    }
+    m_index = (const Bundle_entry*)(m_base + header->index_offset);
+    m_count = header->count;
+    printf("bundle: %u files from %s\n", m_count, path);
+    return true;
+}
+
+bool Asset_bundle::find(const char *url, Asset *asset) const {
+    int len = strlen(url);
+    uint32_t low = 0;
+    uint32_t high = m_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const Bundle_entry& entry = m_index[mid];
+        if (entry.path_offset > m_size || entry.path_len > m_size - entry.path_offset) {
+            return false;
+        }
+        int ret = compare_path(m_base + entry.path_offset, entry.path_len, url, len);
+        if (ret < 0) {
+            low = mid + 1;
+        } else if (ret > 0) {
+            high = mid;
+        } else {
+            // the offsets come from a file, a damaged one must not send other memory
+            uint64_t data_len = (uint64_t)entry.head_len + entry.body_len;
+            if (entry.data_offset > m_size || data_len > m_size - entry.data_offset
+                || (uint64_t)entry.etag_offset + entry.etag_len > entry.head_len) {
+                return false;
+            }
+            asset->data = m_base + entry.data_offset;
+            asset->len = data_len;
+            asset->etag = asset->data + entry.etag_offset;
+            asset->etag_len = entry.etag_len;
+            return true;
+        }
+    }
+    return false;
+}
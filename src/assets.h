@@ -0,0 +1,151 @@
+#ifndef __ASSETS__H
+#define __ASSETS__H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+
+// a file of doc_root loaded in memory
+// data is the response after its status line: the headers, the blank line and the content
+struct Asset
+{
+    const char *data;
+    size_t len;
+
+    // the quoted entity tag of the content, etag_len is 0 if there is none
+    const char *etag;
+    int etag_len;
+};
+
+// class Asset_store loads every file under doc_root once at startup
+// the responses are laid out in one read-only region, backed by huge pages when the system has them,
+// and found through a hash table of their paths that is never written after loading,
+// so serving a file is one probe and a writev() without touching the filesystem
+// files changed after loading are not seen until the server restarts
+class Asset_store
+{
+public:
+    // the deepest directory walked under doc_root
+    static const int MAX_DEPTH = 32;
+
+    Asset_store();
+
+    ~Asset_store();
+
+    // load the files under doc_root and report the time and memory it took
+    bool load(const char *doc_root);
+
+    // the asset of url, false if url is not a loaded file
+    bool find(const char *url, Asset *asset) const;
+
+private:
+    friend class Asset_bundle;
+
+    // one slot of the hash table, the path is in the region right before the asset
+    struct Slot
+    {
+        uint64_t hash;
+        const char *path;
+        int path_len;
+        Asset asset;
+    };
+
+    // a file found by the walk
+    struct File
+    {
+        char *path;
+        size_t size;
+    };
+
+    // collect the regular files that everyone may read, as do_request() serves them
+    bool walk(char *dir, int dir_len, int url_start, int depth);
+
+    // map a region of len bytes, with huge pages if possible
+    char* map_region(size_t len);
+
+    static uint64_t hash_path(const char *path, size_t len);
+
+    File *m_files;
+    int m_file_count;
+    int m_file_capacity;
+
+    char *m_region;
+    size_t m_region_len;
+
+    // how the region is backed, for the report
+    const char *m_backing;
+
+    // open addressing with linear probing, at most half full
+    Slot *m_slots;
+    uint64_t m_mask;
+};
+
+// the file made by Asset_bundle::pack(), in the byte order of the machine that made it
+// header | index sorted by path | paths | for each file, its headers ending right where its body starts
+// the bodies start on a page, so sending one touches no page of another file
+struct Bundle_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t index_offset;
+    uint64_t size;
+};
+
+struct Bundle_entry
+{
+    uint64_t path_offset;
+    uint32_t path_len;
+
+    // the entity tag, counted from the start of the headers
+    uint32_t etag_offset;
+    uint32_t etag_len;
+    uint32_t head_len;
+
+    // the headers start at data_offset, the body at data_offset + head_len
+    uint64_t data_offset;
+    uint64_t body_len;
+};
+
+// class Asset_bundle serves the files of a bundle packed at build time
+// opening it is one mmap(), the index is searched where it lies and the pages come from the page cache
+class Asset_bundle
+{
+public:
+    static const uint32_t VERSION = 1;
+    static const char MAGIC[8];
+
+    Asset_bundle();
+
+    ~Asset_bundle();
+
+    // pack the files under doc_root into the bundle at path
+    static bool pack(const char *doc_root, const char *path);
+
+    // map the bundle at path and check its header
+    bool open(const char *path);
+
+    // the asset of url, false if url is not in the bundle
+    bool find(const char *url, Asset *asset) const;
+
+private:
+    // the MIME type of path from its extension
+    static const char* mime_type(const char *path);
+
+    const char *m_base;
+    size_t m_size;
+    const Bundle_entry *m_index;
+    uint32_t m_count;
+};
+
+#endif
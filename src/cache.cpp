@@ -0,0 +1,289 @@
+#include "cache.h"
+
+// definition is in http_conn.cpp
+extern void modfd(int epollfd, int fd, int ev, uint64_t data);
+
+Response_cache::Response_cache(long capacity) {
+    long per_shard = capacity / SHARDS;
+    m_capacity = per_shard > 0x7fffffff ? 0x7fffffff : per_shard;
+    for (int i = 0; i < SHARDS; ++i) {
+        memset(m_shards[i].buckets, 0, sizeof(m_shards[i].buckets));
+        m_shards[i].lru_head = NULL;
+        m_shards[i].lru_tail = NULL;
+        m_shards[i].bytes = 0;
+    }
+}
+
+Response_cache::~Response_cache() {
+    for (int i = 0; i < SHARDS; ++i) {
+        for (int j = 0; j < BUCKETS; ++j) {
+            Cache_entry *entry = m_shards[i].buckets[j];
+            while (entry) {
+                Cache_entry *next = entry->next;
+                wake(entry->waiters);
+                entry->next = NULL;
+                destroy(entry);
+                entry = next;
+            }
+        }
+    }
+}
+
+int Response_cache::make_key(char *buf, int size, const char *method, const char *host, const char *path, const char *query) {
+    int len = snprintf(buf, size, "%s %s %s%s%s", method, host ? host : "", path, query ? "?" : "", query ? query : "");
+    return (len < size) ? len : -1;
+}
+
+int Response_cache::max_entry() const {
+    // one response never takes more than an eighth of its shard
+    return m_capacity / 8;
+}
+
+// FNV-1a
+uint64_t Response_cache::hash_key(const char *key, int key_len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < key_len; ++i) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+Cache_entry* Response_cache::find(Shard& shard, uint64_t hash, const char *key, int key_len) const {
+    // the low bits choose the shard, the next ones the bucket
+    Cache_entry *entry = shard.buckets[(hash / SHARDS) % BUCKETS];
+    while (entry) {
+        if (entry->hash == hash && entry->key_len == key_len && memcmp(entry->key, key, key_len) == 0) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+    return NULL;
+}
+
+Response_cache::LOOKUP Response_cache::lookup(const char *key, int key_len, Cache_entry **entry, int epollfd, int fd, uint64_t data) {
+    uint64_t hash = hash_key(key, key_len);
+    int index = hash % SHARDS;
+    Shard& shard = m_shards[index];
+    time_t now = time(NULL);
+    Cache_entry *garbage = NULL;
+    LOOKUP ret;
+
+    shard.locker.lock();
+    Cache_entry *found = find(shard, hash, key, key_len);
+    if (found && found->state != Cache_entry::PENDING && found->expires <= now) {
+        // stale, it is fetched again
+        if (unlink(shard, found)) {
+            found->next = NULL;
+            garbage = found;
+        }
+        found = NULL;
+    }
+
+    if (!found) {
+        // the first miss fetches the response, the misses after it wait
+        Cache_entry *e = (Cache_entry*)malloc(sizeof(Cache_entry) + key_len + 1);
+        if (!e) {
+            ret = PASS;
+        } else {
+            memset(e, 0, sizeof(Cache_entry));
+            e->state = Cache_entry::PENDING;
+            e->key = (char*)(e + 1);
+            memcpy(e->key, key, key_len);
+            e->key[key_len] = '\0';
+            e->key_len = key_len;
+            e->hash = hash;
+            e->shard = index;
+            e->refs = 1;
+            e->linked = true;
+
+            Cache_entry **bucket = &shard.buckets[(hash / SHARDS) % BUCKETS];
+            e->next = *bucket;
+            *bucket = e;
+
+            *entry = e;
+            ret = MISS;
+        }
+    } else if (found->state == Cache_entry::PENDING) {
+        Cache_waiter *waiter = (Cache_waiter*)malloc(sizeof(Cache_waiter));
+        if (!waiter) {
+            ret = PASS;
+        } else {
+            waiter->epollfd = epollfd;
+            waiter->fd = fd;
+            waiter->data = data;
+            waiter->next = found->waiters;
+            found->waiters = waiter;
+            ret = WAIT;
+        }
+    } else if (found->state == Cache_entry::PASS) {
+        ret = PASS;
+    } else {
+        ++found->refs;
+        lru_remove(shard, found);
+        found->lru_prev = NULL;
+        found->lru_next = shard.lru_head;
+        if (shard.lru_head) {
+            shard.lru_head->lru_prev = found;
+        } else {
+            shard.lru_tail = found;
+        }
+        shard.lru_head = found;
+        *entry = found;
+        ret = HIT;
+    }
+    shard.locker.unlock();
+
+    destroy(garbage);
+    return ret;
+}
+
+void Response_cache::fill(Cache_entry *entry, const char *head, int head_len, const char *body, int body_len, int max_age) {
+    const char *status_end = (const char*)memchr(head, '\n', head_len);
+    if (max_age <= 0 || !status_end || head_len + body_len > max_entry()) {
+        abandon(entry, true);
+        return;
+    }
+
+    // the response is serialized once, every hit sends it as it is
+    char *data = (char*)malloc(head_len + body_len + 64);
+    if (!data) {
+        abandon(entry, false);
+        return;
+    }
+    memcpy(data, head, head_len);
+    int len = head_len + sprintf(data + head_len, "Content-Length: %d\r\n\r\n", body_len);
+    memcpy(data + len, body, body_len);
+    len += body_len;
+
+    Shard& shard = m_shards[entry->shard];
+    time_t now = time(NULL);
+
+    shard.locker.lock();
+    entry->data = data;
+    entry->len = len;
+    entry->status_len = status_end + 1 - head;
+    entry->stored = now;
+    entry->expires = now + max_age;
+    entry->state = Cache_entry::READY;
+    Cache_waiter *waiters = entry->waiters;
+    entry->waiters = NULL;
+    Cache_entry *garbage = charge(shard, entry);
+    --entry->refs;
+    shard.locker.unlock();
+
+    destroy(garbage);
+    wake(waiters);
+}
+
+void Response_cache::abandon(Cache_entry *entry, bool pass) {
+    Shard& shard = m_shards[entry->shard];
+    Cache_entry *garbage = NULL;
+
+    shard.locker.lock();
+    Cache_waiter *waiters = entry->waiters;
+    entry->waiters = NULL;
+    if (pass) {
+        // the waiters and the requests coming soon fetch it by themselves, one by one would be too slow
+        entry->state = Cache_entry::PASS;
+        entry->expires = time(NULL) + PASS_SECONDS;
+        garbage = charge(shard, entry);
+    } else {
+        // a failed fetch is tried again by the first waiter
+        unlink(shard, entry);
+    }
+    if (--entry->refs == 0 && !entry->linked) {
+        entry->next = garbage;
+        garbage = entry;
+    }
+    shard.locker.unlock();
+
+    destroy(garbage);
+    wake(waiters);
+}
+
+void Response_cache::release(Cache_entry *entry) {
+    Shard& shard = m_shards[entry->shard];
+
+    shard.locker.lock();
+    bool dead = (--entry->refs == 0) && !entry->linked;
+    shard.locker.unlock();
+
+    if (dead) {
+        entry->next = NULL;
+        destroy(entry);
+    }
+}
+
+Cache_entry* Response_cache::charge(Shard& shard, Cache_entry *entry) {
+    entry->cost = sizeof(Cache_entry) + entry->key_len + entry->len;
+    shard.bytes += entry->cost;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = shard.lru_head;
+    if (shard.lru_head) {
+        shard.lru_head->lru_prev = entry;
+    } else {
+        shard.lru_tail = entry;
+    }
+    shard.lru_head = entry;
+
+    // entries still being sent are unlinked now and freed by their last release()
+    Cache_entry *garbage = NULL;
+    while (shard.bytes > m_capacity && shard.lru_tail != entry) {
+        Cache_entry *victim = shard.lru_tail;
+        if (unlink(shard, victim)) {
+            victim->next = garbage;
+            garbage = victim;
+        }
+    }
+    return garbage;
+}
+
+bool Response_cache::unlink(Shard& shard, Cache_entry *entry) {
+    Cache_entry **p = &shard.buckets[(entry->hash / SHARDS) % BUCKETS];
+    while (*p != entry) {
+        p = &(*p)->next;
+    }
+    *p = entry->next;
+
+    if (entry->state != Cache_entry::PENDING) {
+        lru_remove(shard, entry);
+        shard.bytes -= entry->cost;
+    }
+    entry->linked = false;
+    return entry->refs == 0;
+}
+
+void Response_cache::lru_remove(Shard& shard, Cache_entry *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard.lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard.lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+void Response_cache::destroy(Cache_entry *entries) {
+    while (entries) {
+        Cache_entry *next = entries->next;
+        free(entries->data);
+        free(entries);
+        entries = next;
+    }
+}
+
+void Response_cache::wake(Cache_waiter *waiters) {
+    while (waiters) {
+        Cache_waiter *next = waiters->next;
+        modfd(waiters->epollfd, waiters->fd, EPOLLOUT, waiters->data);
+        free(waiters);
+        waiters = next;
+    }
+}
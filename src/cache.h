@@ -0,0 +1,147 @@
+#ifndef __CACHE__H
+#define __CACHE__H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "locker.h"
+
+// a client waiting for a response that another request is fetching
+struct Cache_waiter
+{
+    int epollfd;
+    int fd;
+    uint64_t data;
+    Cache_waiter *next;
+};
+
+// one cached response, or a marker for a response being fetched or not cacheable
+struct Cache_entry
+{
+    // READY: data holds the response
+    // PENDING: the response is being fetched, waiters get EPOLLOUT when it is done
+    // PASS: the response cannot be cached, requests go around the cache until it expires
+    enum STATE {READY = 0, PENDING, PASS};
+
+    STATE state;
+
+    // the serialized response, from the status line to the end of the body
+    char *data;
+    int len;
+
+    // length of the status line with its CRLF, the rest of data is sent as it is
+    int status_len;
+
+    // when the response was stored and when it becomes stale
+    time_t stored;
+    time_t expires;
+
+    // "method host url", stored right after the entry
+    char *key;
+    int key_len;
+    uint64_t hash;
+    int shard;
+
+    // clients sending the response, the entry is freed when it is unlinked and unused
+    int refs;
+    bool linked;
+
+    // bytes charged to the shard
+    int cost;
+
+    Cache_waiter *waiters;
+
+    // chain of the hash bucket
+    Cache_entry *next;
+
+    // least recently used list of the shard, PENDING entries are not in it
+    Cache_entry *lru_prev;
+    Cache_entry *lru_next;
+};
+
+// class Response_cache keeps whole responses in memory, up to capacity bytes
+// it is split into shards, each with its own locker, hash table and LRU list
+// concurrent misses of the same key are collapsed: the first one fetches, the others wait for it
+class Response_cache
+{
+public:
+    static const int SHARDS = 16;
+    static const int BUCKETS = 1024;
+    static const int KEY_LEN = 1024;
+
+    // seconds requests for a response that cannot be cached go around the cache
+    static const int PASS_SECONDS = 10;
+
+    // HIT: *entry holds the response, release() it once it is sent
+    // MISS: the caller fetches the response and hands *entry to fill() or abandon()
+    // WAIT: the response is being fetched, fd gets EPOLLOUT with data in epollfd when it is done
+    // PASS: the response cannot be cached, fetch it without the cache
+    enum LOOKUP {HIT = 0, MISS, WAIT, PASS};
+
+    Response_cache(long capacity);
+
+    ~Response_cache();
+
+    // build the key of a request into buf, return its length, or -1 if it does not fit
+    // query is NULL when the request has none
+    static int make_key(char *buf, int size, const char *method, const char *host, const char *path, const char *query);
+
+    LOOKUP lookup(const char *key, int key_len, Cache_entry **entry, int epollfd, int fd, uint64_t data);
+
+    // store the response fetched for a MISS, fresh for max_age seconds
+    // head is the status line and the headers, without Content-Length and without the blank line
+    void fill(Cache_entry *entry, const char *head, int head_len, const char *body, int body_len, int max_age);
+
+    // the response fetched for a MISS is not stored
+    // with pass, the requests for it go around the cache for PASS_SECONDS
+    void abandon(Cache_entry *entry, bool pass);
+
+    // a client has sent the response of a HIT
+    void release(Cache_entry *entry);
+
+    // largest response that is stored
+    int max_entry() const;
+
+private:
+    struct Shard
+    {
+        Locker locker;
+        Cache_entry *buckets[BUCKETS];
+
+        // most recently used first
+        Cache_entry *lru_head;
+        Cache_entry *lru_tail;
+
+        int bytes;
+    };
+
+    static uint64_t hash_key(const char *key, int key_len);
+
+    Cache_entry* find(Shard& shard, uint64_t hash, const char *key, int key_len) const;
+
+    // link a READY or PASS entry into the LRU list and unlink the least recently used ones over the capacity
+    // return the unlinked entries nothing uses any more, chained by next
+    Cache_entry* charge(Shard& shard, Cache_entry *entry);
+
+    // remove the entry from the shard, return whether nothing uses it any more
+    bool unlink(Shard& shard, Cache_entry *entry);
+
+    void lru_remove(Shard& shard, Cache_entry *entry);
+
+    // free the entries chained by next, after the locker is released
+    static void destroy(Cache_entry *entries);
+
+    // give EPOLLOUT to the waiters and free them
+    static void wake(Cache_waiter *waiters);
+
+    Shard m_shards[SHARDS];
+
+    // bytes per shard
+    int m_capacity;
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+
+#include "cluster.h"
+
+Cluster::Cluster(int workers, int listenfd, File_cache *files) :
+m_workers(workers), m_listenfd(listenfd), m_files(files), m_master(getpid()), m_running(0), m_stopping(false) {
+    for (int i = 0; i < MAX_WORKERS; ++i) {
+        m_pids[i] = 0;
+        m_started_ms[i] = 0;
+        m_restart_ms[i] = 0;
+    }
+}
+
+uint64_t Cluster::now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+int Cluster::run(int channel) {
+    // the master takes its signals with sigtimedwait(), the workers get the mask they had back
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, &m_old_mask);
+
+    for (int i = 0; i < m_workers; ++i) {
+        if (!spawn(i)) {
+            if (channel >= 0) {
+                close(channel);
+            }
+            return i;
+        }
+    }
+    printf("cluster: master %d, %d workers\n", m_master, m_workers);
+
+    if (channel >= 0) {
+        // tell the old binary that it can stop accepting
+        write(channel, "1", 1);
+        close(channel);
+    }
+
+    while (!m_stopping || m_running > 0) {
+        // woken up regularly to restart the workers whose delay has passed
+        struct timespec tick = {0, 100000000};
+        siginfo_t info;
+        int sig = sigtimedwait(&set, &info, &tick);
+        switch (sig) {
+            case SIGCHLD : {
+                reap();
+                break;
+            }
+            case SIGTERM :
+            case SIGINT : {
+                // asked twice, the workers do not wait for their connections any more
+                // the socket is closed once the workers have closed theirs, new clients are refused
+                if (!m_stopping) {
+                    close(m_listenfd);
+                    m_listenfd = -1;
+                }
+                m_stopping = true;
+                signal_workers(sig);
+                break;
+            }
+            case SIGHUP :
+            case SIGUSR1 : {
+                signal_workers(sig);
+                break;
+            }
+            case SIGUSR2 : {
+                printf("upgrade: not supported with workers, the new binary is started after the cluster stops\n");
+                break;
+            }
+        }
+        fflush(stdout);
+
+        uint64_t now = now_ms();
+        for (int i = 0; i < m_workers && !m_stopping; ++i) {
+            if (m_restart_ms[i] != 0 && m_restart_ms[i] <= now && !spawn(i)) {
+                return i;
+            }
+        }
+    }
+
+    printf("cluster: the workers have exited\n");
+    sigprocmask(SIG_SETMASK, &m_old_mask, NULL);
+    return -1;
+}
+
+bool Cluster::spawn(int i) {
+    // what is buffered would be written by the worker too
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // the worker drains when the master dies, however it dies
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != m_master) {
+            _exit(0);
+        }
+        sigprocmask(SIG_SETMASK, &m_old_mask, NULL);
+        return false;
+    }
+
+    m_restart_ms[i] = 0;
+    if (pid < 0) {
+        printf("cluster: cannot fork worker %d: %s\n", i, strerror(errno));
+        m_restart_ms[i] = now_ms() + RESTART_DELAY_MS;
+        return true;
+    }
+    m_pids[i] = pid;
+    m_started_ms[i] = now_ms();
+    ++m_running;
+    Stats::set(Stats::m_segment->processes, m_running);
+    return true;
+}
+
+void Cluster::reap() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        int i = 0;
+        while (i < m_workers && m_pids[i] != pid) {
+            ++i;
+        }
+        if (i == m_workers) {
+            continue;
+        }
+        m_pids[i] = 0;
+        --m_running;
+        Stats::set(Stats::m_segment->processes, m_running);
+
+        // what the worker held is given back, its connections are gone with it
+        Stats::forget(i);
+        if (m_files) {
+            m_files->forget(i);
+        }
+        if (m_stopping) {
+            continue;
+        }
+
+        if (WIFSIGNALED(status)) {
+            printf("cluster: worker %d (pid %d) killed by signal %d\n", i, pid, WTERMSIG(status));
+        } else {
+            printf("cluster: worker %d (pid %d) exited with status %d\n", i, pid, WEXITSTATUS(status));
+        }
+        uint64_t now = now_ms();
+        m_restart_ms[i] = now - m_started_ms[i] < (uint64_t)RESTART_DELAY_MS ? now + RESTART_DELAY_MS : now;
+    }
+}
+
+void Cluster::signal_workers(int sig) {
+    for (int i = 0; i < m_workers; ++i) {
+        if (m_pids[i] > 0) {
+            kill(m_pids[i], sig);
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef __CLUSTER__H
+#define __CLUSTER__H
+
+#include <sys/types.h>
+#include <signal.h>
+#include <stdint.h>
+
+#include "file_cache.h"
+#include "stats.h"
+
+// prefork cluster mode
+// the master binds the port and forks the workers, each one runs the event loops and the thread pool
+// on the listening socket it inherits, EPOLLEXCLUSIVE wakes one of them per connection
+// the master serves nothing: it restarts a worker that dies, passes SIGTERM, SIGINT, SIGHUP and SIGUSR1 on,
+// and exits once the workers have drained
+// the workers share the stats segment and the file cache, both are mapped before they are forked
+class Cluster
+{
+public:
+    static const int MAX_WORKERS = FILE_CACHE_PROCESSES < STATS_PROCESSES ? FILE_CACHE_PROCESSES : STATS_PROCESSES;
+
+    // a worker dying sooner than this after its start is restarted only after the same time, so a worker
+    // that cannot start does not fork in a loop
+    static const int RESTART_DELAY_MS = 1000;
+
+    // listenfd is the listening socket the workers inherit, the master closes its copy once it stops,
+    // files is NULL without the file cache
+    Cluster(int workers, int listenfd, File_cache *files);
+
+    // fork the workers, return the index of the worker in each of them
+    // the master supervises them until they have exited after SIGTERM or SIGINT, then returns -1
+    // channel is the upgrade channel of a new binary, the master acknowledges once the workers are forked
+    int run(int channel);
+
+private:
+    // fork worker i, true in the master, false in the worker
+    bool spawn(int i);
+
+    // reap the workers that have exited, and note when to restart them
+    void reap();
+
+    // pass sig on to the running workers
+    void signal_workers(int sig);
+
+    static uint64_t now_ms();
+
+    int m_workers;
+    int m_listenfd;
+    File_cache *m_files;
+    pid_t m_master;
+
+    pid_t m_pids[MAX_WORKERS];
+    uint64_t m_started_ms[MAX_WORKERS];
+
+    // when a dead worker is restarted, 0 while it runs
+    uint64_t m_restart_ms[MAX_WORKERS];
+
+    int m_running;
+    bool m_stopping;
+
+    // the signal mask of the workers, the master blocks the signals it waits for
+    sigset_t m_old_mask;
+};
+
+#endif
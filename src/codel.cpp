@@ -0,0 +1,47 @@
+#include "codel.h"
+
+Codel::Codel(int target_us, int interval_us) :
+m_target_us(target_us),
+m_interval_us(interval_us),
+m_interval_end(0),
+m_min_delay(UINT64_MAX),
+m_overloaded(false),
+m_shed(0) {}
+
+uint64_t Codel::now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool Codel::on_dequeue(uint64_t delay_us, uint64_t now_us) {
+    if (delay_us < m_min_delay) {
+        m_min_delay = delay_us;
+    }
+
+    if (now_us >= m_interval_end) {
+        // judge the interval that has just ended by its shortest delay
+        bool overloaded = m_min_delay > m_target_us;
+        if (overloaded != m_overloaded) {
+            printf("overload: %s, %lu requests shed so far\n", overloaded ? "shedding" : "recovered", (unsigned long)m_shed);
+        }
+        m_overloaded = overloaded;
+        m_interval_end = now_us + m_interval_us;
+        m_min_delay = UINT64_MAX;
+    }
+
+    // while overloaded, a task that waited twice the target is not worth processing any more
+    return m_overloaded && delay_us > 2 * m_target_us;
+}
+
+bool Codel::overloaded() const {
+    return m_overloaded;
+}
+
+void Codel::count_shed() {
+    ++m_shed;
+}
+
+uint64_t Codel::shed_count() const {
+    return m_shed;
+}
@@ -0,0 +1,49 @@
+#ifndef __CODEL__H
+#define __CODEL__H
+
+#include <stdint.h>
+#include <time.h>
+#include <stdio.h>
+
+// class Codel decides when the thread pool is overloaded, following the CoDel idea:
+// the queue is overloaded if even the shortest wait seen during an interval is above the target,
+// a burst that drains quickly never triggers it, a standing queue always does
+// it is not thread safe, the thread pool calls it with the queue locked
+class Codel
+{
+public:
+    // target of the queueing delay and length of the interval, in microseconds
+    Codel(int target_us = 5000, int interval_us = 100000);
+
+    // called when a task leaves the queue after waiting delay_us
+    // return whether the task should be shed instead of processed
+    bool on_dequeue(uint64_t delay_us, uint64_t now_us);
+
+    // whether new tasks should be refused
+    bool overloaded() const;
+
+    // count one task refused or shed
+    void count_shed();
+
+    // number of tasks refused or shed so far
+    uint64_t shed_count() const;
+
+    // monotonic time in microseconds
+    static uint64_t now_us();
+
+private:
+    uint64_t m_target_us;
+    uint64_t m_interval_us;
+
+    // end of the current interval
+    uint64_t m_interval_end;
+
+    // the shortest delay seen in the current interval
+    uint64_t m_min_delay;
+
+    bool m_overloaded;
+
+    uint64_t m_shed;
+};
+
+#endif
@@ -0,0 +1,399 @@
+#include "config.h"
+#include "affinity.h"
+
+#define SETTING(name, type, min, reloadable, help) \
+    {#name, Config::Setting::type, offsetof(Config, name), min, reloadable, help}
+
+const Config::Setting Config::m_settings[] = {
+    SETTING(port, INT, 1, false, "the port listened"),
+    SETTING(doc_root, PATH, 0, true, "the root path of the webpage"),
+    SETTING(thread_number, INT, 0, false, "threads of the thread pool, 0 for the number of cores"),
+    SETTING(thread_min, INT, 0, false, "fewest threads the thread pool shrinks to when idle, 0 for thread_number"),
+    SETTING(thread_max, INT, 0, false, "most threads the thread pool grows to when requests wait, 0 for thread_number"),
+    SETTING(reactor_number, INT, 0, false, "threads running an epoll loop, 0 for the number of cores"),
+    SETTING(workers, INT, 0, false, "worker processes forked by a master, each with its event loops and thread pool, 0 serves in this process"),
+    SETTING(cpu_affinity, BOOL, 0, false, "pin the event loops and the workers to cpus"),
+    SETTING(reactor_cpus, STRING, 0, false, "cpus of the event loops, as 0-3,8"),
+    SETTING(worker_cpus, STRING, 0, false, "cpus of the workers, as 0-3,8"),
+    SETTING(max_requests, INT, 1, false, "the maximum number of requests in the queue"),
+    SETTING(max_conns, INT, 16, false, "the maximum number of connections at once"),
+    SETTING(max_event_number, INT, 1, false, "events taken by one epoll_wait()"),
+    SETTING(read_buffer_size, INT, 256, false, "size of the reading buffer of a connection"),
+    SETTING(write_buffer_size, INT, 256, false, "size of the writing buffer of a connection"),
+    SETTING(read_budget, INT, 0, true, "bytes read from a connection per event before the others get their turn, 0 for no limit"),
+    SETTING(listen_backlog, INT, 1, false, "backlog of the listening socket"),
+    SETTING(tcp_nodelay, BOOL, 0, true, "set TCP_NODELAY on the connections"),
+    SETTING(tcp_cork, BOOL, 0, true, "cork the connections while a response is written"),
+    SETTING(tcp_defer_accept, INT, 0, false, "seconds of TCP_DEFER_ACCEPT, 0 to turn it off"),
+    SETTING(busy_poll, INT, 0, true, "microseconds the kernel busy polls the device queue of a connection, 0 to turn it off"),
+    SETTING(spin_us, INT, 0, false, "longest spin of an idle event loop or worker before it sleeps, 0 to turn it off"),
+    SETTING(io_threads, INT, 0, false, "threads reading the files that are not in memory for the event loops, 0 lets the loops wait for the disk"),
+    SETTING(io_window, INT, 4096, true, "bytes of a file checked to be in memory, or read by the disk threads, at a time"),
+    SETTING(limit_table_size, INT, 1, false, "number of source IPs tracked at the same time"),
+    SETTING(limit_ip_conns, INT, 0, true, "concurrent connections of one source IP, 0 for no limit"),
+    SETTING(limit_ip_rate, INT, 0, true, "requests per second of one source IP, 0 for no limit"),
+    SETTING(limit_ip_burst, INT, 0, true, "burst of requests of one source IP"),
+    SETTING(limit_global_rate, INT, 0, true, "new connections per second of all clients, 0 for no limit"),
+    SETTING(limit_global_burst, INT, 0, true, "burst of new connections of all clients"),
+    SETTING(overload_target_us, INT, 1, false, "queueing delay in microseconds above which requests are shed"),
+    SETTING(overload_interval_us, INT, 1, false, "interval in microseconds the queueing delay is judged over"),
+    SETTING(drain_timeout, INT, 0, true, "seconds the in-flight connections get to finish on shutdown"),
+    SETTING(proxy, STRING, 0, false, "path prefixes forwarded to upstreams, as /api/=host:port,host:port;/app/=host:port"),
+    SETTING(proxy_keepalive, INT, 0, false, "idle keep-alive connections kept per upstream"),
+    SETTING(proxy_timeout, INT, 0, true, "seconds an upstream gets to connect and for every read before the client gets 502, 0 for no limit"),
+    SETTING(health_path, STRING, 0, false, "path answering ok while the server accepts requests, 503 while it drains, empty to turn it off"),
+    SETTING(stats_path, STRING, 0, false, "path answering the metrics printed by SIGUSR1, empty to turn it off"),
+    SETTING(trace_sample, INT, 0, true, "trace one request in this many, 0 turns tracing off"),
+    SETTING(trace_path, STRING, 0, false, "path answering the trace of the sampled requests as Chrome trace JSON, empty to turn it off"),
+    SETTING(trace_file, PATH, 0, true, "file SIGUSR1 writes the trace to, empty to write none"),
+    SETTING(stats_shm, STRING, 0, false, "shared memory segment the counters are published in, read by server --top NAME, empty to keep them private"),
+    SETTING(cache_size, INT, 0, false, "megabytes of proxied responses kept in memory, 0 turns the cache off"),
+    SETTING(file_cache_size, INT, 0, false, "megabytes of small files kept in memory shared by the worker processes, 0 turns it off"),
+    SETTING(preload, BOOL, 0, false, "load every file under doc_root into memory at startup, later changes are not seen"),
+    SETTING(bundle, PATH, 0, false, "bundle made by --pack, its files are served before doc_root"),
+    SETTING(vhosts, PATH, 0, false, "file of the sites served by name, one \"name root [preload] [bundle=FILE] [rate=N] [burst=N] [ip_rate=N] [ip_burst=N]\" per line"),
+    SETTING(coroutines, BOOL, 0, false, "serve the connections as coroutines in the event loops, needs a C++20 build"),
+};
+
+const int Config::m_setting_count = sizeof(m_settings) / sizeof(m_settings[0]);
+
+std::atomic<const Config*> Config::m_current(NULL);
+
+Config::Config() {
+    port = 0;
+    strcpy(doc_root, "./resources");
+    config_file[0] = '\0';
+    thread_number = 0;
+    thread_min = 0;
+    thread_max = 0;
+    reactor_number = 1;
+    workers = 0;
+    cpu_affinity = false;
+    reactor_cpus[0] = '\0';
+    worker_cpus[0] = '\0';
+    max_requests = 10000;
+    max_conns = 65536;
+    max_event_number = 10000;
+    read_buffer_size = 2048;
+    write_buffer_size = 1024;
+    read_budget = 16384;
+    listen_backlog = 1024;
+    tcp_nodelay = false;
+    tcp_cork = false;
+    tcp_defer_accept = 0;
+    busy_poll = 0;
+    spin_us = 0;
+    io_threads = 2;
+    io_window = 1 << 20;
+    limit_table_size = 65536;
+    limit_ip_conns = 8192;
+    limit_ip_rate = 20000;
+    limit_ip_burst = 40000;
+    limit_global_rate = 0;
+    limit_global_burst = 0;
+    overload_target_us = 5000;
+    overload_interval_us = 100000;
+    drain_timeout = 30;
+    proxy[0] = '\0';
+    proxy_keepalive = 32;
+    proxy_timeout = 30;
+    health_path[0] = '\0';
+    stats_path[0] = '\0';
+    trace_sample = 0;
+    trace_path[0] = '\0';
+    trace_file[0] = '\0';
+    stats_shm[0] = '\0';
+    cache_size = 64;
+    file_cache_size = 0;
+    preload = false;
+    bundle[0] = '\0';
+    coroutines = false;
+    vhosts[0] = '\0';
+}
+
+const Config::Setting* Config::find(const char *name) {
+    // the command line spells the names with '-'
+    char key[64];
+    int len = 0;
+    for ( ; name[len] && len < (int)sizeof(key) - 1; ++len) {
+        key[len] = (name[len] == '-') ? '_' : name[len];
+    }
+    key[len] = '\0';
+
+    for (int i = 0; i < m_setting_count; ++i) {
+        if (strcmp(m_settings[i].name, key) == 0) {
+            return m_settings + i;
+        }
+    }
+    return NULL;
+}
+
+bool Config::set(const char *name, const char *value) {
+    const Setting *setting = find(name);
+    if (!setting) {
+        printf("config: unknown setting %s\n", name);
+        return false;
+    }
+
+    char *field = (char*)this + setting->offset;
+    switch (setting->type) {
+        case Setting::INT : {
+            char *end;
+            long v = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || v < setting->min || v > INT_MAX) {
+                printf("config: invalid value %s for %s\n", value, setting->name);
+                return false;
+            }
+            *(int*)field = (int)v;
+            break;
+        }
+        case Setting::BOOL : {
+            if (strcmp(value, "1") == 0 || strcasecmp(value, "on") == 0 || strcasecmp(value, "true") == 0) {
+                *(bool*)field = true;
+            } else if (strcmp(value, "0") == 0 || strcasecmp(value, "off") == 0 || strcasecmp(value, "false") == 0) {
+                *(bool*)field = false;
+            } else {
+                printf("config: invalid value %s for %s\n", value, setting->name);
+                return false;
+            }
+            break;
+        }
+        case Setting::PATH :
+        case Setting::STRING : {
+            if (strlen(value) >= PATH_LEN) {
+                printf("config: %s is too long\n", setting->name);
+                return false;
+            }
+            strcpy(field, value);
+            break;
+        }
+    }
+    return true;
+}
+
+bool Config::load_file(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        printf("config: cannot open %s\n", path);
+        return false;
+    }
+
+    char line[512];
+    int line_number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), fp)) {
+        ++line_number;
+
+        // cut the comment and the blanks around name and value
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *name = line + strspn(line, " \t\r\n");
+        if (*name == '\0') {
+            continue;
+        }
+
+        char *value = strchr(name, '=');
+        if (!value) {
+            printf("config: %s:%d: expected name = value\n", path, line_number);
+            ok = false;
+            continue;
+        }
+        *value++ = '\0';
+        value += strspn(value, " \t");
+
+        for (char *end = name + strlen(name); end > name && strchr(" \t", end[-1]); ) {
+            *--end = '\0';
+        }
+        for (char *end = value + strlen(value); end > value && strchr(" \t\r\n", end[-1]); ) {
+            *--end = '\0';
+        }
+
+        if (!set(name, value)) {
+            printf("config: %s:%d\n", path, line_number);
+            ok = false;
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+bool Config::apply_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+
+        // a bare number is the port, as in "server port_number"
+        if (arg[0] != '-') {
+            if (!set("port", arg)) {
+                return false;
+            }
+            continue;
+        }
+
+        const char *name = NULL;
+        const char *value = NULL;
+        if (arg[1] != '-' && arg[1] != '\0' && arg[2] == '\0') {
+            // short options
+            switch (arg[1]) {
+                case 'p' : name = "port"; break;
+                case 'r' : name = "doc_root"; break;
+                case 't' : name = "thread_number"; break;
+                case 'c' : name = "config"; break;
+                default : {
+                    printf("unknown option %s\n", arg);
+                    return false;
+                }
+            }
+        } else if (arg[1] == '-') {
+            // --name=value, --name value, or --name for a BOOL
+            static char key[64];
+            const char *eq = strchr(arg + 2, '=');
+            int len = eq ? eq - arg - 2 : strlen(arg + 2);
+            if (len >= (int)sizeof(key)) {
+                printf("unknown option %s\n", arg);
+                return false;
+            }
+            memcpy(key, arg + 2, len);
+            key[len] = '\0';
+            name = key;
+            if (eq) {
+                value = eq + 1;
+            } else {
+                const Setting *setting = find(name);
+                if (setting && setting->type == Setting::BOOL) {
+                    value = "1";
+                }
+            }
+        } else {
+            printf("unknown option %s\n", arg);
+            return false;
+        }
+
+        if (!value) {
+            if (i + 1 >= argc) {
+                printf("option %s needs a value\n", arg);
+                return false;
+            }
+            value = argv[++i];
+        }
+
+        // the config file has been loaded before
+        if (strcmp(name, "config") == 0) {
+            continue;
+        }
+        if (!set(name, value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Config::load(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            usage(argv[0]);
+            return false;
+        }
+
+        // the file comes first so the command line can override it
+        const char *path = NULL;
+        if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) && i + 1 < argc) {
+            path = argv[++i];
+        } else if (strncmp(argv[i], "--config=", 9) == 0) {
+            path = argv[i] + 9;
+        }
+        if (path) {
+            if (strlen(path) >= PATH_LEN || !load_file(path)) {
+                return false;
+            }
+            strcpy(config_file, path);
+        }
+    }
+
+    if (!apply_args(argc, argv)) {
+        return false;
+    }
+    return finish();
+}
+
+bool Config::finish() {
+    if (port == 0) {
+        printf("config: no port given\n");
+        return false;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        cores = 1;
+    }
+    if (thread_number == 0) {
+        thread_number = cores;
+    }
+    if (reactor_number == 0) {
+        reactor_number = cores;
+    }
+
+    // a spinning thread on the only cpu holds off the thread it waits for
+    if (spin_us > 0 && cores < 2) {
+        printf("config: spin_us needs more than one cpu, turned off\n");
+        spin_us = 0;
+    }
+
+    int cpus[CPU_SETSIZE];
+    if (parse_cpu_list(reactor_cpus, cpus, CPU_SETSIZE) < 0 || parse_cpu_list(worker_cpus, cpus, CPU_SETSIZE) < 0) {
+        printf("config: invalid cpu list\n");
+        return false;
+    }
+
+    // the threads may resolve relative paths after a chdir, keep them absolute
+    char path[PATH_MAX];
+    if (!realpath(doc_root, path) || strlen(path) >= PATH_LEN) {
+        printf("config: invalid doc_root %s\n", doc_root);
+        return false;
+    }
+    strcpy(doc_root, path);
+    return true;
+}
+
+void Config::usage(const char *prog) {
+    printf("usage: %s [options] [port_number]\n", prog);
+    printf("  -p, --port N          the port listened\n");
+    printf("  -r, --doc-root DIR    the root path of the webpage\n");
+    printf("  -t, --thread-number N threads of the thread pool\n");
+    printf("  -c, --config FILE     read the settings from FILE, the options override it\n");
+    printf("  --pack DIR FILE       pack the files under DIR into the bundle FILE and exit\n");
+    printf("every setting of the file is also an option --name=value:\n");
+    for (int i = 0; i < m_setting_count; ++i) {
+        printf("  %-22s %s%s\n", m_settings[i].name, m_settings[i].help, m_settings[i].reloadable ? "" : " (restart)");
+    }
+}
+
+void Config::report_restart_needed(const Config& old) const {
+    for (int i = 0; i < m_setting_count; ++i) {
+        const Setting& s = m_settings[i];
+        if (s.reloadable) {
+            continue;
+        }
+        const char *a = (const char*)this + s.offset;
+        const char *b = (const char*)&old + s.offset;
+        bool changed = false;
+        switch (s.type) {
+            case Setting::INT : changed = *(const int*)a != *(const int*)b; break;
+            case Setting::BOOL : changed = *(const bool*)a != *(const bool*)b; break;
+            case Setting::PATH :
+            case Setting::STRING : changed = strcmp(a, b) != 0; break;
+        }
+        if (changed) {
+            printf("reload: %s changes after a restart\n", s.name);
+        }
+    }
+}
+
+const Config* Config::current() {
+    return m_current.load(std::memory_order_acquire);
+}
+
+void Config::publish(const Config *config) {
+    m_current.store(config, std::memory_order_release);
+}
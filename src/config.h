@@ -0,0 +1,201 @@
+#ifndef __CONFIG__H
+#define __CONFIG__H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <limits.h>
+#include <atomic>
+
+// class Config holds every setting of the server
+// a setting comes from, in increasing priority: the default, the config file, the command line
+// the file has one "name = value" per line, '#' starts a comment,
+// the command line takes the same names as --name=value with '-' or '_'
+class Config
+{
+public:
+    // maximum length of a path in the config
+    static const int PATH_LEN = 256;
+
+    // a setting that can be changed by name
+    struct Setting
+    {
+        enum TYPE {INT, BOOL, PATH, STRING};
+
+        const char *name;
+        TYPE type;
+        size_t offset;
+
+        // the smallest valid value of an INT
+        int min;
+
+        // whether a reload changes it in the running server, the others need a restart
+        bool reloadable;
+
+        const char *help;
+    };
+
+public:
+    // the port listened
+    int port;
+
+    // the root path of the webpage
+    char doc_root[PATH_LEN];
+
+    // the file the settings were loaded from, empty if none
+    char config_file[PATH_LEN];
+
+    // threads of the thread pool and event loops, 0 means the number of cores
+    int thread_number;
+    int reactor_number;
+
+    // worker processes of the cluster, 0 if the server runs in one process
+    int workers;
+
+    // bounds of the thread pool as the load changes, 0 keeps it at thread_number
+    int thread_min;
+    int thread_max;
+
+    // whether the threads are pinned to cpus
+    // event loop i runs on reactor_cpus[i], worker i on worker_cpus[i], wrapping around the lists
+    // an empty reactor_cpus means the first cpus, an empty worker_cpus means the cpus after the reactors
+    bool cpu_affinity;
+    char reactor_cpus[PATH_LEN];
+    char worker_cpus[PATH_LEN];
+
+    // the maximum number of requests in the queue of the thread pool
+    int max_requests;
+
+    // maximum number of connections at once, and of events taken by one epoll_wait()
+    int max_conns;
+    int max_event_number;
+
+    // sizes of the reading and writing buffers of a connection
+    int read_buffer_size;
+    int write_buffer_size;
+
+    // bytes read from a connection per event, 0 for no limit
+    int read_budget;
+
+    // backlog of the listening socket
+    int listen_backlog;
+
+    // socket options, tcp_defer_accept is in seconds and 0 turns it off
+    bool tcp_nodelay;
+    bool tcp_cork;
+    int tcp_defer_accept;
+
+    // latency for cpu: microseconds of kernel busy polling, and the longest spin before sleeping, 0 turns them off
+    int busy_poll;
+    int spin_us;
+
+    // threads reading the files that are not in memory, 0 lets the event loops fault them in
+    int io_threads;
+
+    // bytes of a file checked with mincore() or read by the disk threads at a time
+    int io_window;
+
+    // limits of the clients, see Rate_limiter
+    int limit_table_size;
+    int limit_ip_conns;
+    int limit_ip_rate;
+    int limit_ip_burst;
+    int limit_global_rate;
+    int limit_global_burst;
+
+    // overload control of the thread pool, see Codel
+    int overload_target_us;
+    int overload_interval_us;
+
+    // seconds the in-flight connections get to finish on shutdown
+    int drain_timeout;
+
+    // routes of the reverse proxy, as "/api/=127.0.0.1:8080,127.0.0.1:8081;/app/=backend:80"
+    char proxy[PATH_LEN];
+
+    // idle keep-alive connections kept per upstream
+    int proxy_keepalive;
+
+    // seconds an upstream gets to connect and for every read, 0 for no limit
+    int proxy_timeout;
+
+    // path of the health check, empty if there is none
+    char health_path[PATH_LEN];
+
+    // path of the metrics, empty if there is none
+    char stats_path[PATH_LEN];
+
+    // one request in trace_sample is traced, 0 if none
+    int trace_sample;
+
+    // path of the trace, empty if there is none
+    char trace_path[PATH_LEN];
+
+    // file SIGUSR1 writes the trace to, empty if there is none
+    char trace_file[PATH_LEN];
+
+    // name of the shared memory segment of the counters, empty if they are private
+    char stats_shm[PATH_LEN];
+
+    // megabytes of proxied responses kept in memory, 0 turns the cache off
+    int cache_size;
+
+    // megabytes of small files shared by the worker processes, 0 turns the file cache off
+    int file_cache_size;
+
+    // load every file under doc_root into memory at startup
+    bool preload;
+
+    // bundle made by --pack, empty if there is none
+    char bundle[PATH_LEN];
+
+    // serve the connections as coroutines in the event loops
+    bool coroutines;
+
+    // file of the sites served by name, empty if there are none
+    char vhosts[PATH_LEN];
+
+public:
+    // all settings with their default values
+    Config();
+
+    // apply the config file named by -c/--config and then the other options
+    // return false and print the reason if anything is invalid
+    bool load(int argc, char *argv[]);
+
+    // change one setting by name
+    bool set(const char *name, const char *value);
+
+    // read a config file
+    bool load_file(const char *path);
+
+    // print the options
+    static void usage(const char *prog);
+
+    // print which settings differ from old but cannot change without a restart
+    void report_restart_needed(const Config& old) const;
+
+    // the config in use, it is never freed so the threads can keep reading an old one
+    static const Config* current();
+
+    // make config the one in use
+    static void publish(const Config *config);
+
+private:
+    // apply the command line except -c/--config
+    bool apply_args(int argc, char *argv[]);
+
+    // fill the settings that depend on the machine and make paths absolute
+    bool finish();
+
+    static const Setting* find(const char *name);
+
+    static const Setting m_settings[];
+    static const int m_setting_count;
+
+    static std::atomic<const Config*> m_current;
+};
+
+#endif
@@ -0,0 +1,111 @@
+#include "conn_pool.h"
+
+Conn_pool::Conn_pool(int max_conns) :
+m_max_conns(max_conns),
+m_in_use(0),
+m_slab_count(0) {
+    m_node_count = node_count();
+    m_nodes = new Node[m_node_count];
+    for (int i = 0; i < m_node_count; ++i) {
+        m_nodes[i].free_list = NULL;
+    }
+
+    // every node may come to hold max_conns objects in its free list
+    m_max_slabs = (max_conns / SLAB_OBJECTS + 1) * m_node_count;
+    m_slabs = new Http_conn*[m_max_slabs];
+}
+
+Conn_pool::~Conn_pool() {
+    for (int i = 0; i < m_slab_count; ++i) {
+        for (int j = 0; j < SLAB_OBJECTS; ++j) {
+            m_slabs[i][j].~Http_conn();
+        }
+        munmap(m_slabs[i], sizeof(Http_conn) * SLAB_OBJECTS);
+    }
+    delete[] m_slabs;
+    delete[] m_nodes;
+}
+
+Http_conn* Conn_pool::alloc(int node) {
+    if (__atomic_add_fetch(&m_in_use, 1, __ATOMIC_RELAXED) > m_max_conns) {
+        __atomic_sub_fetch(&m_in_use, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (node < 0 || node >= m_node_count) {
+        node = 0;
+    }
+
+    // an object of the node, a new slab, then an object of another node
+    for (int i = 0; i < m_node_count; ++i) {
+        int index = (node + i) % m_node_count;
+        Node& n = m_nodes[index];
+
+        n.locker.lock();
+        Http_conn *conn = n.free_list;
+        if (conn) {
+            n.free_list = conn->m_pool_next;
+        } else if (i == 0) {
+            conn = add_slab(n, index);
+        }
+        n.locker.unlock();
+
+        if (conn) {
+            return conn;
+        }
+    }
+
+    __atomic_sub_fetch(&m_in_use, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+void Conn_pool::free(Http_conn *conn) {
+    Node& n = m_nodes[conn->m_pool_node];
+
+    n.locker.lock();
+    conn->m_pool_next = n.free_list;
+    n.free_list = conn;
+    n.locker.unlock();
+
+    __atomic_sub_fetch(&m_in_use, 1, __ATOMIC_RELAXED);
+}
+
+int Conn_pool::size() const {
+    return __atomic_load_n(&m_slab_count, __ATOMIC_ACQUIRE) * SLAB_OBJECTS;
+}
+
+Http_conn* Conn_pool::at(int i) const {
+    return m_slabs[i / SLAB_OBJECTS] + i % SLAB_OBJECTS;
+}
+
+Http_conn* Conn_pool::add_slab(Node& n, int node) {
+    m_slab_locker.lock();
+    if (m_slab_count == m_max_slabs) {
+        m_slab_locker.unlock();
+        return NULL;
+    }
+
+    // the pages of the slab are allocated on node when they are first touched
+    size_t size = sizeof(Http_conn) * SLAB_OBJECTS;
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        m_slab_locker.unlock();
+        return NULL;
+    }
+    bind_to_node(memory, size, node);
+
+    Http_conn *slab = (Http_conn*)memory;
+    for (int i = 0; i < SLAB_OBJECTS; ++i) {
+        new (slab + i) Http_conn;
+        slab[i].m_pool_node = node;
+    }
+    for (int i = SLAB_OBJECTS - 1; i > 0; --i) {
+        slab[i].m_pool_next = n.free_list;
+        n.free_list = slab + i;
+    }
+
+    // the event loops see the slab once its objects are built
+    m_slabs[m_slab_count] = slab;
+    __atomic_store_n(&m_slab_count, m_slab_count + 1, __ATOMIC_RELEASE);
+    m_slab_locker.unlock();
+    return slab;
+}
@@ -0,0 +1,65 @@
+#ifndef __CONN_POOL__H
+#define __CONN_POOL__H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <new>
+
+#include "locker.h"
+#include "affinity.h"
+#include "http_conn.h"
+
+// class Conn_pool hands out Http_conn objects to the accepted connections
+// objects are made in slabs bound to a NUMA node when the connections need them,
+// a closed connection gives its object back to the free list of its node
+// the slabs are never unmapped, so a stale pointer from an epoll event still reads a valid generation
+class Conn_pool
+{
+public:
+    // objects made at once
+    static const int SLAB_OBJECTS = 256;
+
+    // max_conns is the number of objects in use at once
+    Conn_pool(int max_conns);
+
+    ~Conn_pool();
+
+    // an object for a new connection, on node, NULL if max_conns objects are in use
+    Http_conn* alloc(int node);
+
+    // give back an object from alloc(), its connection is closed
+    void free(Http_conn *conn);
+
+    // the objects made so far, used or not
+    // the event loops look through them while draining, others may be added meanwhile
+    int size() const;
+    Http_conn* at(int i) const;
+
+private:
+    struct Node
+    {
+        // free objects, linked by m_pool_next
+        Http_conn *free_list;
+
+        Locker locker;
+    };
+
+    // make a slab on node, keep one object for the caller and put the others in the free list
+    Http_conn* add_slab(Node& n, int node);
+
+    int m_max_conns;
+    int m_in_use;
+
+    int m_node_count;
+    Node *m_nodes;
+
+    // every slab, the array is sized for the most slabs max_conns can need
+    Http_conn **m_slabs;
+    int m_slab_count;
+    int m_max_slabs;
+    Locker m_slab_locker;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#include "coroutine.h"
+
+#ifdef __cpp_impl_coroutine
+
+#include "http_conn.h"
+
+thread_local Frame_pool::Frame *Frame_pool::m_free[Frame_pool::CLASSES];
+thread_local int Frame_pool::m_free_count[Frame_pool::CLASSES];
+
+int Frame_pool::size_class(size_t size) {
+    int index = 0;
+    size_t class_size = 64;
+    while (class_size < size) {
+        class_size *= 2;
+        ++index;
+    }
+    return index;
+}
+
+void* Frame_pool::alloc(size_t size) {
+    if (size > MAX_FRAME) {
+        return malloc(size);
+    }
+    int index = size_class(size);
+    Frame *frame = m_free[index];
+    if (frame) {
+        m_free[index] = frame->next;
+        --m_free_count[index];
+        return frame;
+    }
+    void *p = malloc((size_t)64 << index);
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+
+void Frame_pool::free(void *frame, size_t size) {
+    if (size > MAX_FRAME) {
+        ::free(frame);
+        return;
+    }
+    int index = size_class(size);
+    if (m_free_count[index] >= MAX_FREE) {
+        ::free(frame);
+        return;
+    }
+    Frame *f = (Frame*)frame;
+    f->next = m_free[index];
+    m_free[index] = f;
+    ++m_free_count[index];
+}
+
+void Io_wait::await_suspend(std::coroutine_handle<>) {
+    // the connection knows its coroutine, only the socket is armed
+    conn->wait_event(ev);
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef __COROUTINE__H
+#define __COROUTINE__H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+// the runtime of the connections written as coroutines, it needs a C++20 build
+// in an older build the connections are served by the callbacks as before
+#ifdef __cpp_impl_coroutine
+
+#include <coroutine>
+
+class Http_conn;
+
+// class Frame_pool keeps the frames of the coroutines of one thread
+// a connection starts its coroutine and ends it in the event loop that owns it, so the free lists
+// need no lock, the frames are grouped in sizes of powers of two
+class Frame_pool
+{
+public:
+    // frames bigger than this come from malloc()
+    static const size_t MAX_FRAME = 4096;
+
+    // free frames kept for each size
+    static const int MAX_FREE = 1024;
+
+    static void* alloc(size_t size);
+
+    static void free(void *frame, size_t size);
+
+private:
+    struct Frame
+    {
+        Frame *next;
+    };
+
+    // the free lists of a size, from 64 bytes to MAX_FRAME
+    static const int CLASSES = 7;
+
+    static int size_class(size_t size);
+
+    static thread_local Frame *m_free[CLASSES];
+    static thread_local int m_free_count[CLASSES];
+};
+
+// the coroutine of a connection
+// it is suspended as soon as it is made and first resumed by the first event of the socket,
+// it frees itself when it returns
+struct Conn_task
+{
+    struct promise_type
+    {
+        Conn_task get_return_object() {
+            return Conn_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { abort(); }
+
+        static void* operator new(size_t size) { return Frame_pool::alloc(size); }
+        static void operator delete(void *frame, size_t size) { Frame_pool::free(frame, size); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// co_await Io_wait(conn, EPOLLIN) arms the socket of conn for the event and gives the event loop back,
+// the loop resumes the coroutine with the events that came
+struct Io_wait
+{
+    Http_conn *conn;
+    uint32_t ev;
+
+    Io_wait(Http_conn *c, uint32_t e) : conn(c), ev(e) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const noexcept {}
+};
+
+#endif
+
+#endif
@@ -0,0 +1,191 @@
+#include "disk_io.h"
+
+// from linux/mman.h of Linux 5.14, older headers do not have it
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+// files from this size are read ahead more and dropped behind as they are sent
+#define SEQUENTIAL_SIZE (1 << 20)
+
+extern void modfd(int epollfd, int fd, int ev, uint64_t data);
+
+thread_local unsigned char *Disk_io::m_vec = NULL;
+thread_local size_t Disk_io::m_vec_size = 0;
+
+static long page_size() {
+    static long size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+Disk_io::Disk_io(int threads) :
+m_thread_number(threads),
+m_threads(NULL),
+m_head(NULL),
+m_tail(NULL),
+m_stop(false) {
+    if (threads <= 0) {
+        throw std::exception();
+    }
+    memset(&m_metrics, 0, sizeof(m_metrics));
+
+    m_threads = new pthread_t[m_thread_number];
+    for (int i = 0; i < m_thread_number; ++i) {
+        if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
+            delete[] m_threads;
+            throw std::exception();
+        }
+    }
+}
+
+Disk_io::~Disk_io() {
+    m_locker.lock();
+    m_stop = true;
+    m_locker.unlock();
+    for (int i = 0; i < m_thread_number; ++i) {
+        m_jobs.post();
+    }
+    for (int i = 0; i < m_thread_number; ++i) {
+        pthread_join(m_threads[i], NULL);
+    }
+    delete[] m_threads;
+
+    // the connections of the jobs left are closed with the server
+    while (m_head) {
+        Job *job = m_head;
+        m_head = job->next;
+        delete job;
+    }
+}
+
+long Disk_io::now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+bool Disk_io::resident(const char *addr, size_t len) {
+    if (len == 0) {
+        return true;
+    }
+    uintptr_t begin = (uintptr_t)addr & ~(page_size() - 1);
+    size_t pages = ((uintptr_t)addr + len - begin + page_size() - 1) / page_size();
+    if (pages > m_vec_size) {
+        unsigned char *vec = (unsigned char*)realloc(m_vec, pages);
+        if (!vec) {
+            return true;
+        }
+        m_vec = vec;
+        m_vec_size = pages;
+    }
+
+    __atomic_add_fetch(&m_metrics.checks, 1, __ATOMIC_RELAXED);
+    if (mincore((void*)begin, pages * page_size(), m_vec) < 0) {
+        // not knowing, the loop sends it as it did before
+        return true;
+    }
+    for (size_t i = 0; i < pages; ++i) {
+        if (!(m_vec[i] & 1)) {
+            __atomic_add_fetch(&m_metrics.cold, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+    return true;
+}
+
+void Disk_io::submit(const char *addr, size_t len, int epollfd, int fd, uint64_t data, uint32_t trace) {
+    Job *job = new Job;
+    job->addr = addr;
+    job->len = len;
+    job->epollfd = epollfd;
+    job->fd = fd;
+    job->data = data;
+    job->trace = trace;
+    job->next = NULL;
+
+    m_locker.lock();
+    if (m_tail) {
+        m_tail->next = job;
+    } else {
+        m_head = job;
+    }
+    m_tail = job;
+    m_locker.unlock();
+    m_jobs.post();
+}
+
+void Disk_io::populate(const char *addr, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    uintptr_t begin = (uintptr_t)addr & ~(page_size() - 1);
+    size_t size = (uintptr_t)addr + len - begin;
+    if (madvise((void*)begin, size, MADV_POPULATE_READ) == 0) {
+        return;
+    }
+
+    // before Linux 5.14, a read of each page faults it in
+    const volatile char *bytes = (const volatile char*)begin;
+    for (size_t offset = (uintptr_t)addr - begin; offset < size; offset += page_size()) {
+        (void)bytes[offset];
+    }
+    (void)bytes[size - 1];
+}
+
+void Disk_io::advise_sequential(int fd, const char *addr, size_t size) {
+    if (size < SEQUENTIAL_SIZE) {
+        return;
+    }
+    // a bigger readahead window for the file, the faults on the mapping read ahead too
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    madvise((void*)addr, size, MADV_SEQUENTIAL);
+}
+
+void* Disk_io::worker(void *arg) {
+    Disk_io *disk = (Disk_io*)arg;
+    disk->run();
+    return disk;
+}
+
+void Disk_io::run() {
+    while (true) {
+        m_jobs.wait();
+        m_locker.lock();
+        if (m_stop) {
+            m_locker.unlock();
+            break;
+        }
+        Job *job = m_head;
+        if (!job) {
+            m_locker.unlock();
+            continue;
+        }
+        m_head = job->next;
+        if (!m_head) {
+            m_tail = NULL;
+        }
+        m_locker.unlock();
+
+        long start = now_us();
+        uint64_t trace_start = job->trace ? Tracer::now() : 0;
+        populate(job->addr, job->len);
+        if (job->trace) {
+            Tracer::record(job->trace, TRACE_DISK, trace_start, Tracer::now());
+        }
+        long spent = now_us() - start;
+        Stats::observe(STATS_DISK, spent);
+
+        // the connection goes on in its event loop, the window is in memory now
+        modfd(job->epollfd, job->fd, EPOLLOUT, job->data);
+
+        m_locker.lock();
+        ++m_metrics.reads;
+        m_metrics.read_bytes += job->len;
+        m_metrics.read_us += spent;
+        if (spent > m_metrics.max_read_us) {
+            m_metrics.max_read_us = spent;
+        }
+        m_locker.unlock();
+        delete job;
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef __DISK_IO__H
+#define __DISK_IO__H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <exception>
+
+#include "futex.h"
+#include "trace.h"
+#include "stats.h"
+
+// counters of the disk stage, read while it runs
+struct Disk_metrics
+{
+    // windows checked with mincore() and found out of memory
+    long checks;
+    long cold;
+
+    // windows read by the disk threads, and their bytes
+    long reads;
+    long read_bytes;
+
+    // time the disk threads spent reading
+    long read_us;
+    long max_read_us;
+};
+
+// class Disk_io keeps the event loops from waiting for the disk
+// a file is sent from its mapping, and a page that is not in memory stops the thread that touches it
+// until the disk has read it, with every other connection of its loop behind it
+// the connection checks the window it is about to send with mincore(), a cold window is given to
+// the disk threads, which fault it in and arm the socket for EPOLLOUT when it is in memory
+class Disk_io
+{
+public:
+    // threads reading the windows
+    Disk_io(int threads);
+
+    ~Disk_io();
+
+    // whether every page of [addr, addr + len) is in memory
+    bool resident(const char *addr, size_t len);
+
+    // read the pages of [addr, addr + len) in a disk thread, then arm fd in epollfd for EPOLLOUT with data
+    // the mapping must stay until the event comes, the socket must not be armed meanwhile
+    // the read is a span of the request trace, unless it is 0
+    void submit(const char *addr, size_t len, int epollfd, int fd, uint64_t data, uint32_t trace);
+
+    // read the pages of [addr, addr + len) in the calling thread, which may block
+    void populate(const char *addr, size_t len);
+
+    // hint the kernel that the file of fd, mapped at addr, is about to be sent from start to end
+    static void advise_sequential(int fd, const char *addr, size_t size);
+
+    const Disk_metrics& metrics() const { return m_metrics; }
+
+private:
+    struct Job
+    {
+        const char *addr;
+        size_t len;
+        int epollfd;
+        int fd;
+        uint64_t data;
+        uint32_t trace;
+        Job *next;
+    };
+
+    static void* worker(void *arg);
+
+    void run();
+
+    static long now_us();
+
+    int m_thread_number;
+    pthread_t *m_threads;
+
+    // jobs in the order they came
+    Job *m_head;
+    Job *m_tail;
+    Futex_mutex m_locker;
+    Futex_sem m_jobs;
+
+    bool m_stop;
+
+    // the pages of the mincore() vector, grown by the threads as needed
+    static thread_local unsigned char *m_vec;
+    static thread_local size_t m_vec_size;
+
+    Disk_metrics m_metrics;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "event_batch.h"
+
+thread_local Event_batch *Event_batch::m_current = NULL;
+
+Event_batch::Event_batch(int epollfd) :
+m_epollfd(epollfd),
+m_in_batch(false),
+m_begin_us(0),
+m_changes(NULL),
+m_change_count(0),
+m_change_capacity(0),
+m_slot_of_fd(NULL),
+m_fd_capacity(0) {
+    memset(&m_metrics, 0, sizeof(m_metrics));
+    m_current = this;
+}
+
+Event_batch::~Event_batch() {
+    if (m_current == this) {
+        m_current = NULL;
+    }
+    free(m_changes);
+    free(m_slot_of_fd);
+}
+
+Event_batch* Event_batch::current() {
+    return m_current;
+}
+
+long Event_batch::now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void Event_batch::begin(int events) {
+    m_in_batch = true;
+    m_begin_us = now_us();
+    ++m_metrics.batches;
+    m_metrics.events += events;
+    if (events > m_metrics.max_batch) {
+        m_metrics.max_batch = events;
+    }
+}
+
+void Event_batch::end() {
+    flush();
+    m_in_batch = false;
+
+    long busy = now_us() - m_begin_us;
+    m_metrics.busy_us += busy;
+    if (busy > m_metrics.max_busy_us) {
+        m_metrics.max_busy_us = busy;
+    }
+}
+
+bool Event_batch::defer(int epollfd, int fd, uint32_t events, uint64_t data) {
+    if (!m_in_batch || epollfd != m_epollfd || fd < 0) {
+        return false;
+    }
+
+    if (fd >= m_fd_capacity) {
+        int capacity = m_fd_capacity ? m_fd_capacity : 1024;
+        while (capacity <= fd) {
+            capacity *= 2;
+        }
+        int *slots = (int*)realloc(m_slot_of_fd, sizeof(int) * capacity);
+        if (!slots) {
+            return false;
+        }
+        memset(slots + m_fd_capacity, 0xff, sizeof(int) * (capacity - m_fd_capacity));
+        m_slot_of_fd = slots;
+        m_fd_capacity = capacity;
+    }
+
+    // the last change of a fd in the batch is the one that counts
+    int slot = m_slot_of_fd[fd];
+    if (slot >= 0) {
+        ++m_metrics.ctl_saved;
+    } else {
+        if (m_change_count == m_change_capacity) {
+            int capacity = m_change_capacity ? m_change_capacity * 2 : 64;
+            Change *changes = (Change*)realloc(m_changes, sizeof(Change) * capacity);
+            if (!changes) {
+                return false;
+            }
+            m_changes = changes;
+            m_change_capacity = capacity;
+        }
+        slot = m_change_count++;
+        m_slot_of_fd[fd] = slot;
+    }
+    m_changes[slot].fd = fd;
+    m_changes[slot].event.events = events;
+    m_changes[slot].event.data.u64 = data;
+    return true;
+}
+
+void Event_batch::cancel(int epollfd, int fd) {
+    if (epollfd != m_epollfd || fd < 0 || fd >= m_fd_capacity || m_slot_of_fd[fd] < 0) {
+        return;
+    }
+    // the number may be given to a socket accepted later in the batch, which must not get this change
+    m_changes[m_slot_of_fd[fd]].fd = -1;
+    m_slot_of_fd[fd] = -1;
+    ++m_metrics.ctl_saved;
+}
+
+void Event_batch::note_requeue() {
+    ++m_metrics.requeued;
+}
+
+void Event_batch::flush() {
+    for (int i = 0; i < m_change_count; ++i) {
+        Change& change = m_changes[i];
+        if (change.fd < 0) {
+            continue;
+        }
+        m_slot_of_fd[change.fd] = -1;
+        epoll_ctl(m_epollfd, EPOLL_CTL_MOD, change.fd, &change.event);
+        ++m_metrics.ctl_calls;
+    }
+    m_change_count = 0;
+}
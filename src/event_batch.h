@@ -0,0 +1,90 @@
+#ifndef __EVENT_BATCH__H
+#define __EVENT_BATCH__H
+
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// counters of one event loop, written by its thread only
+struct Loop_metrics
+{
+    // epoll_wait() calls that returned events, and the events they returned
+    long batches;
+    long events;
+    int max_batch;
+
+    // time spent handling the events, from the return of epoll_wait() to its next call
+    long busy_us;
+    long max_busy_us;
+
+    // epoll_ctl() calls made for the deferred changes, and changes that needed none
+    long ctl_calls;
+    long ctl_saved;
+
+    // reads that stopped at the read budget with data left in the socket
+    long requeued;
+};
+
+// class Event_batch collects the interest changes an event loop makes while it handles a batch of events
+// and applies them once the batch is done, a connection re-armed twice costs one epoll_ctl(),
+// a connection closed in the batch costs none
+// changes made by other threads, or for another epoll, are applied at once
+class Event_batch
+{
+public:
+    Event_batch(int epollfd);
+
+    ~Event_batch();
+
+    // the batch of the event loop running in this thread, NULL in other threads
+    static Event_batch* current();
+
+    // called by the event loop around the handling of the events epoll_wait() returned
+    void begin(int events);
+    void end();
+
+    // defer EPOLL_CTL_MOD of fd, false if the change must be applied by the caller
+    bool defer(int epollfd, int fd, uint32_t events, uint64_t data);
+
+    // forget the change of fd, it is closed
+    void cancel(int epollfd, int fd);
+
+    // a read stopped at the budget, the connection is handled again when its socket is re-armed
+    void note_requeue();
+
+    const Loop_metrics& metrics() const { return m_metrics; }
+
+private:
+    struct Change
+    {
+        // -1 once cancelled
+        int fd;
+        epoll_event event;
+    };
+
+    // apply the changes, one epoll_ctl() each
+    void flush();
+
+    static long now_us();
+
+    static thread_local Event_batch *m_current;
+
+    int m_epollfd;
+    bool m_in_batch;
+    long m_begin_us;
+
+    Change *m_changes;
+    int m_change_count;
+    int m_change_capacity;
+
+    // index of the change of each fd in m_changes, -1 if it has none
+    int *m_slot_of_fd;
+    int m_fd_capacity;
+
+    Loop_metrics m_metrics;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "file_cache.h"
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+File_cache::File_cache() : m_files(NULL), m_slots(0), m_mapped(0), m_process(0) {}
+
+File_cache::~File_cache() {
+    if (m_files) {
+        munmap(m_files, m_mapped);
+    }
+}
+
+bool File_cache::open(long capacity) {
+    m_slots = capacity / sizeof(Cached_file);
+    if (m_slots < PROBES) {
+        m_slots = PROBES;
+    }
+    m_mapped = m_slots * sizeof(Cached_file);
+
+    // the pages are zero, every slot starts EMPTY, and they are only touched as files are stored
+    void *addr = mmap(NULL, m_mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        printf("file cache: cannot map %ld bytes\n", (long)m_mapped);
+        return false;
+    }
+    m_files = (Cached_file*)addr;
+    return true;
+}
+
+uint64_t File_cache::hash_path(const char *path, int len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < len; ++i) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool File_cache::same(const Cached_file *file, const struct stat& st) {
+    return file->size == st.st_size && file->mode == st.st_mode && file->ino == st.st_ino && file->dev == st.st_dev
+        && file->mtime.tv_sec == st.st_mtim.tv_sec && file->mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+Cached_file* File_cache::lookup(const char *path) {
+    int len = strlen(path);
+    if (len >= Cached_file::PATH_LEN) {
+        return NULL;
+    }
+    uint64_t hash = hash_path(path, len);
+    for (int i = 0; i < PROBES; ++i) {
+        Cached_file *file = m_files + (hash + i) % m_slots;
+        if (file->hash.load(std::memory_order_relaxed) != hash) {
+            continue;
+        }
+
+        // counted before the state is read, a writer taking the slot afterwards sees the count and leaves it
+        file->refs[m_process].fetch_add(1, std::memory_order_seq_cst);
+        if ((file->state.load(std::memory_order_seq_cst) & 0xff) != Cached_file::READY
+            || file->hash.load(std::memory_order_relaxed) != hash || strcmp(file->path, path) != 0) {
+            release(file);
+            continue;
+        }
+
+        uint64_t now = now_us();
+        if (now - file->checked_us.load(std::memory_order_relaxed) > CHECK_US) {
+            struct stat st;
+            if (stat(path, &st) < 0 || !same(file, st)) {
+                invalidate(file);
+                release(file);
+                return NULL;
+            }
+            file->checked_us.store(now, std::memory_order_relaxed);
+        }
+        // the line of the slot is shared by the processes, it is written once in a while rather than on every hit
+        if (now - file->used_us.load(std::memory_order_relaxed) > CHECK_US / 10) {
+            file->used_us.store(now, std::memory_order_relaxed);
+        }
+        return file;
+    }
+    return NULL;
+}
+
+bool File_cache::contains(const char *path) const {
+    int len = strlen(path);
+    if (len >= Cached_file::PATH_LEN) {
+        return false;
+    }
+    uint64_t hash = hash_path(path, len);
+    for (int i = 0; i < PROBES; ++i) {
+        const Cached_file *file = m_files + (hash + i) % m_slots;
+        // the slot may be filled meanwhile, the compare stays within the path
+        if (file->hash.load(std::memory_order_relaxed) == hash
+            && (file->state.load(std::memory_order_acquire) & 0xff) == Cached_file::READY
+            && strncmp(file->path, path, Cached_file::PATH_LEN) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void File_cache::invalidate(Cached_file *file) {
+    uint32_t word = file->state.load(std::memory_order_relaxed);
+    if ((word & 0xff) == Cached_file::READY) {
+        file->state.compare_exchange_strong(word, state_word(Cached_file::STALE));
+    }
+}
+
+void File_cache::store(const char *path, const struct stat& st, const char *data) {
+    int len = strlen(path);
+    if (len >= Cached_file::PATH_LEN || st.st_size <= 0 || st.st_size > Cached_file::BODY_LEN || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    uint64_t hash = hash_path(path, len);
+
+    // an empty slot among the probes, else a stale one, else the least recently used
+    Cached_file *victim = NULL;
+    uint32_t victim_word = 0;
+    uint64_t victim_used = UINT64_MAX;
+    for (int i = 0; i < PROBES; ++i) {
+        Cached_file *file = m_files + (hash + i) % m_slots;
+        uint32_t word = file->state.load(std::memory_order_acquire);
+        int state = word & 0xff;
+        if (state == Cached_file::READY && file->hash.load(std::memory_order_relaxed) == hash && strcmp(file->path, path) == 0) {
+            // another request has stored it meanwhile
+            return;
+        }
+        if (state == Cached_file::FILLING) {
+            continue;
+        }
+        uint64_t used = state == Cached_file::EMPTY ? 0 : state == Cached_file::STALE ? 1 : file->used_us.load(std::memory_order_relaxed);
+        if (used < victim_used) {
+            victim = file;
+            victim_word = word;
+            victim_used = used;
+        }
+    }
+    if (!victim || !victim->state.compare_exchange_strong(victim_word, state_word(Cached_file::FILLING), std::memory_order_seq_cst)) {
+        return;
+    }
+
+    // a reader counted before FILLING was set may be sending the slot, it is left as it was
+    for (int i = 0; i < FILE_CACHE_PROCESSES; ++i) {
+        if (victim->refs[i].load(std::memory_order_seq_cst) != 0) {
+            victim->state.store(victim_word, std::memory_order_release);
+            return;
+        }
+    }
+
+    victim->hash.store(hash, std::memory_order_relaxed);
+    memcpy(victim->path, path, len + 1);
+    victim->size = st.st_size;
+    victim->mode = st.st_mode;
+    victim->ino = st.st_ino;
+    victim->dev = st.st_dev;
+    victim->mtime = st.st_mtim;
+    memcpy(victim->body, data, st.st_size);
+    uint64_t now = now_us();
+    victim->checked_us.store(now, std::memory_order_relaxed);
+    victim->used_us.store(now, std::memory_order_relaxed);
+    victim->state.store(state_word(Cached_file::READY), std::memory_order_release);
+}
+
+void File_cache::forget(int process) {
+    for (int i = 0; i < m_slots; ++i) {
+        Cached_file *file = m_files + i;
+        if (file->refs[process].load(std::memory_order_relaxed) != 0) {
+            file->refs[process].store(0, std::memory_order_release);
+        }
+        uint32_t word = file->state.load(std::memory_order_acquire);
+        if ((word & 0xff) == Cached_file::FILLING && (int)(word >> 8) == process) {
+            file->state.compare_exchange_strong(word, Cached_file::EMPTY);
+        }
+    }
+}
+
+int File_cache::count() const {
+    int count = 0;
+    for (int i = 0; i < m_slots; ++i) {
+        if ((m_files[i].state.load(std::memory_order_relaxed) & 0xff) == Cached_file::READY) {
+            ++count;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,112 @@
+#ifndef __FILE_CACHE__H
+#define __FILE_CACHE__H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <atomic>
+
+// the most processes that can hold the files of the cache
+#define FILE_CACHE_PROCESSES 64
+
+// one file kept in the cache, in memory shared by the worker processes
+struct Cached_file
+{
+    // largest file kept, with the slot it fills 16 kB
+    static const int BODY_LEN = 16384 - 1024;
+    static const int PATH_LEN = 256;
+
+    // the low byte of state is EMPTY, FILLING, READY or STALE, the rest is the process that set it
+    // FILLING: a process writes the slot, nothing else reads or takes it
+    // STALE: the file has changed since, the slot is taken again once nothing sends it
+    enum STATE {EMPTY = 0, FILLING, READY, STALE};
+
+    std::atomic<uint32_t> state;
+
+    // responses of each process sending the body, the slot is only taken again when they are all 0
+    std::atomic<uint32_t> refs[FILE_CACHE_PROCESSES];
+
+    // hash of the path, read before the path is compared
+    std::atomic<uint64_t> hash;
+
+    // monotonic us of the last stat() finding the file unchanged, and of the last hit
+    std::atomic<uint64_t> checked_us;
+    std::atomic<uint64_t> used_us;
+
+    // what stat() said when the slot was filled
+    off_t size;
+    mode_t mode;
+    ino_t ino;
+    dev_t dev;
+    struct timespec mtime;
+
+    char path[PATH_LEN];
+
+    char body[BODY_LEN];
+};
+
+// class File_cache keeps the small files served from the filesystem in memory shared by the processes of a cluster,
+// so the workers warm one copy between them and a hit costs no open(), mmap() or munmap()
+// the memory is mapped before the workers are forked, it is a fixed table of slots, a path has PROBES of them to be in
+// a hit is checked with stat() once CHECK_US have passed since the last check, a changed file is read again
+// there is no lock between the processes: a reader counts itself in refs of the slot before looking at its state,
+// a writer sets the state to FILLING before looking at refs, so a slot is never rewritten while it is being sent
+class File_cache
+{
+public:
+    static const int PROBES = 8;
+    static const uint64_t CHECK_US = 1000000;
+
+    File_cache();
+
+    ~File_cache();
+
+    // map capacity bytes of shared memory, false if it cannot be mapped
+    bool open(long capacity);
+
+    // the refs of the calling process are counted in row process, set in every worker after the fork
+    void set_process(int process) { m_process = process; }
+
+    // the file at path, NULL if it is not kept or has changed, release() it once it is sent
+    Cached_file* lookup(const char *path);
+
+    // whether the file at path looks kept, without a ref and without checking the file, it may change at once
+    bool contains(const char *path) const;
+
+    // keep the file at path, st is its status and data its content, a file over BODY_LEN is not kept
+    void store(const char *path, const struct stat& st, const char *data);
+
+    // a response has sent the body of file
+    void release(Cached_file *file) {
+        file->refs[m_process].fetch_sub(1, std::memory_order_release);
+    }
+
+    // the process in row process has exited, drop its refs and the slots it was filling
+    void forget(int process);
+
+    // slots holding a file, counted while they change
+    int count() const;
+
+    int slots() const { return m_slots; }
+
+    const Cached_file* at(int i) const { return m_files + i; }
+
+private:
+    static uint64_t hash_path(const char *path, int len);
+
+    // whether st still describes the file kept in file
+    static bool same(const Cached_file *file, const struct stat& st);
+
+    // the state word of the calling process
+    uint32_t state_word(Cached_file::STATE state) const { return state | (uint32_t)m_process << 8; }
+
+    // stop serving file, the caller holds a ref on it
+    void invalidate(Cached_file *file);
+
+    Cached_file *m_files;
+    int m_slots;
+    size_t m_mapped;
+    int m_process;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include "futex.h"
+
+// the longest spin of a lock, in rounds of cpu_relax()
+#define MAX_LOCK_SPINS 100
+
+static long futex_wait(uint32_t *addr, uint32_t expected) {
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static long futex_wake(uint32_t *addr, int count) {
+    return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// the spin is worth it only if the holder runs on another cpu meanwhile
+static int max_lock_spins() {
+    static int spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MAX_LOCK_SPINS : 0;
+    return spins;
+}
+
+Futex_mutex::Futex_mutex() :
+m_state(0),
+m_spins(0) {}
+
+void Futex_mutex::lock() {
+    uint32_t unlocked = 0;
+    if (__atomic_compare_exchange_n(&m_state, &unlocked, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    lock_slow();
+}
+
+bool Futex_mutex::try_lock() {
+    uint32_t unlocked = 0;
+    return __atomic_compare_exchange_n(&m_state, &unlocked, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void Futex_mutex::lock_slow() {
+    // spin up to twice as long as the recent locks needed
+    int spins = __atomic_load_n(&m_spins, __ATOMIC_RELAXED);
+    int max = spins * 2 + 10;
+    if (max > max_lock_spins()) {
+        max = max_lock_spins();
+    }
+    for (int i = 0; i < max; ++i) {
+        cpu_relax();
+        if (__atomic_load_n(&m_state, __ATOMIC_RELAXED) == 0 && try_lock()) {
+            __atomic_store_n(&m_spins, spins + (i - spins) / 8, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    if (max > 0) {
+        __atomic_store_n(&m_spins, spins + (max - spins) / 8, __ATOMIC_RELAXED);
+    }
+
+    // mark it contended, the holder wakes a sleeper when it unlocks
+    uint32_t state = __atomic_exchange_n(&m_state, 2, __ATOMIC_ACQUIRE);
+    while (state != 0) {
+        futex_wait(&m_state, 2);
+        state = __atomic_exchange_n(&m_state, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+void Futex_mutex::unlock() {
+    if (__atomic_fetch_sub(&m_state, 1, __ATOMIC_RELEASE) != 1) {
+        // someone may sleep on it
+        __atomic_store_n(&m_state, 0, __ATOMIC_RELEASE);
+        futex_wake(&m_state, 1);
+    }
+}
+
+Futex_sem::Futex_sem(uint32_t count) :
+m_count(count),
+m_sleepers(0) {}
+
+bool Futex_sem::try_wait() {
+    uint32_t count = __atomic_load_n(&m_count, __ATOMIC_RELAXED);
+    while (count > 0) {
+        if (__atomic_compare_exchange_n(&m_count, &count, count - 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Futex_sem::wait() {
+    while (!try_wait()) {
+        // counted before the count is checked again, so a post() after the check sees the sleeper
+        __atomic_add_fetch(&m_sleepers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&m_count, __ATOMIC_SEQ_CST) == 0) {
+            futex_wait(&m_count, 0);
+        }
+        __atomic_sub_fetch(&m_sleepers, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void Futex_sem::post() {
+    __atomic_add_fetch(&m_count, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&m_sleepers, __ATOMIC_SEQ_CST) > 0) {
+        futex_wake(&m_count, 1);
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef __FUTEX__H
+#define __FUTEX__H
+
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// synchronization on futexes, for the paths every request takes
+// an uncontended lock, unlock, post or wait is one atomic instruction and no syscall,
+// the kernel is only entered to sleep and to wake a thread that sleeps
+
+// tell the cpu it is a spin, the other hyperthread gets the core meanwhile
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// class Futex_mutex is a mutex that spins a while before it sleeps
+// the spin adapts to how long the lock was held before, like PTHREAD_MUTEX_ADAPTIVE_NP,
+// and is skipped on a single cpu where the holder cannot run while it spins
+class Futex_mutex
+{
+public:
+    Futex_mutex();
+
+    void lock();
+
+    bool try_lock();
+
+    void unlock();
+
+private:
+    void lock_slow();
+
+    // 0 unlocked, 1 locked, 2 locked with threads sleeping on it
+    uint32_t m_state;
+
+    // average spins the recent locks needed
+    int m_spins;
+
+    Futex_mutex(const Futex_mutex&) = delete;
+    Futex_mutex& operator=(const Futex_mutex&) = delete;
+};
+
+// class Futex_sem is a counting semaphore that only makes a syscall to wake a thread that sleeps
+// post() of sem_post() enters the kernel whenever a waiter may exist, this one counts the sleepers
+class Futex_sem
+{
+public:
+    Futex_sem(uint32_t count = 0);
+
+    // take the semaphore, sleep until it is posted
+    void wait();
+
+    // take the semaphore if it is posted, without blocking
+    bool try_wait();
+
+    void post();
+
+private:
+    uint32_t m_count;
+    uint32_t m_sleepers;
+
+    Futex_sem(const Futex_sem&) = delete;
+    Futex_sem& operator=(const Futex_sem&) = delete;
+};
+
+// class Lock_guard holds the lock of m for its scope, for a Futex_mutex or a Locker
+template<typename M>
+class Lock_guard
+{
+public:
+    explicit Lock_guard(M& m) : m_mutex(m) { m_mutex.lock(); }
+
+    ~Lock_guard() { m_mutex.unlock(); }
+
+private:
+    M& m_mutex;
+
+    Lock_guard(const Lock_guard&) = delete;
+    Lock_guard& operator=(const Lock_guard&) = delete;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#include "handlers.h"
+
+Text_producer::Text_producer(char *data, size_t len, bool owned) :
+m_data(data), m_len(len), m_sent(0), m_owned(owned) {}
+
+Text_producer::~Text_producer() {
+    if (m_owned) {
+        free(m_data);
+    }
+}
+
+int Text_producer::produce(char *buf, int size) {
+    size_t len = m_len - m_sent;
+    if (len > (size_t)size) {
+        len = size;
+    }
+    memcpy(buf, m_data + m_sent, len);
+    m_sent += len;
+    return len;
+}
+
+Http_conn::HTTP_CODE Proxy_handler::handle(Http_conn *conn, const Route_match& /*match*/) {
+    return conn->forward(m_route);
+}
+
+Http_conn::HTTP_CODE Trace_handler::handle(Http_conn *conn, const Route_match& /*match*/) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out) {
+        return Http_conn::INTERNAL_ERROR;
+    }
+    Tracer::dump(out);
+    fclose(out);
+    return conn->start_stream(200, "OK", "application/json", new Text_producer(text, len, true));
+}
+
+Http_conn::HTTP_CODE Health_handler::handle(Http_conn *conn, const Route_match& /*match*/) {
+    static char ok[] = "ok\n";
+    static char draining[] = "draining\n";
+    if (Http_conn::m_draining) {
+        return conn->start_stream(503, "Service Unavailable", "text/plain", new Text_producer(draining, strlen(draining), false));
+    }
+    return conn->start_stream(200, "OK", "text/plain", new Text_producer(ok, strlen(ok), false));
+}
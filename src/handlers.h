@@ -0,0 +1,58 @@
+#ifndef __HANDLERS__H
+#define __HANDLERS__H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+
+struct Proxy_route;
+
+// a body already in memory, streamed out of it
+class Text_producer : public Stream_producer
+{
+public:
+    // the producer frees data with free() if owned is set
+    Text_producer(char *data, size_t len, bool owned);
+
+    ~Text_producer();
+
+    int produce(char *buf, int size);
+
+private:
+    char *m_data;
+    size_t m_len;
+    size_t m_sent;
+    bool m_owned;
+};
+
+// the requests of a proxy route go to its upstreams
+class Proxy_handler : public Route_handler
+{
+public:
+    explicit Proxy_handler(const Proxy_route *route) : m_route(route) {}
+
+    Http_conn::HTTP_CODE handle(Http_conn *conn, const Route_match& match);
+
+    // an upstream may take long to answer, the requests served from memory go first
+    Http_conn::LANE lane() const { return Http_conn::LANE_LOW; }
+
+private:
+    const Proxy_route *m_route;
+};
+
+// "ok" while the server accepts requests, 503 once it drains, for the health checks of load balancers
+class Health_handler : public Route_handler
+{
+public:
+    Http_conn::HTTP_CODE handle(Http_conn *conn, const Route_match& match);
+};
+
+// the spans of the sampled requests as Chrome trace JSON, for chrome://tracing or Perfetto
+class Trace_handler : public Route_handler
+{
+public:
+    Http_conn::HTTP_CODE handle(Http_conn *conn, const Route_match& match);
+};
+
+#endif
@@ -1,22 +1,43 @@
 #include "http_conn.h"
-
-// the root path of the webpage
-const char *doc_root = "/home/bdth333/project/real/webserver_cpp/resources";
+#include "proxy.h"
+#include "cache.h"
+#include "conn_pool.h"
+#include "assets.h"
+#include "event_batch.h"
+#include "spin.h"
+#include "vhost.h"
+#include "disk_io.h"
+#include "router.h"
+
+#include <netinet/tcp.h>
 
 // define the status information of HTTP response
 const char* ok_200_title = "OK";
+const char* not_modified_304_title = "Not Modified";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_429_title = "Too Many Requests";
+const char* error_429_form = "This site receives too many requests, try again later.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
 
-Http_conn::Http_conn() {}
+// prebuilt responses for rejected clients, they have no body and always close the connection
+const char* reject_429_response = "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+const char* reject_502_response = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+const char* reject_503_response = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
 
-Http_conn::~Http_conn() {}
+Http_conn::Http_conn() : m_sockfd(-1), m_generation(1), m_pool_node(0), m_pool_next(0), m_epollfd(-1), m_read_buf(0), m_buf_node(0), m_write_buf(0), m_file_address(0), m_resident_end(0), m_shared_file(0), m_stream(0), m_stream_buf(0), m_proxy(0), m_cached(0), m_cache_wait(false), m_coro(0), m_events(0), m_request_start(0), m_queued_at(0), m_trace_id(0), m_trace_wait(0) {}
+
+Http_conn::~Http_conn() {
+    if (m_read_buf && m_buffers) {
+        m_buffers->free(m_read_buf, m_buf_node);
+    }
+    delete[] m_stream_buf;
+}
 
 int set_nonblocking(int fd) {
     int old_option = fcntl(fd, F_GETFL);
@@ -26,9 +47,9 @@ int set_nonblocking(int fd) {
 }
 
 // append the fd that needs to be listened into epoll
-void addfd(int epollfd, int fd, bool one_shot) {
+void addfd(int epollfd, int fd, bool one_shot, uint64_t data) {
     epoll_event event;
-    event.data.fd = fd;
+    event.data.u64 = data;
     event.events = EPOLLIN | EPOLLRDHUP;
     if (one_shot) {
         // prevent one connection from being processed by different threads
@@ -41,23 +62,58 @@ void addfd(int epollfd, int fd, bool one_shot) {
 
 // remove the fd that needs to be listened from epoll
 void removefd(int epollfd, int fd) {
+    Event_batch *batch = Event_batch::current();
+    if (batch) {
+        batch->cancel(epollfd, fd);
+    }
     epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
     close(fd);
 }
 
+// the socket buffer of a fresh connection always has room for the response,
+// if it does not the client gets nothing, the caller closes the connection anyway
+void send_reject(int fd, int status) {
+    const char *response = (status == 429) ? reject_429_response : (status == 502) ? reject_502_response : reject_503_response;
+    send(fd, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL);
+    Stats::add(Stats::m_segment->rejected);
+    Stats::response(status);
+}
+
 // modify the fd, reset the EPOLLONESHOT event on socket
 // this is to ensure that EPOLLIN event can be triggered on next read()
-void modfd(int epollfd, int fd, int ev) {
+// in an event loop the change is applied after the batch of events it is handling
+void modfd(int epollfd, int fd, int ev, uint64_t data) {
+    uint32_t events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    Event_batch *batch = Event_batch::current();
+    if (batch && batch->defer(epollfd, fd, events, data)) {
+        return;
+    }
+
     epoll_event event;
-    event.data.fd = fd;
-    event.events = ev | EPOLLET | EPOLLONESHOT | EPOLLRDHUP;
+    event.data.u64 = data;
+    event.events = events;
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
 
 // total number of clients
-int Http_conn::m_user_count = 0;
-int Http_conn::m_epollfd = -1;
+std::atomic<int> Http_conn::m_user_count(0);
+int Http_conn::m_read_buffer_size = 2048;
+int Http_conn::m_write_buffer_size = 1024;
+Node_buffers *Http_conn::m_buffers = NULL;
+Rate_limiter *Http_conn::m_limiter = NULL;
+bool Http_conn::m_draining = false;
+Proxy *Http_conn::m_upstreams = NULL;
+Router *Http_conn::m_router = NULL;
+Response_cache *Http_conn::m_cache = NULL;
+File_cache *Http_conn::m_files = NULL;
+Conn_pool *Http_conn::m_pool = NULL;
+Asset_store *Http_conn::m_assets = NULL;
+Asset_bundle *Http_conn::m_bundle = NULL;
+Vhost_table *Http_conn::m_vhosts = NULL;
+Disk_io *Http_conn::m_disk = NULL;
+bool Http_conn::m_use_coroutines = false;
+thread_local void *Http_conn::m_running_coro = NULL;
 
 
 
@@ -70,33 +126,172 @@ void Http_conn::close_conn() {
     if (m_sockfd != -1) {
         removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;
+        end_request();
+        release_stream();
+        release_proxy();
+        release_cached();
+        release_shared();
         // after closing one connection, decrease the number of clients by 1
         --m_user_count;
+        if (m_limiter) {
+            m_limiter->on_close(client_ip());
+        }
+
+        // a coroutine waiting for an event ends with its connection, a running one returns by itself
+        if (m_coro) {
+#ifdef __cpp_impl_coroutine
+            if (m_coro != m_running_coro) {
+                std::coroutine_handle<>::from_address(m_coro).destroy();
+            }
+#endif
+            m_coro = NULL;
+        }
+
+        // events still queued for the connection are recognized as stale, 0 is never used
+        if (++m_generation == 0) {
+            m_generation = 1;
+        }
+        if (m_pool) {
+            m_pool->free(this);
+        }
+    }
+}
+
+uint64_t Http_conn::event_data() const {
+    return (uint64_t)this | ((uint64_t)m_generation << CONN_GENERATION_SHIFT);
+}
+
+Http_conn* Http_conn::from_event(uint64_t data) {
+    // the slabs of the pool stay mapped, so the generation of a reused object can be read
+    Http_conn *conn = (Http_conn*)(data & CONN_POINTER_MASK);
+    if (conn->m_generation != (uint16_t)(data >> CONN_GENERATION_SHIFT)) {
+        return NULL;
+    }
+    return conn;
+}
+
+void Http_conn::reject(int status) {
+    if (m_sockfd != -1) {
+        send_reject(m_sockfd, status);
+        close_conn();
+    }
+}
+
+// a connection handed to the thread pool has data in m_read_buf, one being answered has bytes to send
+bool Http_conn::idle(int epollfd) const {
+    return m_sockfd != -1 && m_epollfd == epollfd && m_read_idx == 0 && bytes_to_send == 0 && !m_stream && !m_proxy && !m_cache_wait;
+}
+
+uint32_t Http_conn::client_ip() const {
+    return m_address.sin_addr.s_addr;
+}
+
+Http_conn::LANE Http_conn::lane() const {
+    // "GET /a/b.html?x=1 HTTP/1.1", the line has to be complete
+    const char *end = (const char*)memchr(m_read_buf, '\n', m_read_idx);
+    const char *target = end ? (const char*)memchr(m_read_buf, ' ', end - m_read_buf) : NULL;
+    if (!target || target[1] != '/') {
+        return LANE_NORMAL;
+    }
+    ++target;
+
+    // only a path the parser would leave as it is, so the lookups see what do_request() will
+    char path[FILENAME_LEN];
+    int len = 0;
+    for (const char *p = target; p < end && *p != ' ' && *p != '?'; ++p) {
+        if (*p == '%' || (*p == '.' && p[-1] == '/') || (*p == '/' && p[-1] == '/') || len == FILENAME_LEN - 1) {
+            return LANE_NORMAL;
+        }
+        path[len++] = *p;
+    }
+    path[len] = '\0';
+
+    if (m_router) {
+        Route_match match;
+        Route_handler *handler = m_router->find(std::string_view(path, len), &match);
+        if (handler) {
+            return handler->lane();
+        }
     }
+
+    // the site, its assets and its root depend on the Host header, which is not looked at here
+    if (m_vhosts) {
+        return LANE_NORMAL;
+    }
+    Asset asset;
+    if ((m_assets && m_assets->find(path, &asset)) || (m_bundle && m_bundle->find(path, &asset))) {
+        return LANE_HIGH;
+    }
+    if (m_files) {
+        char real_file[FILENAME_LEN];
+        if (snprintf(real_file, FILENAME_LEN, "%s%s", Config::current()->doc_root, path) < FILENAME_LEN && m_files->contains(real_file)) {
+            return LANE_HIGH;
+        }
+    }
+    return LANE_NORMAL;
 }
 
 // initialize the connection and the address of socket
-void Http_conn::init(int sockfd, const sockaddr_in& addr) {
+bool Http_conn::init(int sockfd, const sockaddr_in& addr, int epollfd, int node) {
+    // unused objects cost no buffer memory, used ones keep their buffers on the node of their event loop
+    if (m_read_buf && m_buf_node != node) {
+        m_buffers->free(m_read_buf, m_buf_node);
+        m_read_buf = 0;
+    }
+    if (!m_read_buf) {
+        m_read_buf = m_buffers->alloc(node);
+        if (!m_read_buf) {
+            return false;
+        }
+        m_write_buf = m_read_buf + m_read_buffer_size;
+        m_buf_node = node;
+    }
+
     m_sockfd = sockfd;
     m_address = addr;
+    m_epollfd = epollfd;
+    m_corked = false;
 
     // port reuse
     int reuse = 1;
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
+    if (Config::current()->tcp_nodelay) {
+        int nodelay = 1;
+        setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+
+    // a read right after the wake up polls the device queue instead of waiting for its interrupt
+    if (Config::current()->busy_poll > 0) {
+        busy_poll_socket(m_sockfd, Config::current()->busy_poll);
+    }
+
+#ifdef __cpp_impl_coroutine
+    // the coroutine exists before the socket is armed, the event loop of epollfd may run in another thread
+    if (m_use_coroutines) {
+        m_coro = serve().handle.address();
+    }
+#endif
+
     // add the sockfd into the epoll
-    addfd(m_epollfd, sockfd, true);
+    addfd(m_epollfd, sockfd, true, event_data());
     // increase the number of clients by 1
     ++m_user_count;
 
     init(); // call the init() below
+    return true;
 }
 
 // the meaning is different from the init(int sockfd, const sockaddr_in& addr) above
 void Http_conn::init() {
+    end_request();
     bytes_to_send = 0;
     bytes_have_send = 0;
-    
+    release_stream();
+    release_proxy();
+    release_cached();
+    release_shared();
+    m_cache_wait = false;
 
     // the initial status is checking the request line
     m_check_state = CHECK_STATE_REQUESTLINE;
@@ -108,18 +303,17 @@ void Http_conn::init() {
     m_method = GET;
     
     m_url = 0;
-    m_version = 0;
     m_content_length = 0;
-    m_host = 0;
+    m_request.clear();
 
     m_start_line = 0;
     m_checked_idx = 0;
  
     m_read_idx = 0;
-    bzero(m_read_buf, READ_BUFFER_SIZE);
+    bzero(m_read_buf, m_read_buffer_size);
 
     m_write_idx = 0;
-    bzero(m_write_buf, WRITE_BUFFER_SIZE); // q
+    bzero(m_write_buf, m_write_buffer_size); // q
 
     bzero(m_real_file, FILENAME_LEN);
 }
@@ -127,15 +321,40 @@ void Http_conn::init() {
 // read the data from client 
 // until no data can be read, or the connection is closed by client
 bool Http_conn::read() {
-    if (m_read_idx >= READ_BUFFER_SIZE) {
+    if (m_read_idx >= m_read_buffer_size) {
         return false;
     }
     
+    // one fast sender does not hold the event loop, past the budget the rest is read when the socket is re-armed,
+    // which reports it again after the other connections of the batch
+    int budget = Config::current()->read_budget;
+    int total = 0;
+
+    // the request starts with its first read, it may be traced
+    if (!m_request_start) {
+        m_request_start = Tracer::now();
+        m_trace_id = Tracer::sample();
+    }
+    Trace_span span(m_trace_id, TRACE_READ);
+
     int bytes_read = 0;
     while (true) {
         // save the data from m_read_buf + m_read_idx
-        // the length is READ_BUFFER_SIZE - m_read_idx
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+        // the length is m_read_buffer_size - m_read_idx
+        int len = m_read_buffer_size - m_read_idx;
+        if (budget > 0) {
+            if (total >= budget) {
+                Event_batch *batch = Event_batch::current();
+                if (batch) {
+                    batch->note_requeue();
+                }
+                break;
+            }
+            if (len > budget - total) {
+                len = budget - total;
+            }
+        }
+        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, len, 0);
         if (bytes_read == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break; // no data can be read
@@ -147,7 +366,9 @@ bool Http_conn::read() {
 
         }
         m_read_idx += bytes_read;
+        total += bytes_read;
     }
+    m_queued_at = Tracer::now();
     return true;
 }
 
@@ -180,41 +401,16 @@ Http_conn::LINE_STATUS Http_conn::parse_line() {
 // analyze the request line
 // get: request method, target url, http version
 Http_conn::HTTP_CODE Http_conn::parse_request_line(char *text) {
-    // GET /index.html HTTP/1.1
-    m_url = strpbrk(text, " \t");
-    if (!m_url) {
+    // GET /index.html HTTP/1.1, the path is decoded and cannot leave the root
+    if (!m_request.parse_request_line(text)) {
         return BAD_REQUEST;
     }
-
-    // GET\0/index.html HTTP/1.1
-    *m_url++ = '\0';
-    char *method = text;
-    if (strcasecmp(method, "GET") == 0) {
+    if (Http_request::equals_nocase(m_request.method, "GET")) {
         m_method = GET;
     } else {
         return BAD_REQUEST;
     }
-
-    // /index.html HTTP/1.1
-    m_version = strpbrk(m_url, " \t");
-    if (!m_version) {
-        return BAD_REQUEST;
-    }
-    *m_version++ = '\0';
-    // if (strcasecmp(m_version, "HTTP/1.1") != 0) {
-    //     return BAD_REQUEST;
-    // }
-
-    /**
-     * http://192.168.110.129:10000/index.html
-    */
-    if (strncasecmp(m_url, "http://", 7) == 0) {
-        m_url += 7;
-        m_url = strchr(m_url, '/');
-    }
-    if (!m_url || m_url[0] != '/') {
-        return BAD_REQUEST;
-    }
+    m_url = (char*)m_request.path.data();
     m_check_state = CHECK_STATE_HEADER;
     return NO_REQUEST;
 }
@@ -223,27 +419,26 @@ Http_conn::HTTP_CODE Http_conn::parse_request_line(char *text) {
 Http_conn::HTTP_CODE Http_conn::parse_headers(char *text) {
     // if it is an empty line, it means headers have been analyzed
     if (text[0] == '\0') {
+        // every header is in, the connection takes what it needs from the index
+        m_linger = m_request.header_has_token(HEADER_CONNECTION, "keep-alive");
+        // a chunked body is not read, its chunks would be taken for the next request
+        if (m_request.has(HEADER_TRANSFER_ENCODING)) {
+            return BAD_REQUEST;
+        }
+        // the body and the '\0' after it have to fit in what is left of the reading buffer
+        long length = m_request.content_length(m_read_buffer_size - m_checked_idx - 1);
+        if (length < 0) {
+            return BAD_REQUEST;
+        }
+        m_content_length = length;
         if (m_content_length != 0) {
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
         return GET_REQUEST;
-    } else if (strncasecmp(text, "Connection:", 11) == 0) {
-        text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "keep-alive") == 0) {
-            m_linger = true;
-        }
-    } else if (strncasecmp(text, "Content-Length:", 15) == 0) {
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atol(text);
-    } else if (strncasecmp( text, "Host:", 5 ) == 0) {
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
-    } else {
-        printf("oop! unknow header %s\n", text);
+    }
+    if (!m_request.parse_header(text)) {
+        return BAD_REQUEST;
     }
     return NO_REQUEST;
 }
@@ -260,6 +455,8 @@ Http_conn::HTTP_CODE Http_conn::parse_content(char *text) {
 // main FSM
 // analyze the request
 Http_conn::HTTP_CODE Http_conn::process_read() {
+    Trace_span span(m_trace_id, TRACE_PARSE);
+
     // initial status
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
@@ -289,6 +486,7 @@ Http_conn::HTTP_CODE Http_conn::process_read() {
                 if (ret == BAD_REQUEST) {
                     return BAD_REQUEST;
                 } else if (ret == GET_REQUEST) {
+                    Stats::add(Stats::m_segment->requests);
                     return do_request();
                 }
                 break;
@@ -296,10 +494,11 @@ Http_conn::HTTP_CODE Http_conn::process_read() {
             case CHECK_STATE_CONTENT : {
                 ret = parse_content(text);
                 if (ret == GET_REQUEST) {
+                    Stats::add(Stats::m_segment->requests);
                     return do_request();
                 }
-                line_status = LINE_OPEN;
-                break;
+                // the body is not complete, parse_line() must not move m_checked_idx into it
+                return NO_REQUEST;
             }
             default: {
                 return INTERNAL_ERROR;
@@ -314,9 +513,47 @@ Http_conn::HTTP_CODE Http_conn::process_read() {
 // if target file exists can public to all users, and it is not a directory
 // use mmap() to map it to m_file_address in the memory, and notice who calls it
 Http_conn::HTTP_CODE Http_conn::do_request() {
-    strcpy(m_real_file, doc_root);
-    int len = strlen(doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+    Trace_span span(m_trace_id, TRACE_HANDLE);
+
+    // the site named by the Host header, requests to other names are served from doc_root
+    const char *host = m_request.header_cstr(HEADER_HOST);
+    Vhost *vhost = m_vhosts ? m_vhosts->find(host) : NULL;
+    if (vhost && !Vhost_table::admit(vhost, client_ip())) {
+        return LIMITED_REQUEST;
+    }
+
+    // the routed paths belong to their handlers
+    if (m_router) {
+        Route_match match;
+        Route_handler *handler = m_router->find(m_request.path, &match);
+        if (handler) {
+            return handler->handle(this, match);
+        }
+    }
+
+    // a loaded or packed file is served from memory
+    const Asset_store *assets = vhost ? vhost->assets : m_assets;
+    const Asset_bundle *bundle = vhost ? vhost->bundle : m_bundle;
+    if (assets && assets->find(m_url, &m_asset)) {
+        return ASSET_REQUEST;
+    }
+    if (bundle && bundle->find(m_url, &m_asset)) {
+        return ASSET_REQUEST;
+    }
+
+    const char *doc_root = vhost ? vhost->root : Config::current()->doc_root;
+    // a url too long to be joined to the root names no file
+    if (snprintf(m_real_file, FILENAME_LEN, "%s%s", doc_root, m_url) >= FILENAME_LEN) {
+        return NO_RESOURCE;
+    }
+
+    // a small file another request, or another worker process, has read already
+    if (m_files) {
+        m_shared_file = m_files->lookup(m_real_file);
+        if (m_shared_file) {
+            return SHARED_REQUEST;
+        }
+    }
 
     // status of m_real_file
     if (stat(m_real_file, &m_file_stat) < 0) {
@@ -338,11 +575,44 @@ Http_conn::HTTP_CODE Http_conn::do_request() {
 
     // create the mmap
     m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    m_resident_end = 0;
+    if (m_file_address != MAP_FAILED) {
+        Disk_io::advise_sequential(fd, m_file_address, m_file_stat.st_size);
+    }
     
     close(fd);
     return FILE_REQUEST;
 }
 
+// the request goes to an upstream of route, unless its response is in the cache
+Http_conn::HTTP_CODE Http_conn::forward(const Proxy_route *route) {
+    const char *host = m_request.header_cstr(HEADER_HOST);
+    Cache_entry *entry = 0;
+    Response_cache::LOOKUP lookup = Response_cache::PASS;
+    char key[Response_cache::KEY_LEN];
+    // only GET is parsed
+    int key_len = m_cache ? Response_cache::make_key(key, sizeof(key), "GET", host, m_url, m_request.query.data()) : -1;
+    if (key_len > 0) {
+        // set before the lookup, the EPOLLOUT of a WAIT may come before it returns
+        m_cache_wait = true;
+        lookup = m_cache->lookup(key, key_len, &entry, m_epollfd, m_sockfd, event_data());
+        if (lookup == Response_cache::WAIT) {
+            return CACHE_WAIT;
+        }
+        m_cache_wait = false;
+    }
+    if (lookup == Response_cache::HIT) {
+        m_cached = entry;
+        return CACHE_REQUEST;
+    }
+
+    m_proxy = new Proxy_session(m_upstreams, route);
+    if (lookup == Response_cache::MISS) {
+        m_proxy->capture(m_cache, entry);
+    }
+    return PROXY_REQUEST;
+}
+
 // munmap
 void Http_conn::unmap() {
     if (m_file_address) {
@@ -351,25 +621,283 @@ void Http_conn::unmap() {
     }
 }
 
+// whether the next window of the mapped file is in memory, so sending it does not wait for the disk
+// a cold window is given to the disk threads, EPOLLOUT comes when they have read it
+bool Http_conn::window_resident() {
+    if (!m_disk || !m_file_address || m_iv_count < 2 || m_iv[1].iov_len == 0) {
+        return true;
+    }
+    const char *next = (const char*)m_iv[1].iov_base;
+    size_t offset = next - m_file_address;
+    if (offset < m_resident_end) {
+        return true;
+    }
+
+    size_t window = Config::current()->io_window;
+    if (window > m_iv[1].iov_len) {
+        window = m_iv[1].iov_len;
+    }
+    m_resident_end = offset + window;
+    if (m_disk->resident(next, window)) {
+        return true;
+    }
+    trace_wait();
+    m_disk->submit(next, window, m_epollfd, m_sockfd, event_data(), m_trace_id);
+    return false;
+}
+
+// read the first window of the mapped file in the calling worker, which may wait for the disk
+// instead of the event loop that sends it
+void Http_conn::read_first_window() {
+    if (!m_disk || !m_file_address || m_iv_count < 2 || m_iv[1].iov_len == 0) {
+        return;
+    }
+    size_t window = Config::current()->io_window;
+    if (window > m_iv[1].iov_len) {
+        window = m_iv[1].iov_len;
+    }
+    if (!m_disk->resident(m_file_address, window)) {
+        m_disk->populate(m_file_address, window);
+    }
+    m_resident_end = window;
+}
+
+// writev() of m_iv, without the bytes of the file beyond m_resident_end
+int Http_conn::send_iv() {
+    Trace_span span(m_trace_id, TRACE_WRITE);
+    int ret = 0;
+    if (!m_disk || !m_file_address || m_iv_count < 2) {
+        ret = writev(m_sockfd, m_iv, m_iv_count);
+    } else {
+        struct iovec iv[2] = {m_iv[0], m_iv[1]};
+        size_t offset = (const char*)m_iv[1].iov_base - m_file_address;
+        if (offset + iv[1].iov_len > m_resident_end) {
+            iv[1].iov_len = m_resident_end > offset ? m_resident_end - offset : 0;
+        }
+        ret = writev(m_sockfd, iv, 2);
+    }
+    if (ret > 0) {
+        Stats::add(Stats::m_segment->bytes_sent, ret);
+    }
+    return ret;
+}
+
+// skip the bytes that have been sent in m_iv
+void Http_conn::consume_iv(int bytes) {
+    for (int i = 0; i < m_iv_count && bytes > 0; ++i) {
+        if (bytes >= (int)m_iv[i].iov_len) {
+            bytes -= m_iv[i].iov_len;
+            m_iv[i].iov_len = 0;
+        } else {
+            m_iv[i].iov_base = (char*)m_iv[i].iov_base + bytes;
+            m_iv[i].iov_len -= bytes;
+            bytes = 0;
+        }
+    }
+}
+
+// ask the producer for the next part of the body and put it into m_iv[slot]
+// with chunked encoding the data is framed as "size\r\n data \r\n", the last chunk is "0\r\n\r\n"
+bool Http_conn::fill_chunk(int slot) {
+    char *data = m_stream_buf + CHUNK_HEADER_LEN;
+    int len = m_stream->produce(data, STREAM_BUFFER_SIZE - CHUNK_HEADER_LEN - 2);
+    if (len < 0) {
+        return false;
+    }
+
+    char *begin = data;
+    if (len == 0) {
+        m_stream_done = true;
+        if (m_stream_chunked) {
+            memcpy(data, "0\r\n\r\n", 5);
+            len = 5;
+        }
+    } else if (m_stream_chunked) {
+        // write the size line backwards, right in front of the data
+        begin = data - 2;
+        memcpy(begin, "\r\n", 2);
+        for (int n = len; n > 0; n >>= 4) {
+            *--begin = "0123456789abcdef"[n & 0xf];
+        }
+        memcpy(data + len, "\r\n", 2);
+        len += 2;
+    }
+
+    m_iv[slot].iov_base = begin;
+    m_iv[slot].iov_len = data + len - begin;
+    m_iv_count = slot + 1;
+    bytes_to_send += m_iv[slot].iov_len;
+    return true;
+}
+
+void Http_conn::set_cork(bool on) {
+    if (m_corked != on) {
+        int value = on;
+        setsockopt(m_sockfd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+        m_corked = on;
+    }
+}
+
+// delete the producer of the streamed response
+void Http_conn::release_stream() {
+    if (m_stream) {
+        delete m_stream;
+        m_stream = 0;
+    }
+}
+
+// keep the producer and respond with its output once the request has been processed
+Http_conn::HTTP_CODE Http_conn::start_stream(int status, const char *title, const char *content_type, Stream_producer *producer) {
+    release_stream();
+    if (!m_stream_buf) {
+        m_stream_buf = new char[STREAM_BUFFER_SIZE];
+    }
+    m_stream = producer;
+    m_stream_status = status;
+    m_stream_title = title;
+    m_stream_type = content_type;
+    m_stream_done = false;
+
+    // HTTP/1.0 does not know chunked encoding, the end of the body is the end of the connection
+    m_stream_chunked = !Http_request::equals_nocase(m_request.version, "HTTP/1.0");
+    if (!m_stream_chunked) {
+        m_linger = false;
+    }
+    return STREAM_REQUEST;
+}
+
+// delete the proxy session, an unfinished upstream connection is closed
+void Http_conn::release_proxy() {
+    if (m_proxy) {
+        delete m_proxy;
+        m_proxy = 0;
+    }
+}
+
+// give the cached response back to the cache
+void Http_conn::release_cached() {
+    if (m_cached) {
+        m_cache->release(m_cached);
+        m_cached = 0;
+    }
+}
+
+// the mapped file has been sent, so its pages are in memory, keep it in the file cache for the next requests
+// copying it earlier would read a cold file in the worker, around the disk threads
+void Http_conn::share_file() {
+    if (m_files && m_file_address && m_file_address != MAP_FAILED) {
+        m_files->store(m_real_file, m_file_stat, m_file_address);
+    }
+}
+
+// give the shared file back to the file cache
+void Http_conn::release_shared() {
+    if (m_shared_file) {
+        m_files->release(m_shared_file);
+        m_shared_file = 0;
+    }
+}
+
+void Http_conn::proxy_event(uint64_t tag) {
+    // the connection may have been closed by an earlier event of the same epoll_wait()
+    if (!m_proxy) {
+        return;
+    }
+
+    Proxy_session::RESULT ret = (tag & UPSTREAM_TIMER_TAG) ? m_proxy->on_timeout() : tag ? m_proxy->on_upstream() : m_proxy->on_client();
+    switch (ret) {
+        case Proxy_session::WAIT : {
+            break;
+        }
+        case Proxy_session::DONE : {
+            if (m_draining || !m_proxy->keep_client()) {
+                close_conn();
+                break;
+            }
+            // wait for the next request, as write() does after a response
+            release_proxy();
+            init();
+            modfd(m_epollfd, m_sockfd, EPOLLIN, event_data());
+            break;
+        }
+        case Proxy_session::BAD_GATEWAY : {
+            send_reject(m_sockfd, 502);
+            close_conn();
+            break;
+        }
+        default : {
+            close_conn();
+            break;
+        }
+    }
+}
+
 // HTTP response
 bool Http_conn::write() {
     int temp = 0;
+    trace_waited();
+
+    if (m_proxy) {
+        // the client socket is writable again, the proxy continues the relay
+        proxy_event(0);
+        return true;
+    }
 
-    if (bytes_to_send == 0) {
+    if (m_cache_wait) {
+        // the response the request waited for has been fetched, or its fetch has been given up
+        m_cache_wait = false;
+        respond(do_request());
+        return true;
+    }
+
+    if (bytes_to_send == 0 && !m_stream) {
         // no bytes to send, response ends
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+        modfd(m_epollfd, m_sockfd, EPOLLIN, event_data());
         init();
         return true;
     }
 
     while (true) {
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        if (bytes_to_send == 0) {
+            // the previous chunk has been accepted by the socket, produce the next one
+            if (m_stream && !m_stream_done) {
+                if (!fill_chunk(0)) {
+                    return false;
+                }
+                continue;
+            }
+
+            // no data to be sent
+            share_file();
+            unmap();
+            set_cork(false);
+            modfd(m_epollfd, m_sockfd, EPOLLIN, event_data());
+            if (m_linger) {
+                init();
+                return true;
+            } else {
+                return false;
+            }
+        }
+
+        // the socket is corked while the response is written, so headers and small chunks leave in full frames
+        if (bytes_have_send == 0 && Config::current()->tcp_cork) {
+            set_cork(true);
+        }
+
+        // the event loop does not wait for the disk, the disk threads arm EPOLLOUT once the file is read
+        if (!window_resident()) {
+            return true;
+        }
+
+        temp = send_iv();
         if (temp <= -1) {
             // if  writing buffer is full, wait for next EPOLLOUT event
             // although the server cannot receive the next request from the same clinet during waiting
             // the connection can keep complete
             if (errno == EAGAIN) {
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                trace_wait();
+                modfd(m_epollfd, m_sockfd, EPOLLOUT, event_data());
                 return true;
             }
             unmap();
@@ -378,42 +906,22 @@ bool Http_conn::write() {
 
         bytes_to_send -= temp;
         bytes_have_send += temp;
-
-        if (bytes_have_send >= m_iv[0].iov_len) {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-        } else {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
-        }
-
-        if (bytes_to_send <= 0) {
-            // no data to be sent
-            unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
-            if (m_linger) {
-                init();
-                return true;
-            } else {
-                return false;
-            }
-        }
+        consume_iv(temp);
     }
 }
 
 
 // write data into writing buffer
 bool Http_conn::add_response(const char *format, ...) {
-    if (m_write_idx >= WRITE_BUFFER_SIZE) {
+    if (m_write_idx >= m_write_buffer_size) {
         return false;
     }
 
     va_list arg_list;
     va_start(arg_list, format);
 
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-    if (len >= WRITE_BUFFER_SIZE - 1 - m_write_idx) {
+    int len = vsnprintf(m_write_buf + m_write_idx, m_write_buffer_size - 1 - m_write_idx, format, arg_list);
+    if (len >= m_write_buffer_size - 1 - m_write_idx) {
         return false;
     }
     m_write_idx += len;
@@ -422,6 +930,7 @@ bool Http_conn::add_response(const char *format, ...) {
 }
 
 bool Http_conn::add_status_line(int status, const char *title) {
+    Stats::response(status);
     return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
 }
 
@@ -438,9 +947,16 @@ bool Http_conn::add_content_length(int content_len) {
 }
 
 bool Http_conn::add_linger() {
+    if (m_draining) {
+        m_linger = false;
+    }
     return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
 }
 
+bool Http_conn::add_transfer_encoding() {
+    return add_response("Transfer-Encoding: %s\r\n", "chunked");
+}
+
 bool Http_conn::add_blank_line() {
     return add_response("%s", "\r\n");
 }
@@ -492,6 +1008,15 @@ bool Http_conn::process_write(HTTP_CODE ret) {
             break;
         }
 
+        case LIMITED_REQUEST : {
+            add_status_line(429, error_429_title);
+            add_headers(strlen(error_429_form));
+            if (!add_content(error_429_form)) {
+                return false;
+            }
+            break;
+        }
+
         case FILE_REQUEST : {
             add_status_line(200, ok_200_title);
             add_headers(m_file_stat.st_size);
@@ -506,6 +1031,86 @@ bool Http_conn::process_write(HTTP_CODE ret) {
             return true;
         }
 
+        case SHARED_REQUEST : {
+            add_status_line(200, ok_200_title);
+            add_headers(m_shared_file->size);
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = m_write_idx;
+            m_iv[1].iov_base = m_shared_file->body;
+            m_iv[1].iov_len = m_shared_file->size;
+            m_iv_count = 2;
+
+            bytes_to_send = m_write_idx + m_shared_file->size;
+            return true;
+        }
+
+        case ASSET_REQUEST : {
+            // the client has this content already
+            std::string_view if_none_match = m_request.header(HEADER_IF_NONE_MATCH);
+            if (m_asset.etag_len > 0 && !if_none_match.empty()
+                && (if_none_match == "*" || if_none_match.find(std::string_view(m_asset.etag, m_asset.etag_len)) != std::string_view::npos)) {
+                add_status_line(304, not_modified_304_title);
+                add_response("ETag: %.*s\r\n", m_asset.etag_len, m_asset.etag);
+                add_linger();
+                if (!add_blank_line()) {
+                    return false;
+                }
+                break;
+            }
+
+            // the headers and the content were rendered before, only the headers about this connection are added
+            add_status_line(200, ok_200_title);
+            if (!add_linger()) {
+                return false;
+            }
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = m_write_idx;
+            m_iv[1].iov_base = (void*)m_asset.data;
+            m_iv[1].iov_len = m_asset.len;
+            m_iv_count = 2;
+
+            bytes_to_send = m_write_idx + m_asset.len;
+            return true;
+        }
+
+        case STREAM_REQUEST : {
+            // the length is unknown, the body follows the headers chunk by chunk
+            add_status_line(m_stream_status, m_stream_title);
+            add_response("Content-Type:%s\r\n", m_stream_type);
+            if (m_stream_chunked) {
+                add_transfer_encoding();
+            }
+            add_linger();
+            if (!add_blank_line()) {
+                return false;
+            }
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = m_write_idx;
+            bytes_to_send = m_write_idx;
+
+            // send the first chunk together with the headers
+            return fill_chunk(1);
+        }
+
+        case CACHE_REQUEST : {
+            // the stored response is sent as it is, after its status line and the headers about this connection
+            // only 200 responses are stored
+            Stats::response(200);
+            add_response("%.*s", m_cached->status_len, m_cached->data);
+            add_response("Age: %d\r\n", (int)(time(NULL) - m_cached->stored));
+            if (!add_linger()) {
+                return false;
+            }
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = m_write_idx;
+            m_iv[1].iov_base = m_cached->data + m_cached->status_len;
+            m_iv[1].iov_len = m_cached->len - m_cached->status_len;
+            m_iv_count = 2;
+
+            bytes_to_send = m_write_idx + m_iv[1].iov_len;
+            return true;
+        }
+
         default: {
             return false;
         }
@@ -513,23 +1118,186 @@ bool Http_conn::process_write(HTTP_CODE ret) {
     m_iv[0].iov_base = m_write_buf;
     m_iv[0].iov_len = m_write_idx;
     m_iv_count = 1;
+    bytes_to_send = m_write_idx;
     return true;
 }
 
+void Http_conn::resume(uint32_t events) {
+#ifdef __cpp_impl_coroutine
+    // the object may be reused by another connection once the coroutine returns, it is not touched after
+    m_events = events;
+    m_running_coro = m_coro;
+    std::coroutine_handle<>::from_address(m_coro).resume();
+    m_running_coro = NULL;
+#else
+    // without coroutines no connection has one to resume
+    (void)events;
+#endif
+}
+
+void Http_conn::wait_event(uint32_t ev) {
+    modfd(m_epollfd, m_sockfd, ev, event_data());
+}
+
+#ifdef __cpp_impl_coroutine
+// the same steps as the callbacks, in the event loop, with the waits written where they happen
+// the requests the callbacks handle in several steps, proxied, streamed or waiting for the cache,
+// are given to them with the rest of the connection
+Conn_task Http_conn::serve() {
+    while (true) {
+        if ((m_events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) || !read()) {
+            close_conn();
+            co_return;
+        }
+
+        if (m_limiter) {
+            Rate_limiter::VERDICT verdict = m_limiter->on_request(client_ip());
+            if (verdict != Rate_limiter::ADMIT) {
+                reject(verdict);
+                co_return;
+            }
+        }
+
+        HTTP_CODE ret = process_read();
+        if (ret == NO_REQUEST) {
+            co_await Io_wait(this, EPOLLIN);
+            continue;
+        }
+        if (ret == PROXY_REQUEST || ret == STREAM_REQUEST || ret == CACHE_WAIT) {
+            m_coro = NULL;
+            respond(ret);
+            co_return;
+        }
+        if (!process_write(ret)) {
+            close_conn();
+            co_return;
+        }
+
+        bool ok = true;
+        while (bytes_to_send > 0) {
+            if (bytes_have_send == 0 && Config::current()->tcp_cork) {
+                set_cork(true);
+            }
+            if (!window_resident()) {
+                // the disk threads arm EPOLLOUT once the window is read, the loop resumes the coroutine then
+                co_await std::suspend_always();
+                trace_waited();
+                if (m_events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    ok = false;
+                    break;
+                }
+                continue;
+            }
+            int temp = send_iv();
+            if (temp < 0) {
+                if (errno != EAGAIN) {
+                    ok = false;
+                    break;
+                }
+                trace_wait();
+                co_await Io_wait(this, EPOLLOUT);
+                trace_waited();
+                if (m_events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    ok = false;
+                    break;
+                }
+                continue;
+            }
+            bytes_to_send -= temp;
+            bytes_have_send += temp;
+            consume_iv(temp);
+        }
+
+        if (ok) {
+            share_file();
+        }
+        unmap();
+        if (!ok || !m_linger) {
+            close_conn();
+            co_return;
+        }
+        set_cork(false);
+        init();
+        co_await Io_wait(this, EPOLLIN);
+    }
+}
+#endif
+
 // called by working thread in the thread pool
 void Http_conn::process() {
+    uint64_t start = Tracer::now();
+    if (m_queued_at) {
+        Stats::observe_ticks(STATS_QUEUE, start - m_queued_at);
+        if (m_trace_id) {
+            Tracer::record(m_trace_id, TRACE_QUEUE, m_queued_at, start);
+        }
+        m_queued_at = 0;
+    }
     HTTP_CODE read_ret = process_read();
+    if (read_ret != NO_REQUEST) {
+        Stats::observe_ticks(STATS_PARSE, Tracer::now() - start);
+    }
     if (read_ret == NO_REQUEST) {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+        modfd(m_epollfd, m_sockfd, EPOLLIN, event_data());
+        return;
+    }
+    respond(read_ret);
+}
+
+// answer the request, in a worker thread or in the event loop after waiting for the cache
+void Http_conn::respond(HTTP_CODE read_ret) {
+    if (read_ret == CACHE_WAIT) {
+        // the connection belongs to the thread handling its EPOLLOUT, it may have it already
+        return;
+    }
+
+    if (read_ret == PROXY_REQUEST) {
+        // the event loop takes over once the upstream is connected, m_proxy must not be touched here any more
+        Stats::add(Stats::m_segment->proxied);
+        bool http10 = Http_request::equals_nocase(m_request.version, "HTTP/1.0");
+        if (!m_proxy->start(m_epollfd, m_sockfd, event_data(), m_url, m_request.query.data(), m_request.header_cstr(HEADER_HOST),
+                            http10, client_ip(), m_linger && !m_draining, Config::current()->proxy_timeout)) {
+            send_reject(m_sockfd, 502);
+            close_conn();
+        }
         return;
     }
 
     // generate the response
-    bool write_ret = process_write(read_ret);
-    if (!write_ret) {
-        close_conn();
+    {
+        Trace_span span(m_trace_id, TRACE_RESPOND);
+        bool write_ret = process_write(read_ret);
+        if (!write_ret) {
+            close_conn();
+            return;
+        }
+        // files are answered in the workers, they wait for the disk instead of the event loop
+        read_first_window();
+    }
+    trace_wait();
+    modfd(m_epollfd, m_sockfd, EPOLLOUT, event_data());
+}
+
+void Http_conn::trace_waited() {
+    if (m_trace_id && m_trace_wait) {
+        Tracer::record(m_trace_id, TRACE_WAIT, m_trace_wait, Tracer::now());
+        m_trace_wait = 0;
+    }
+}
+
+void Http_conn::end_request() {
+    // a connection closed before a byte of a request came has no request
+    if (m_request_start && m_read_idx > 0) {
+        uint64_t end = Tracer::now();
+        Stats::observe_ticks(STATS_REQUEST, end - m_request_start);
+        if (m_trace_id) {
+            Tracer::record(m_trace_id, TRACE_REQUEST, m_request_start, end);
+        }
     }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+    m_request_start = 0;
+    m_queued_at = 0;
+    m_trace_id = 0;
+    m_trace_wait = 0;
 }
 
 
@@ -21,39 +21,85 @@
 #include "locker.h"
 #include "cond.h"
 #include "sem.h"
+#include "limiter.h"
+#include "config.h"
+#include "affinity.h"
+#include "assets.h"
+#include "coroutine.h"
+#include "request.h"
+#include "trace.h"
+#include "stats.h"
+#include "file_cache.h"
+
+class Proxy;
+class Proxy_session;
+class Response_cache;
+struct Cache_entry;
+class Conn_pool;
+class Vhost_table;
+class Disk_io;
+class Router;
+struct Proxy_route;
+
+// the epoll data of a connection is the address of its object, with the generation of the object
+// in the bits above CONN_GENERATION_SHIFT, the other sockets carry their fd
+#define CONN_GENERATION_SHIFT 48
+#define CONN_POINTER_MASK ((1ULL << CONN_GENERATION_SHIFT) - 8)
 
 
 int set_nonblocking(int fd);
 
-// append the fd that needs to be listened into epoll
-void addfd(int epollfd, int fd, bool one_shot);
+// append the fd that needs to be listened into epoll, its events carry data
+void addfd(int epollfd, int fd, bool one_shot, uint64_t data);
 
 // remove the fd that needs to be listened from epoll
 void removefd(int epollfd, int fd);
 
 // modify the fd, reset the EPOLLONESHOT event on socket
 // this is to ensure that EPOLLIN event can be triggered on next read()
-void modfd(int epollfd, int fd, int ev);
+void modfd(int epollfd, int fd, int ev, uint64_t data);
+
+// send a prebuilt response with status to a client that will not be served
+// it is used before anything is parsed, so it never blocks and never allocates
+void send_reject(int fd, int status);
+
+// producer of a streamed response body
+// the connection calls produce() whenever the socket has accepted the previous chunk,
+// so a slow client applies backpressure to the producer through EPOLLOUT
+class Stream_producer
+{
+public:
+    virtual ~Stream_producer() {}
+
+    // fill at most size bytes of body into buf
+    // return the number of bytes filled, 0 when the body ends, -1 on error
+    virtual int produce(char *buf, int size) = 0;
+};
 
 class Http_conn
 {
+    friend class Conn_pool;
+
 public:
     // maximum length of filename
-    static const int FILENAME_LEN = 200; 
-    
-    // size of the reading buffer
-    static const int READ_BUFFER_SIZE = 2048;
+    static const int FILENAME_LEN = 512; 
 
-    // size of the writing buffer
-    static const int WRITE_BUFFER_SIZE = 1024;
+    // size of the buffer holding one chunk of a streamed response
+    static const int STREAM_BUFFER_SIZE = 8192;
+
+    // room reserved in front of a chunk for its hexadecimal size line
+    static const int CHUNK_HEADER_LEN = 10;
 
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
 
     // status of FSM
     enum CHECK_STATE {CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT};
 
+    // the lanes of the thread pool, in the order of its PRIORITY
+    enum LANE {LANE_HIGH = 0, LANE_NORMAL, LANE_LOW};
+
     // results of processing HTTP requests
-    enum HTTP_CODE {NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION};
+    enum HTTP_CODE {NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, LIMITED_REQUEST, FILE_REQUEST, STREAM_REQUEST, PROXY_REQUEST, CACHE_REQUEST, CACHE_WAIT, ASSET_REQUEST, SHARED_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION};
 
     // status of line
     // LINE_OK: get a complete line
@@ -62,21 +108,76 @@ public:
     enum LINE_STATUS {LINE_OK = 0, LINE_BAD, LINE_OPEN};
 
 public:
-    // all events of socket is registered in one epoll
-    static int m_epollfd;
+    // size of the reading buffer, set from the config before any connection is initialized
+    static int m_read_buffer_size;
+
+    // size of the writing buffer, set from the config before any connection is initialized
+    static int m_write_buffer_size;
+
+    // allocator of the reading and writing buffers, one block of m_read_buffer_size + m_write_buffer_size
+    static Node_buffers *m_buffers;
+
+    // number of users, changed by the threads opening and closing connections
+    static std::atomic<int> m_user_count;
+
+    // the objects of the connections, every closed connection gives its object back
+    static Conn_pool *m_pool;
+
+    // the files of doc_root loaded at startup, NULL if they are read from the filesystem
+    static Asset_store *m_assets;
+
+    // the packed files of the bundle setting, NULL if there is no bundle
+    static Asset_bundle *m_bundle;
 
-    // number of users
-    static int m_user_count;
+    // the sites served by name, NULL if every request is served from doc_root
+    static Vhost_table *m_vhosts;
+
+    // the threads reading the files that are not in memory, NULL if the event loops wait for them
+    static Disk_io *m_disk;
+
+    // limiter of the clients, NULL if clients are not limited
+    static Rate_limiter *m_limiter;
+
+    // set when the server shuts down, responses close their connection instead of keeping it alive
+    static bool m_draining;
+
+    // routes and connection pools of the reverse proxy, NULL if nothing is proxied
+    static Proxy *m_upstreams;
+
+    // the paths answered by handlers instead of files, NULL if every request is for a file
+    static Router *m_router;
+
+    // responses of the upstreams kept in memory, NULL if they are not cached
+    static Response_cache *m_cache;
+
+    // small files shared by the worker processes, NULL if every file is opened and mapped
+    static File_cache *m_files;
+
+    // whether new connections are served by a coroutine in their event loop instead of the thread pool
+    static bool m_use_coroutines;
 
 private:
     // fd of socket
     int m_sockfd;
 
+    // changed whenever the connection closes, an event carrying another generation is for an old connection
+    uint16_t m_generation;
+
+    // NUMA node of the slab of the object, and the next free object while it is unused
+    int m_pool_node;
+    Http_conn *m_pool_next;
+
+    // the epoll of the event loop the socket is registered in
+    int m_epollfd;
+
     // socket address of another one
     sockaddr_in m_address;
 
-    // reading buffer
-    char m_read_buf[READ_BUFFER_SIZE];
+    // reading buffer, allocated on the NUMA node of the event loop when the object is used
+    char *m_read_buf;
+
+    // NUMA node of the buffers
+    int m_buf_node;
     
     // the next index of the last byte that has been read
     int m_read_idx;
@@ -96,14 +197,11 @@ private:
     // the complete file path of requested file, it is equal to doc_root + m_url
     char m_real_file[FILENAME_LEN];
 
-    // the filename of requested file
-    char *m_url;
-
-    // version of HTTP
-    char *m_version;
+    // the request being handled, its parts are views into the reading buffer
+    Http_request m_request;
 
-    // hostname
-    char *m_host;
+    // the filename of requested file, the decoded path of m_request
+    char *m_url;
 
     // the total length of HTTP request
     int m_content_length;
@@ -111,8 +209,8 @@ private:
     // whether the HTTP request requires keeping connection
     bool m_linger;
 
-    // writing buffer
-    char m_write_buf[WRITE_BUFFER_SIZE];
+    // writing buffer, it follows the reading buffer in the same block
+    char *m_write_buf;
 
     // number of bytes waiting to be sent in the writing buffer
     int m_write_idx;
@@ -123,6 +221,15 @@ private:
     // status of target file
     struct stat m_file_stat;
 
+    // the bytes of the mapped file from the start known to be in memory, nothing beyond is sent
+    size_t m_resident_end;
+
+    // the loaded or packed file being sent, instead of m_file_address
+    Asset m_asset;
+
+    // the file of the shared file cache being sent, NULL if the file is not from it
+    Cached_file *m_shared_file;
+
     // for writing
     struct iovec m_iv[2];
 
@@ -135,17 +242,91 @@ private:
     // number of bytes that have been sent
     int bytes_have_send;
 
+    // producer of the streamed response body, NULL if the response is not streamed
+    Stream_producer *m_stream;
+
+    // status line and content type of the streamed response
+    int m_stream_status;
+    const char *m_stream_title;
+    const char *m_stream_type;
+
+    // whether the body is sent with chunked encoding, HTTP/1.0 clients get a raw body instead
+    bool m_stream_chunked;
+
+    // whether the producer has reported the end of the body
+    bool m_stream_done;
+
+    // buffer for the chunk being sent, STREAM_BUFFER_SIZE bytes allocated by the first streamed response
+    char *m_stream_buf;
+
+    // whether TCP_CORK is set on the socket
+    bool m_corked;
+
+    // the request forwarded to an upstream, NULL if the request is not proxied
+    Proxy_session *m_proxy;
+
+    // the cached response being sent, NULL if the response is not from the cache
+    Cache_entry *m_cached;
+
+    // whether the request waits for a response another request is fetching, EPOLLOUT comes when it is there
+    bool m_cache_wait;
+
+    // the coroutine serving the connection, NULL if the callbacks serve it
+    void *m_coro;
+
+    // the events the coroutine is resumed with
+    uint32_t m_events;
+
+    // when the first byte of the request was read, in ticks of Tracer::now(), 0 before
+    uint64_t m_request_start;
+
+    // when the request was handed to the thread pool, 0 once a worker has it
+    uint64_t m_queued_at;
+
+    // the trace id of the request, 0 if it is not sampled, and when EPOLLOUT was armed if it is
+    uint32_t m_trace_id;
+    uint64_t m_trace_wait;
+
+    // the coroutine running in this thread, it cannot be destroyed by close_conn()
+    static thread_local void *m_running_coro;
+
 public:
     Http_conn();
 
     ~Http_conn();
 
-    // initializing new connections
-    void init(int sockfd, const sockaddr_in& addr);
+    // initializing new connections, the socket is registered in epollfd
+    // whose event loop runs on NUMA node
+    // false if there is no memory for the buffers, the socket is left to the caller
+    bool init(int sockfd, const sockaddr_in& addr, int epollfd, int node);
 
-    // close the socket connection
+    // close the socket connection, the object goes back to the pool and must not be used any more
     void close_conn();
 
+    // what the events of the connection carry
+    uint64_t event_data() const;
+
+    // the connection an event is for, NULL if that connection has been closed since
+    static Http_conn* from_event(uint64_t data);
+
+    // answer with a prebuilt response and close the connection, the request is not parsed
+    void reject(int status);
+
+    // whether the connection belongs to the event loop of epollfd,
+    // and waits for a new request with nothing received yet
+    // only meaningful in the thread of that event loop
+    bool idle(int epollfd) const;
+
+    // source address of the client in network byte order
+    uint32_t client_ip() const;
+
+    // the lane of the thread pool for the request read so far, from its request line, before it is parsed
+    // files served from memory go first and proxied requests last, anything unsure is LANE_NORMAL
+    LANE lane() const;
+
+    // the request being handled, complete once it has been parsed
+    const Http_request& request() const { return m_request; }
+
     // process the request from clients
     void process();
 
@@ -155,9 +336,36 @@ public:
     // non-blocking write
     bool write();
 
+    // an event while the request is proxied, tag is UPSTREAM_TAG for the upstream socket,
+    // UPSTREAM_TIMER_TAG for its deadline, 0 for the client socket
+    void proxy_event(uint64_t tag);
+
+    // whether the events of the connection resume its coroutine
+    bool in_coroutine() const { return m_coro != NULL; }
+
+    // resume the coroutine with the events of the socket
+    void resume(uint32_t events);
+
+    // arm the socket for ev, the coroutine is suspended until it comes
+    void wait_event(uint32_t ev);
+
+    // respond with a body generated by producer instead of a file
+    // called while handling the request, the connection takes ownership of producer
+    // and the caller returns STREAM_REQUEST
+    HTTP_CODE start_stream(int status, const char *title, const char *content_type, Stream_producer *producer);
+
+    // send the request to an upstream of route, or answer it from the cache
+    // called while handling the request, the caller returns the result
+    HTTP_CODE forward(const Proxy_route *route);
+
 private:
     void init();
 
+#ifdef __cpp_impl_coroutine
+    // read, answer and send the requests of the connection one after another
+    Conn_task serve();
+#endif
+
     // analyze the HTTP request
     HTTP_CODE process_read();
 
@@ -174,6 +382,29 @@ private:
 
     // these functions are used by process_write() to complete the HTTP response
     void unmap();
+    bool window_resident();
+    void read_first_window();
+    int send_iv();
+    void consume_iv(int bytes);
+    bool fill_chunk(int slot);
+    void release_stream();
+    void set_cork(bool on);
+    void release_proxy();
+    void release_cached();
+    void release_shared();
+    void share_file();
+    void respond(HTTP_CODE ret);
+
+    // note that the request waits for EPOLLOUT from now, and record the wait once it comes
+    void trace_wait() {
+        if (m_trace_id) {
+            m_trace_wait = Tracer::now();
+        }
+    }
+    void trace_waited();
+
+    // count the whole request in the stats and the trace once its response has been sent or its connection closed
+    void end_request();
     bool add_response(const char *format, ...);
     bool add_content(const char *content);
     bool add_content_type();
@@ -181,6 +412,7 @@ private:
     bool add_headers(int content_length);
     bool add_content_length(int content_length);
     bool add_linger();
+    bool add_transfer_encoding();
     bool add_blank_line();
 
 };
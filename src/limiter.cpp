@@ -0,0 +1,162 @@
+#include "limiter.h"
+
+Rate_limiter::Rate_limiter(int capacity, int ip_rate, int ip_burst, int ip_max_conns, int global_rate, int global_burst) :
+m_ip_rate(ip_rate),
+m_ip_burst(ip_burst),
+m_ip_max_conns(ip_max_conns),
+m_global_rate(global_rate),
+m_global_burst(global_burst) {
+    if (capacity <= 0) {
+        throw std::exception();
+    }
+
+    // round the capacity up to a power of 2, so the slot is ip & m_mask
+    uint32_t size = 1;
+    while (size < (uint32_t)capacity) {
+        size <<= 1;
+    }
+    m_mask = size - 1;
+
+    // ip 0 with no connections and no bucket marks an empty slot
+    m_table = new Entry[size];
+    for (uint32_t i = 0; i < size; ++i) {
+        m_table[i].ip = 0;
+        m_table[i].conns = 0;
+        m_table[i].bucket.tokens = m_ip_burst;
+        m_table[i].bucket.last_ms = 0;
+    }
+
+    m_global.tokens = m_global_burst;
+    m_global.last_ms = now_ms();
+}
+
+Rate_limiter::~Rate_limiter() {
+    delete[] m_table;
+}
+
+uint32_t Rate_limiter::now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+bool Rate_limiter::take(Token_bucket& b, uint32_t now, int rate, int burst) {
+    if (rate <= 0) {
+        return true;
+    }
+
+    // refill with the tokens earned since the last call
+    b.tokens += (float)(uint32_t)(now - b.last_ms) * rate / 1000;
+    if (b.tokens > burst) {
+        b.tokens = burst;
+    }
+    b.last_ms = now;
+
+    if (b.tokens < 1) {
+        return false;
+    }
+    b.tokens -= 1;
+    return true;
+}
+
+bool Rate_limiter::reusable(const Entry& e, uint32_t now) const {
+    if (e.conns != 0) {
+        return false;
+    }
+    if (m_ip_rate <= 0) {
+        return true;
+    }
+    return e.bucket.tokens + (float)(uint32_t)(now - e.bucket.last_ms) * m_ip_rate / 1000 >= m_ip_burst;
+}
+
+Rate_limiter::Entry* Rate_limiter::find(uint32_t ip, uint32_t now, bool insert) {
+    // mix the address, the low bits of neighbouring clients are too similar
+    uint32_t h = ip * 2654435761u;
+    h ^= h >> 16;
+
+    Entry *free_slot = NULL;
+    for (int i = 0; i < MAX_PROBE; ++i) {
+        Entry *e = m_table + ((h + i) & m_mask);
+        if (e->ip == ip && (ip != 0 || e->conns != 0)) {
+            return e;
+        }
+        if (!free_slot && reusable(*e, now)) {
+            free_slot = e;
+        }
+    }
+
+    if (!insert || !free_slot) {
+        return NULL;
+    }
+
+    // the slot is taken over by ip, the old entry had nothing to remember
+    free_slot->ip = ip;
+    free_slot->conns = 0;
+    free_slot->bucket.tokens = m_ip_burst;
+    free_slot->bucket.last_ms = now;
+    return free_slot;
+}
+
+Rate_limiter::VERDICT Rate_limiter::on_accept(uint32_t ip) {
+    uint32_t now = now_ms();
+    m_locker.lock();
+
+    if (!take(m_global, now, m_global_rate, m_global_burst)) {
+        m_locker.unlock();
+        return SERVICE_UNAVAILABLE;
+    }
+
+    Entry *e = find(ip, now, true);
+    if (!e) {
+        // all slots around ip are used by active clients
+        m_locker.unlock();
+        return SERVICE_UNAVAILABLE;
+    }
+
+    if (m_ip_max_conns > 0 && e->conns >= (uint32_t)m_ip_max_conns) {
+        m_locker.unlock();
+        return TOO_MANY_REQUESTS;
+    }
+
+    ++e->conns;
+    m_locker.unlock();
+    return ADMIT;
+}
+
+Rate_limiter::VERDICT Rate_limiter::on_request(uint32_t ip) {
+    if (m_ip_rate <= 0) {
+        return ADMIT;
+    }
+
+    uint32_t now = now_ms();
+    m_locker.lock();
+
+    // the connection holds the entry, so it is always found
+    Entry *e = find(ip, now, true);
+    VERDICT ret = ADMIT;
+    if (!e || !take(e->bucket, now, m_ip_rate, m_ip_burst)) {
+        ret = TOO_MANY_REQUESTS;
+    }
+
+    m_locker.unlock();
+    return ret;
+}
+
+void Rate_limiter::on_close(uint32_t ip) {
+    m_locker.lock();
+    Entry *e = find(ip, now_ms(), false);
+    if (e && e->conns > 0) {
+        --e->conns;
+    }
+    m_locker.unlock();
+}
+
+void Rate_limiter::set_limits(int ip_rate, int ip_burst, int ip_max_conns, int global_rate, int global_burst) {
+    m_locker.lock();
+    m_ip_rate = ip_rate;
+    m_ip_burst = ip_burst;
+    m_ip_max_conns = ip_max_conns;
+    m_global_rate = global_rate;
+    m_global_burst = global_burst;
+    m_locker.unlock();
+}
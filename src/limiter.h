@@ -0,0 +1,87 @@
+#ifndef __LIMITER__H
+#define __LIMITER__H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "locker.h"
+
+// token bucket, it is refilled lazily when it is used, so no timer has to scan the buckets
+struct Token_bucket
+{
+    // tokens left
+    float tokens;
+
+    // time of the last refill in milliseconds
+    uint32_t last_ms;
+};
+
+// class Rate_limiter limits connections and requests per source IP and connections globally
+// the per-IP state is kept in an open-addressing hash table of fixed size,
+// every operation probes at most MAX_PROBE slots
+class Rate_limiter
+{
+public:
+    // result of admission, it is the status code that rejects the client
+    enum VERDICT {ADMIT = 0, TOO_MANY_REQUESTS = 429, SERVICE_UNAVAILABLE = 503};
+
+    // number of slots that are probed for one address
+    static const int MAX_PROBE = 16;
+
+    // a rate of 0 disables the bucket, a max_conns of 0 disables the connection cap
+    Rate_limiter(int capacity, int ip_rate, int ip_burst, int ip_max_conns, int global_rate, int global_burst);
+
+    ~Rate_limiter();
+
+    // called when a connection is accepted, counts the connection if it is admitted
+    VERDICT on_accept(uint32_t ip);
+
+    // called when a request arrives on an admitted connection, before it is parsed
+    VERDICT on_request(uint32_t ip);
+
+    // called when an admitted connection is closed
+    void on_close(uint32_t ip);
+
+    // change the limits, the state of the clients is kept
+    void set_limits(int ip_rate, int ip_burst, int ip_max_conns, int global_rate, int global_burst);
+
+    // refill the bucket and take one token from it, a rate of 0 always gives one
+    static bool take(Token_bucket& b, uint32_t now, int rate, int burst);
+
+    // the clock of the buckets
+    static uint32_t now_ms();
+
+private:
+    // state of one source IP
+    struct Entry
+    {
+        uint32_t ip;
+        uint32_t conns;
+        Token_bucket bucket;
+    };
+
+    // the slot of ip, or NULL if ip is not in the table and cannot be inserted
+    Entry* find(uint32_t ip, uint32_t now, bool insert);
+
+    // whether the slot carries no state, an idle entry with a full bucket is as good as empty
+    bool reusable(const Entry& e, uint32_t now) const;
+
+private:
+    // slots of the table, the size is a power of 2
+    Entry *m_table;
+    uint32_t m_mask;
+
+    int m_ip_rate;
+    int m_ip_burst;
+    int m_ip_max_conns;
+    int m_global_rate;
+    int m_global_burst;
+
+    // bucket shared by all new connections
+    Token_bucket m_global;
+
+    // close_conn() runs in the working threads, so the table is protected by a locker
+    Locker m_locker;
+};
+
+#endif
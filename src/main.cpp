@@ -1,5 +1,6 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -8,23 +9,49 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/wait.h>
 
 #include "locker.h"
 #include "cond.h"
 #include "sem.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "config.h"
+#include "upgrade.h"
+#include "affinity.h"
+#include "proxy.h"
+#include "cache.h"
+#include "conn_pool.h"
+#include "assets.h"
+#include "event_batch.h"
+#include "spin.h"
+#include "vhost.h"
+#include "disk_io.h"
+#include "router.h"
+#include "handlers.h"
+#include "stats.h"
+#include "file_cache.h"
+#include "cluster.h"
 #include "threadpool.cpp"
 
-#define MAX_FD 65536 // maximum number of fd
-#define MAX_EVENT_NUMBER 10000 // maximum number of events listened
-
 
 // definition is in http_conn.cpp
-extern void addfd(int epollfd, int fd, bool one_shot); 
+extern void addfd(int epollfd, int fd, bool one_shot, uint64_t data); 
 extern void removefd(int epollfd, int fd);
 
+// the signal handler only passes the signal to the main loop through this pipe
+static int sig_pipefd[2];
+
+void sig_handler(int sig) {
+    int save_errno = errno;
+    char msg = sig;
+    send(sig_pipefd[1], &msg, 1, 0);
+    errno = save_errno;
+}
+
 void addsig(int sig, void(handler)(int)) {
     struct sigaction sa;
     memset(&sa, '\0', sizeof(sa));
@@ -33,108 +60,774 @@ void addsig(int sig, void(handler)(int)) {
     assert(sigaction(sig, &sa, NULL) != 1);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc <= 1) {
-        printf("usage: %s port_number\n", basename(argv[0]));
-        return 1;
-    }
+struct Reactor;
 
-    int port = atoi(argv[1]);
-    addsig(SIGPIPE, SIG_IGN);
+// state shared by the event loops
+struct Server
+{
+    int argc;
+    char **argv;
 
-    Threadpool< Http_conn > *pool = NULL;
-    try {
-        pool = new Threadpool< Http_conn >;
-    } catch(...) {
-        printf("nonono\n");
-        return 1;
-    }
+    Threadpool< Http_conn > *pool;
+    Conn_pool *conns;
+    Rate_limiter *limiter;
 
-    Http_conn *users = new Http_conn[MAX_FD];
+    // the listening socket, -1 once the server drains
+    int listenfd;
 
-    // create the socket
+    // eventfd written when the server starts draining, it wakes up every event loop
+    int wakefd;
+
+    // parent side of the channel to a new binary while an upgrade is in progress
+    int upgrade_fd;
+
+    volatile bool draining;
+    time_t drain_deadline;
+
+    Reactor *reactors;
+    int reactor_number;
+
+    // the reactor pinned to each cpu, -1 if none, NULL if the reactors are not pinned
+    int *cpu_reactor;
+};
+
+// one event loop
+// every reactor has its own epoll, they share the listening socket and the thread pool,
+// a connection stays in the epoll of the reactor that accepted it
+// reactor 0 runs in the main thread and also handles the signals
+struct Reactor
+{
+    int id;
+    int epollfd;
+    pthread_t thread;
+    Server *server;
+
+    // the cpu the reactor is pinned to, -1 if it is not pinned, and its NUMA node
+    int cpu;
+    int node;
+
+    // whether this reactor has noticed the drain
+    bool drained;
+
+    // the interest changes and the metrics of the loop, NULL until it runs
+    Event_batch *batch;
+};
+
+// create the listening socket
+int open_listen(const Config& config) {
     int listenfd = socket(PF_INET, SOCK_STREAM, 0);
 
-    int ret;
     struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_family = AF_INET;
-    address.sin_port = htons(port);
+    address.sin_port = htons(config.port);
 
     // port reuse and binding
     int reuse = 1;
     setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    ret = bind(listenfd, (struct sockaddr*)(&address), sizeof(address));
-    ret = listen(listenfd, 5);
+    if (bind(listenfd, (struct sockaddr*)(&address), sizeof(address)) < 0) {
+        printf("cannot bind port %d, errno is : %d\n", config.port, errno);
+        close(listenfd);
+        return -1;
+    }
+    listen(listenfd, config.listen_backlog);
+
+    // wake up accept() only when the request has arrived
+    if (config.tcp_defer_accept > 0) {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.tcp_defer_accept, sizeof(config.tcp_defer_accept));
+    }
+    return listenfd;
+}
+
+// stop accepting and let the connections finish, called by reactor 0
+// connections waiting for their next request are closed by their reactor,
+// the others close after their response
+void start_drain(Server *srv) {
+    int listenfd = srv->listenfd;
+    srv->listenfd = -1;
+
+    // the master and the other workers of a cluster keep the socket open, closing it here
+    // would leave it in the epolls, ready and never accepted
+    for (int i = 0; i < srv->reactor_number; ++i) {
+        epoll_ctl(srv->reactors[i].epollfd, EPOLL_CTL_DEL, listenfd, 0);
+    }
+    close(listenfd);
+
+    Http_conn::m_draining = true;
+    srv->drain_deadline = time(NULL) + Config::current()->drain_timeout;
+    srv->draining = true;
+
+    uint64_t one = 1;
+    write(srv->wakefd, &one, sizeof(one));
+    printf("draining %d connections\n", Http_conn::m_user_count.load());
+}
+
+// a reactor that notices the drain closes its idle connections
+void drain_reactor(Reactor *r) {
+    Server *srv = r->server;
+    epoll_ctl(r->epollfd, EPOLL_CTL_DEL, srv->wakefd, 0);
+    for (int i = 0; i < srv->conns->size(); ++i) {
+        Http_conn *conn = srv->conns->at(i);
+        if (conn->idle(r->epollfd)) {
+            conn->close_conn();
+        }
+    }
+    r->drained = true;
+}
+
+// apply the config file and the command line again
+void reload(Server *srv) {
+    Config *config = new Config;
+    if (!config->load(srv->argc, srv->argv)) {
+        delete config;
+        printf("reload: keep the old config\n");
+        return;
+    }
+
+    // the old config is not freed, other threads may still read it
+    const Config *old = Config::current();
+    config->report_restart_needed(*old);
+    Config::publish(config);
+
+    // the connections accepted from now on poll as the new config says, the open ones keep what they had
+    if (config->busy_poll != old->busy_poll) {
+        for (int i = 0; i < srv->reactor_number; ++i) {
+            if (!busy_poll_epoll(srv->reactors[i].epollfd, config->busy_poll) && i == 0) {
+                printf("reload: epoll busy polling needs Linux 6.9, only the sockets poll\n");
+            }
+        }
+    }
+    srv->limiter->set_limits(config->limit_ip_rate, config->limit_ip_burst, config->limit_ip_conns,
+                             config->limit_global_rate, config->limit_global_burst);
+    Tracer::set_sample(config->trace_sample);
+    printf("reload: done\n");
+}
+
+// print the metrics of every event loop and of the disk threads to out, they are read while they run
+void report_loops(Server *srv, FILE *out) {
+    for (int i = 0; i < srv->reactor_number; ++i) {
+        Event_batch *batch = srv->reactors[i].batch;
+        if (!batch) {
+            continue;
+        }
+        const Loop_metrics& m = batch->metrics();
+        fprintf(out, "loop %d: %ld batches, %.1f events per batch, max %d, %.1f us per batch, max %ld us, "
+                "%ld epoll_ctl, %ld saved, %ld reads requeued\n",
+                i, m.batches, m.batches ? (double)m.events / m.batches : 0.0, m.max_batch,
+                m.batches ? (double)m.busy_us / m.batches : 0.0, m.max_busy_us, m.ctl_calls, m.ctl_saved, m.requeued);
+    }
+    fprintf(out, "pool: %d workers, %d connections\n", srv->pool->thread_count(), Http_conn::m_user_count.load());
+    if (Http_conn::m_files) {
+        fprintf(out, "file cache: %d of %d slots\n", Http_conn::m_files->count(), Http_conn::m_files->slots());
+    }
+    if (Http_conn::m_disk) {
+        const Disk_metrics& d = Http_conn::m_disk->metrics();
+        fprintf(out, "disk: %ld windows checked, %ld cold, %ld read, %ld kB in %.1f us per read, max %ld us\n",
+                d.checks, d.cold, d.reads, d.read_bytes >> 10, d.reads ? (double)d.read_us / d.reads : 0.0, d.max_read_us);
+    }
+}
+
+// the metrics of SIGUSR1 for a client, on the stats_path
+class Stats_handler : public Route_handler
+{
+public:
+    explicit Stats_handler(Server *srv) : m_srv(srv) {}
+
+    Http_conn::HTTP_CODE handle(Http_conn *conn, const Route_match& /*match*/) {
+        char *text = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&text, &len);
+        if (!out) {
+            return Http_conn::INTERNAL_ERROR;
+        }
+        report_loops(m_srv, out);
+        fclose(out);
+        return conn->start_stream(200, "OK", "text/plain", new Text_producer(text, len, true));
+    }
+
+private:
+    Server *m_srv;
+};
+
+// route the paths of the built-in handlers and of the proxy, NULL if every request is for a file
+Router* build_router(Server *srv, const Config *config, const Proxy *upstreams) {
+    Router *router = new Router;
+    bool ok = true;
+    if (config->health_path[0]) {
+        ok = ok && router->add(config->health_path, Router::EXACT, new Health_handler);
+    }
+    if (config->stats_path[0]) {
+        ok = ok && router->add(config->stats_path, Router::EXACT, new Stats_handler(srv));
+    }
+    if (config->trace_path[0]) {
+        ok = ok && router->add(config->trace_path, Router::EXACT, new Trace_handler);
+    }
+    if (Http_conn::m_upstreams) {
+        for (int i = 0; ok && i < upstreams->route_count(); ++i) {
+            const Proxy_route *route = upstreams->route(i);
+            ok = router->add(route->prefix, Router::PREFIX, new Proxy_handler(route));
+        }
+    }
+    if (!ok || router->route_count() == 0) {
+        delete router;
+        return NULL;
+    }
+    return router;
+}
+
+// handle the signals passed through the pipe, in reactor 0
+void handle_signals(Reactor *r) {
+    Server *srv = r->server;
+    char signals[64];
+    int count = recv(sig_pipefd[0], signals, sizeof(signals), 0);
+    for (int i = 0; i < count; ++i) {
+        switch (signals[i]) {
+            case SIGTERM :
+            case SIGINT : {
+                if (srv->draining) {
+                    // asked twice, do not wait any more
+                    srv->drain_deadline = 0;
+                } else {
+                    start_drain(srv);
+                }
+                break;
+            }
+            case SIGHUP : {
+                reload(srv);
+                break;
+            }
+            case SIGUSR1 : {
+                report_loops(srv, stdout);
+                const char *trace_file = Config::current()->trace_file;
+                if (trace_file[0]) {
+                    printf("trace: %s %s\n", Tracer::dump(trace_file) ? "written to" : "cannot write", trace_file);
+                }
+                break;
+            }
+            case SIGUSR2 : {
+                if (srv->draining || srv->upgrade_fd >= 0) {
+                    break;
+                }
+                // a worker of a cluster does not own the listening socket
+                if (Config::current()->workers > 0) {
+                    printf("upgrade: not supported with workers\n");
+                    break;
+                }
+                srv->upgrade_fd = spawn_upgrade(srv->argv);
+                if (srv->upgrade_fd < 0 || !send_fd(srv->upgrade_fd, srv->listenfd)) {
+                    printf("upgrade: cannot start the new binary\n");
+                    if (srv->upgrade_fd >= 0) {
+                        close(srv->upgrade_fd);
+                        srv->upgrade_fd = -1;
+                    }
+                    break;
+                }
+                // wait for the acknowledgement without blocking the clients
+                addfd(r->epollfd, srv->upgrade_fd, false, srv->upgrade_fd);
+                break;
+            }
+        }
+    }
+}
+
+// the new binary acknowledges, or the channel is closed because it died
+void handle_upgrade(Reactor *r) {
+    Server *srv = r->server;
+    char ack = 0;
+    int ret = recv(srv->upgrade_fd, &ack, 1, 0);
+    removefd(r->epollfd, srv->upgrade_fd);
+    srv->upgrade_fd = -1;
+    if (ret == 1 && !srv->draining) {
+        printf("upgrade: the new binary is accepting\n");
+        start_drain(srv);
+    } else {
+        printf("upgrade: the new binary failed, keep serving\n");
+        waitpid(-1, NULL, WNOHANG);
+    }
+}
+
+// client connecting...
+void accept_conn(Reactor *r) {
+    Server *srv = r->server;
+
+    struct sockaddr_in client_address;
+    socklen_t client_addrlength = sizeof(client_address);
+    int connfd = accept(srv->listenfd, (struct sockaddr*)(&client_address), &client_addrlength);
+
+    if (connfd < 0) {
+        // another reactor may have taken the connection
+        if (errno != EAGAIN) {
+            printf("errno is : %d\n", errno);
+        }
+        return;
+    }
+    Stats::add(Stats::m_segment->accepted);
+
+    // one client cannot take all the connections
+    Rate_limiter::VERDICT verdict = srv->limiter->on_accept(client_address.sin_addr.s_addr);
+    if (verdict != Rate_limiter::ADMIT) {
+        send_reject(connfd, verdict);
+        close(connfd);
+        return;
+    }
+
+    // with pinned reactors, the connection goes to the reactor on the cpu that handles its packets,
+    // so the socket, the connection and the event loop stay on one cpu
+    Reactor *owner = r;
+    int *cpu_reactor = __atomic_load_n(&srv->cpu_reactor, __ATOMIC_ACQUIRE);
+    if (cpu_reactor) {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+            cpu >= 0 && cpu < cpu_count() && cpu_reactor[cpu] >= 0) {
+            owner = srv->reactors + cpu_reactor[cpu];
+        }
+    }
+
+    // the object comes from the node of the event loop that serves it
+    Http_conn *conn = srv->conns->alloc(owner->node);
+    if (!conn) {
+        // number of connections >= max_conns
+        // send a message to the client saying that the server is busy
+        srv->limiter->on_close(client_address.sin_addr.s_addr);
+        send_reject(connfd, 503);
+        close(connfd);
+        return;
+    }
+    if (!conn->init(connfd, client_address, owner->epollfd, owner->node)) {
+        // no memory for its buffers, the client is told to come back later like above
+        srv->conns->free(conn);
+        srv->limiter->on_close(client_address.sin_addr.s_addr);
+        send_reject(connfd, 503);
+        close(connfd);
+    }
+}
+
+// pin the reactors and the workers as the config says
+void place_threads(Server *srv, const Config *config) {
+    int ncpu = cpu_count();
+    int reactor_cpus[CPU_SETSIZE];
+    int worker_cpus[CPU_SETSIZE];
+    int reactor_count = parse_cpu_list(config->reactor_cpus, reactor_cpus, CPU_SETSIZE);
+    int worker_count = parse_cpu_list(config->worker_cpus, worker_cpus, CPU_SETSIZE);
+
+    // by default the reactors take the first cpus and the workers the next ones
+    if (reactor_count <= 0) {
+        reactor_count = 0;
+        for (int i = 0; i < srv->reactor_number && i < ncpu; ++i) {
+            reactor_cpus[reactor_count++] = i;
+        }
+    }
+    if (worker_count <= 0) {
+        worker_count = 0;
+        for (int i = 0; i < ncpu; ++i) {
+            worker_cpus[worker_count++] = (reactor_count + i) % ncpu;
+        }
+    }
+
+    int *cpu_reactor = new int[ncpu];
+    for (int i = 0; i < ncpu; ++i) {
+        cpu_reactor[i] = -1;
+    }
+
+    for (int i = 0; i < srv->reactor_number; ++i) {
+        Reactor *r = srv->reactors + i;
+        r->cpu = reactor_cpus[i % reactor_count];
+        r->node = cpu_node(r->cpu);
+        if (!pin_thread(i == 0 ? pthread_self() : r->thread, r->cpu)) {
+            printf("cannot pin the reactor %d to cpu %d\n", i, r->cpu);
+        }
+        if (r->cpu < ncpu && cpu_reactor[r->cpu] < 0) {
+            cpu_reactor[r->cpu] = i;
+        }
+    }
+
+    // the other reactors are running already, they see the map once it is complete
+    __atomic_store_n(&srv->cpu_reactor, cpu_reactor, __ATOMIC_RELEASE);
+
+    if (!srv->pool->pin(worker_cpus, worker_count)) {
+        printf("cannot pin the workers\n");
+    }
+}
+
+// a connection names its lane in the order of the priorities of the pool
+static_assert((int)Http_conn::LANE_HIGH == (int)Threadpool< Http_conn >::HIGH && (int)Http_conn::LANE_LOW == (int)Threadpool< Http_conn >::LOW,
+              "the lanes of Http_conn follow Threadpool::PRIORITY");
+
+// an event of a client connection
+void handle_conn(Server *srv, Http_conn *conn, uint32_t events) {
+    if (conn->in_coroutine()) {
+        // the coroutine waits for the events itself
+        conn->resume(events);
+
+    } else if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        // exception or error happens, close the connection
+        conn->close_conn();
+
+    } else if (events & EPOLLIN) {
+        // read() reads all data at one time
+        if (conn->read()) {
+            // a client over its rate is answered before the request is parsed
+            Rate_limiter::VERDICT verdict = srv->limiter->on_request(conn->client_ip());
+            if (verdict != Rate_limiter::ADMIT) {
+                conn->reject(verdict);
+                return;
+            }
+
+            // put the target pointer in
+            // the lanes only order requests that wait, with an empty queue a worker takes it at once
+            Threadpool< Http_conn >::PRIORITY lane = Threadpool< Http_conn >::NORMAL;
+            if (srv->pool->queued() > 0) {
+                lane = (Threadpool< Http_conn >::PRIORITY)conn->lane();
+            }
+            // the pool refuses it when it is overloaded, answer at once instead of letting it hang
+            if (!srv->pool->append(conn, lane)) {
+                conn->reject(503);
+            }
+        } else {
+            // read() fails, close the connection
+            conn->close_conn();
+        }
+
+    } else if (events & EPOLLOUT) {
+        // write() writes all data at one time
+        if (!conn->write()) {
+            conn->close_conn();
+        }
+    }
+}
 
-    // create epoll and array of events
-    epoll_event events[MAX_EVENT_NUMBER] ;
-    int epollfd = epoll_create(5);
+void* run_reactor(void *arg) {
+    Reactor *r = (Reactor*)arg;
+    Server *srv = r->server;
+    int max_events = Config::current()->max_event_number;
+    epoll_event *events = new epoll_event[max_events];
+    Event_batch batch(r->epollfd);
+    r->batch = &batch;
+    Adaptive_spin spin(Config::current()->spin_us);
 
-    // add the listenfd
-    addfd(epollfd, listenfd, false);
-    Http_conn::m_epollfd = epollfd;
+    while (!srv->draining || (Http_conn::m_user_count > 0 && time(NULL) < srv->drain_deadline)) {
+        if (srv->draining && !r->drained) {
+            drain_reactor(r);
+        }
 
-    while (true) {
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+        // while draining, wake up regularly to check whether all connections are gone
+        int number = spin.epoll_wait(r->epollfd, events, max_events, srv->draining ? 100 : -1);
 
         if ((number < 0) && (errno != EINTR)) {
             printf("epoll failure\n");
             break;
         }
 
+        // the interest changes made while the events are handled are applied after them
+        if (number > 0) {
+            batch.begin(number);
+        }
+
         // iterate the array of events
         for (int i = 0; i < number; ++i) {
-            int sockfd = events[i].data.fd;
-            if (sockfd == listenfd) {
-                // client connecting...
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)(&client_address), &client_addrlength);
-
-                if (connfd < 0) {
-                    printf("errno is : %d\n", errno);
+            // connections carry their object, the other sockets their fd
+            uint64_t data = events[i].data.u64;
+            Http_conn *conn = NULL;
+            if (data >> CONN_GENERATION_SHIFT) {
+                conn = Http_conn::from_event(data);
+                if (!conn) {
+                    // closed by an earlier event, the object may serve another connection by now
                     continue;
                 }
+            }
 
-                if (Http_conn::m_user_count >= MAX_FD) {
-                    // number of connection >= MAX_FD
-                    // send a message to the client saying that the server is busy
-                    close(connfd);
-                    continue;
-                }
+            int sockfd = events[i].data.fd;
+            if (conn && (data & (UPSTREAM_TAG | UPSTREAM_TIMER_TAG))) {
+                // the upstream of a proxied request, or its deadline
+                conn->proxy_event(data & (UPSTREAM_TAG | UPSTREAM_TIMER_TAG));
 
-                // initialize the data of new client, put it into the array
-                users[connfd].init(connfd, client_address);
+            } else if (conn) {
+                handle_conn(srv, conn, events[i].events);
 
-            } else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                // exception or error happens, close the connection
-                users[sockfd].close_conn();
+            } else if (sockfd == srv->wakefd) {
+                // the loop condition handles the drain
+                continue;
 
-            } else if (events[i].events & EPOLLIN) {
-                // read() reads all data at one time
-                if (users[sockfd].read()) {
-                    // put the target pointer in
-                    pool->append(users + sockfd);
-                } else {
-                    // read() fails, close the connection
-                    users[sockfd].close_conn();
-                }
+            } else if (r->id == 0 && sockfd == sig_pipefd[0]) {
+                handle_signals(r);
 
-            } else if (events[i].events & EPOLLOUT) {
-                // write() writes all data at one time
-                if (!users[sockfd].write()) {
-                    users[sockfd].close_conn();
-                }
+            } else if (r->id == 0 && sockfd == srv->upgrade_fd) {
+                handle_upgrade(r);
+
+            } else if (sockfd == srv->listenfd) {
+                accept_conn(r);
             }
         }
+        if (number > 0) {
+            batch.end();
+        }
     }
 
-    close(epollfd);
-    close(listenfd);
-    delete[] users;
+    r->batch = NULL;
+    delete[] events;
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    // server --pack DIR FILE is run at build time, it does not serve
+    if (argc > 1 && strcmp(argv[1], "--pack") == 0) {
+        if (argc != 4) {
+            printf("usage: %s --pack DIR FILE\n", argv[0]);
+            return 1;
+        }
+        return Asset_bundle::pack(argv[2], argv[3]) ? 0 : 1;
+    }
+
+    // server --top NAME [INTERVAL_MS] [COUNT] watches a server started with --stats-shm=NAME
+    if (argc > 1 && strcmp(argv[1], "--top") == 0) {
+        if (argc < 3 || argc > 5) {
+            printf("usage: %s --top NAME [INTERVAL_MS] [COUNT]\n", argv[0]);
+            return 1;
+        }
+        int interval_ms = argc > 3 ? atoi(argv[3]) : 100;
+        return Stats::top(argv[2], interval_ms > 0 ? interval_ms : 100, argc > 4 ? atoi(argv[4]) : 0);
+    }
+
+    Config *config = new Config;
+    if (!config->load(argc, argv)) {
+        return 1;
+    }
+    Config::publish(config);
+
+    addsig(SIGPIPE, SIG_IGN);
+
+    // started by an upgrade, the listening socket comes from the old binary
+    int channel = upgrade_channel();
+
+    // the clock of the trace starts before any thread could record
+    Tracer::start(config->trace_sample);
+    if (!Stats::open(config->stats_shm, config->port)) {
+        return 1;
+    }
+
+    int listenfd = -1;
+    if (channel >= 0) {
+        listenfd = recv_fd(channel);
+        if (listenfd < 0) {
+            printf("upgrade: cannot receive the listening socket\n");
+            return 1;
+        }
+    } else {
+        listenfd = open_listen(*config);
+        if (listenfd < 0) {
+            return 1;
+        }
+    }
+
+    // the file cache is mapped before the workers are forked, they all see the same files
+    if (config->file_cache_size > 0) {
+        Http_conn::m_files = new File_cache;
+        if (!Http_conn::m_files->open((long)config->file_cache_size << 20)) {
+            return 1;
+        }
+    }
+
+    // with workers, this process is their master and serves nothing, each worker runs the rest of main
+    if (config->workers > 0) {
+        if (config->workers > Cluster::MAX_WORKERS) {
+            printf("cluster: at most %d workers\n", Cluster::MAX_WORKERS);
+            return 1;
+        }
+        Cluster cluster(config->workers, listenfd, Http_conn::m_files);
+        int worker = cluster.run(channel);
+        if (worker < 0) {
+            delete Http_conn::m_files;
+            Stats::close();
+            return 0;
+        }
+        channel = -1;
+        Stats::m_process = worker;
+        if (Http_conn::m_files) {
+            Http_conn::m_files->set_process(worker);
+        }
+    }
+
+    Threadpool< Http_conn > *pool = NULL;
+    try {
+        pool = new Threadpool< Http_conn >(config->thread_number, config->max_requests,
+                                           config->overload_target_us, config->overload_interval_us, config->spin_us,
+                                           config->thread_min, config->thread_max);
+    } catch(...) {
+        printf("nonono\n");
+        return 1;
+    }
+
+    // the log is block buffered when it goes to a file, a worker flushes it once a second
+    pool->submit_every(1000, []() { fflush(stdout); }, Threadpool< Http_conn >::LOW);
+
+    // the gauges of the stats, ahead of the requests so they are fresh when the queue is long
+    pool->submit_every(100, [pool]() {
+        Stats_gauges& g = Stats::gauges();
+        Stats::set(g.pid, getpid());
+        Stats::set(g.connections, Http_conn::m_user_count.load(std::memory_order_relaxed));
+        Stats::set(g.queue_depth, pool->queued());
+        Stats::set(g.workers, pool->thread_count());
+        g.shed.store(pool->shed_count(), std::memory_order_relaxed);
+        g.sampled_us.store(Stats::monotonic_us(), std::memory_order_relaxed);
+    }, Threadpool< Http_conn >::HIGH);
+
+    Http_conn::m_read_buffer_size = config->read_buffer_size;
+    Http_conn::m_write_buffer_size = config->write_buffer_size;
+    Http_conn::m_buffers = new Node_buffers(config->read_buffer_size + config->write_buffer_size);
+
+    // objects are made as the connections come, on the node of the event loop serving them
+    Conn_pool *conns = new Conn_pool(config->max_conns);
+    Http_conn::m_pool = conns;
+
+    if (config->preload) {
+        Http_conn::m_assets = new Asset_store;
+        if (!Http_conn::m_assets->load(config->doc_root)) {
+            return 1;
+        }
+    }
+    if (config->coroutines) {
+#ifdef __cpp_impl_coroutine
+        Http_conn::m_use_coroutines = true;
+#else
+        printf("coroutines need a C++20 build, the connections are served by the thread pool\n");
+#endif
+    }
+    if (config->bundle[0] != '\0') {
+        Http_conn::m_bundle = new Asset_bundle;
+        if (!Http_conn::m_bundle->open(config->bundle)) {
+            return 1;
+        }
+    }
+    if (config->vhosts[0] != '\0') {
+        Http_conn::m_vhosts = new Vhost_table;
+        if (!Http_conn::m_vhosts->load(config->vhosts)) {
+            return 1;
+        }
+    }
+    if (config->io_threads > 0) {
+        Http_conn::m_disk = new Disk_io(config->io_threads);
+    }
+
+    Rate_limiter limiter(config->limit_table_size, config->limit_ip_rate, config->limit_ip_burst, config->limit_ip_conns,
+                         config->limit_global_rate, config->limit_global_burst);
+    Http_conn::m_limiter = &limiter;
+
+    Proxy upstreams;
+    if (!upstreams.init(config->proxy, config->proxy_keepalive)) {
+        return 1;
+    }
+    if (config->proxy[0]) {
+        Http_conn::m_upstreams = &upstreams;
+        if (config->cache_size > 0) {
+            Http_conn::m_cache = new Response_cache((long)config->cache_size << 20);
+        }
+    }
+
+    Server srv;
+    srv.argc = argc;
+    srv.argv = argv;
+    srv.pool = pool;
+    srv.conns = conns;
+    srv.limiter = &limiter;
+    srv.listenfd = listenfd;
+    srv.wakefd = eventfd(0, EFD_NONBLOCK);
+    srv.upgrade_fd = -1;
+    srv.draining = false;
+    srv.drain_deadline = 0;
+    srv.reactor_number = config->reactor_number;
+    srv.cpu_reactor = NULL;
+
+    Http_conn::m_router = build_router(&srv, config, &upstreams);
+    if (!Http_conn::m_router && (config->health_path[0] || config->stats_path[0] || config->trace_path[0] || config->proxy[0])) {
+        return 1;
+    }
+
+    // SIGTERM and SIGINT drain and exit, SIGHUP reloads, SIGUSR1 prints the loop metrics, SIGUSR2 upgrades the binary
+    socketpair(PF_UNIX, SOCK_STREAM, 0, sig_pipefd);
+    set_nonblocking(sig_pipefd[1]);
+
+    Reactor *reactors = new Reactor[config->reactor_number];
+    srv.reactors = reactors;
+    for (int i = 0; i < config->reactor_number; ++i) {
+        Reactor *r = reactors + i;
+        r->id = i;
+        r->server = &srv;
+        r->drained = false;
+        r->batch = NULL;
+        r->cpu = -1;
+        r->node = 0;
+
+        // create epoll and add the listenfd
+        r->epollfd = epoll_create(5);
+        if (config->reactor_number == 1 && config->workers == 0) {
+            addfd(r->epollfd, listenfd, false, listenfd);
+        } else {
+            // only one of the reactors, of all the worker processes, is woken up for a new connection
+            epoll_event event;
+            event.data.u64 = listenfd;
+            event.events = EPOLLIN | EPOLLEXCLUSIVE;
+            epoll_ctl(r->epollfd, EPOLL_CTL_ADD, listenfd, &event);
+            set_nonblocking(listenfd);
+        }
+        addfd(r->epollfd, srv.wakefd, false, srv.wakefd);
+
+        if (config->busy_poll > 0 && !busy_poll_epoll(r->epollfd, config->busy_poll) && i == 0) {
+            printf("busy_poll: epoll busy polling needs Linux 6.9, only the sockets poll\n");
+        }
+    }
+    addfd(reactors[0].epollfd, sig_pipefd[0], false, sig_pipefd[0]);
+
+    addsig(SIGTERM, sig_handler);
+    addsig(SIGINT, sig_handler);
+    addsig(SIGHUP, sig_handler);
+    addsig(SIGUSR1, sig_handler);
+    addsig(SIGUSR2, sig_handler);
+
+    for (int i = 1; i < config->reactor_number; ++i) {
+        if (pthread_create(&reactors[i].thread, NULL, run_reactor, reactors + i) != 0) {
+            printf("cannot create the reactor %d\n", i);
+            return 1;
+        }
+    }
+
+    if (config->cpu_affinity) {
+        place_threads(&srv, config);
+    }
+
+    if (channel >= 0) {
+        // tell the old binary that it can stop accepting
+        write(channel, "1", 1);
+        close(channel);
+    }
+
+    run_reactor(reactors);
+    for (int i = 1; i < config->reactor_number; ++i) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+
+    if (srv.listenfd >= 0) {
+        close(srv.listenfd);
+    }
+
+    // the workers finish what they have and are joined
     delete pool;
+    delete Http_conn::m_disk;
+    for (int i = 0; i < config->reactor_number; ++i) {
+        close(reactors[i].epollfd);
+    }
+    delete[] reactors;
+    delete[] srv.cpu_reactor;
+    delete conns;
+    delete Http_conn::m_buffers;
+    delete Http_conn::m_cache;
+    delete Http_conn::m_assets;
+    delete Http_conn::m_bundle;
+    delete Http_conn::m_vhosts;
+    delete Http_conn::m_router;
+    delete Http_conn::m_files;
+    Stats::close();
 
     return 0;
 }
-
@@ -0,0 +1,814 @@
+#include "proxy.h"
+#include "stats.h"
+
+// definition is in http_conn.cpp
+extern void modfd(int epollfd, int fd, int ev, uint64_t data);
+
+// bytes moved by one splice()
+#define SPLICE_SIZE 65536
+
+// seconds a response may be stored by a shared cache, from its Cache-Control value in [value, end)
+// -1 if it must not be stored
+static int parse_max_age(const char *value, const char *end) {
+    int max_age = -1;
+    int s_maxage = -1;
+    const char *p = value;
+    while (p < end) {
+        p += strspn(p, " \t,");
+        const char *token_end = (const char*)memchr(p, ',', end - p);
+        if (!token_end) {
+            token_end = end;
+        }
+        int len = token_end - p;
+        if ((len >= 8 && strncasecmp(p, "no-store", 8) == 0) || (len >= 8 && strncasecmp(p, "no-cache", 8) == 0) ||
+            (len >= 7 && strncasecmp(p, "private", 7) == 0)) {
+            return -1;
+        } else if (len > 8 && strncasecmp(p, "max-age=", 8) == 0) {
+            max_age = atoi(p + 8);
+        } else if (len > 9 && strncasecmp(p, "s-maxage=", 9) == 0) {
+            s_maxage = atoi(p + 9);
+        }
+        p = token_end;
+    }
+    // s-maxage is meant for shared caches and wins over max-age
+    return s_maxage >= 0 ? s_maxage : max_age;
+}
+
+Proxy::Proxy() : m_route_count(0), m_upstream_count(0), m_max_idle(0) {}
+
+Proxy::~Proxy() {
+    for (int i = 0; i < m_upstream_count; ++i) {
+        for (int j = 0; j < m_upstreams[i].idle_count; ++j) {
+            close(m_upstreams[i].idle[j]);
+        }
+    }
+}
+
+bool Proxy::init(const char *routes, int max_idle) {
+    m_max_idle = max_idle < MAX_IDLE ? max_idle : MAX_IDLE;
+
+    const char *p = routes;
+    while (*p) {
+        const char *end = strchr(p, ';');
+        if (!end) {
+            end = p + strlen(p);
+        }
+        const char *eq = (const char*)memchr(p, '=', end - p);
+        if (!eq || eq == p || !add_route(p, eq - p, eq + 1, end - eq - 1)) {
+            printf("proxy: invalid route %.*s\n", (int)(end - p), p);
+            return false;
+        }
+        p = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+bool Proxy::add_route(const char *prefix, int prefix_len, const char *servers, int servers_len) {
+    if (m_route_count == MAX_ROUTES || prefix_len >= Proxy_route::PREFIX_LEN || prefix[0] != '/') {
+        return false;
+    }
+
+    Proxy_route& route = m_routes[m_route_count];
+    memcpy(route.prefix, prefix, prefix_len);
+    route.prefix[prefix_len] = '\0';
+    route.prefix_len = prefix_len;
+    route.first = m_upstream_count;
+    route.count = 0;
+    route.next = 0;
+
+    // host:port separated by ','
+    const char *p = servers;
+    const char *end = servers + servers_len;
+    while (p < end) {
+        const char *comma = (const char*)memchr(p, ',', end - p);
+        if (!comma) {
+            comma = end;
+        }
+        const char *colon = (const char*)memchr(p, ':', comma - p);
+        if (!colon || colon == p || m_upstream_count == MAX_UPSTREAMS) {
+            return false;
+        }
+
+        char host[256];
+        char port[16];
+        if (colon - p >= (int)sizeof(host) || comma - colon - 1 >= (int)sizeof(port)) {
+            return false;
+        }
+        memcpy(host, p, colon - p);
+        host[colon - p] = '\0';
+        memcpy(port, colon + 1, comma - colon - 1);
+        port[comma - colon - 1] = '\0';
+
+        // names are resolved once at startup
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *res = NULL;
+        if (getaddrinfo(host, port, &hints, &res) != 0 || !res) {
+            printf("proxy: cannot resolve %s:%s\n", host, port);
+            return false;
+        }
+
+        Upstream& up = m_upstreams[m_upstream_count++];
+        memcpy(&up.addr, res->ai_addr, sizeof(up.addr));
+        up.active = 0;
+        up.idle_count = 0;
+        freeaddrinfo(res);
+
+        ++route.count;
+        p = comma + 1;
+    }
+
+    if (route.count == 0) {
+        return false;
+    }
+    ++m_route_count;
+    return true;
+}
+
+int Proxy::acquire(const Proxy_route *route, int *fd) {
+    m_locker.lock();
+
+    // least connections, the search starts after the last choice so that ties rotate
+    Proxy_route *r = m_routes + (route - m_routes);
+    int best = -1;
+    for (int i = 0; i < r->count; ++i) {
+        int index = r->first + (r->next + i) % r->count;
+        if (best < 0 || m_upstreams[index].active < m_upstreams[best].active) {
+            best = index;
+        }
+    }
+    r->next = (best - r->first + 1) % r->count;
+
+    Upstream& up = m_upstreams[best];
+    ++up.active;
+    *fd = up.idle_count > 0 ? up.idle[--up.idle_count] : -1;
+
+    m_locker.unlock();
+    return best;
+}
+
+void Proxy::release(int upstream, int fd, bool reusable) {
+    m_locker.lock();
+    Upstream& up = m_upstreams[upstream];
+    --up.active;
+    if (reusable && fd >= 0 && up.idle_count < m_max_idle) {
+        up.idle[up.idle_count++] = fd;
+        fd = -1;
+    }
+    m_locker.unlock();
+
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+int Proxy::connect_to(int upstream) const {
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    const sockaddr_in& addr = m_upstreams[upstream].addr;
+    if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+Proxy_session::Proxy_session(Proxy *proxy, const Proxy_route *route) :
+m_proxy(proxy),
+m_route(route),
+m_epollfd(-1),
+m_clientfd(-1),
+m_client_data(0),
+m_upfd(-1),
+m_upstream(-1),
+m_registered(false),
+m_reused(false),
+m_state(CONNECTING),
+m_body(BODY_NONE),
+m_upstream_keep(false),
+m_client_keep(false),
+m_remaining(0),
+m_chunk_state(CHUNK_SIZE),
+m_chunk_left(0),
+m_eof(false),
+m_in_len(0),
+m_pending(NULL),
+m_pending_len(0),
+m_cache(NULL),
+m_fill(NULL),
+m_max_age(-1),
+m_capture(NULL),
+m_capture_len(0),
+m_capture_size(0),
+m_capture_head(0),
+m_pipe_bytes(0),
+m_timeout(0),
+m_timerfd(-1),
+m_waiting_upstream(false) {
+    m_pipe[0] = m_pipe[1] = -1;
+}
+
+Proxy_session::~Proxy_session() {
+    // an unfinished response leaves the upstream connection in an unknown state
+    release_upstream(false);
+    if (m_pipe[0] >= 0) {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+    if (m_timerfd >= 0) {
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_timerfd, 0);
+        close(m_timerfd);
+    }
+    // the waiters of a failed fetch try again by themselves
+    finish_capture(false);
+}
+
+void Proxy_session::capture(Response_cache *cache, Cache_entry *entry) {
+    m_cache = cache;
+    m_fill = entry;
+}
+
+void Proxy_session::capture_body(const char *data, int len) {
+    if (!m_capture || len <= 0) {
+        return;
+    }
+    if (m_capture_len + len > m_cache->max_entry()) {
+        // too large to be stored, the relay goes on without the copy
+        free(m_capture);
+        m_capture = NULL;
+        m_cache->abandon(m_fill, true);
+        m_fill = NULL;
+        return;
+    }
+    if (m_capture_len + len > m_capture_size) {
+        int size = m_capture_size * 2;
+        while (size < m_capture_len + len) {
+            size *= 2;
+        }
+        char *p = (char*)realloc(m_capture, size);
+        if (!p) {
+            free(m_capture);
+            m_capture = NULL;
+            m_cache->abandon(m_fill, false);
+            m_fill = NULL;
+            return;
+        }
+        m_capture = p;
+        m_capture_size = size;
+    }
+    memcpy(m_capture + m_capture_len, data, len);
+    m_capture_len += len;
+}
+
+void Proxy_session::finish_capture(bool complete) {
+    if (!m_fill) {
+        return;
+    }
+    if (complete && m_capture) {
+        m_cache->fill(m_fill, m_capture, m_capture_head, m_capture + m_capture_head, m_capture_len - m_capture_head, m_max_age);
+    } else {
+        m_cache->abandon(m_fill, false);
+    }
+    m_fill = NULL;
+    free(m_capture);
+    m_capture = NULL;
+}
+
+bool Proxy_session::start(int epollfd, int clientfd, uint64_t client_data, const char *path, const char *query, const char *host,
+                          bool http10, uint32_t client_ip, bool keep_alive, int timeout) {
+    m_epollfd = epollfd;
+    m_clientfd = clientfd;
+    m_client_data = client_data;
+    m_client_keep = keep_alive;
+    m_timeout = timeout;
+
+    // the path was decoded by the parser, the bytes that cannot be in a path are encoded again
+    static const char hex[] = "0123456789ABCDEF";
+    int len = snprintf(m_out, sizeof(m_out), "GET ");
+    const unsigned char *p = (const unsigned char*)path;
+    for (; *p && len < (int)sizeof(m_out) - 3; ++p) {
+        if (*p <= ' ' || *p >= 0x7f || *p == '%' || *p == '?' || *p == '#') {
+            m_out[len++] = '%';
+            m_out[len++] = hex[*p >> 4];
+            m_out[len++] = hex[*p & 15];
+        } else {
+            m_out[len++] = *p;
+        }
+    }
+    if (*p) {
+        return false;
+    }
+
+    // an HTTP/1.0 client gets an HTTP/1.0 response, which is never chunked
+    struct in_addr addr;
+    addr.s_addr = client_ip;
+    len += snprintf(m_out + len, sizeof(m_out) - len,
+                    "%s%s HTTP/1.%d\r\n"
+                    "Host: %s\r\n"
+                    "Connection: keep-alive\r\n"
+                    "X-Forwarded-For: %s\r\n"
+                    "\r\n",
+                    query ? "?" : "", query ? query : "", http10 ? 0 : 1, host ? host : "", inet_ntoa(addr));
+    if (len >= (int)sizeof(m_out)) {
+        return false;
+    }
+    m_pending = m_out;
+    m_pending_len = len;
+
+    return connect_upstream(true);
+}
+
+bool Proxy_session::connect_upstream(bool allow_pooled) {
+    int fd = -1;
+    m_upstream = m_proxy->acquire(m_route, &fd);
+    if (!allow_pooled && fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    m_reused = fd >= 0;
+    if (!m_reused) {
+        fd = m_proxy->connect_to(m_upstream);
+        if (fd < 0) {
+            m_proxy->release(m_upstream, -1, false);
+            m_upstream = -1;
+            return false;
+        }
+    }
+    m_upfd = fd;
+    m_registered = false;
+
+    // a pooled connection is writable at once, a new one when it is connected
+    m_state = m_reused ? SENDING : CONNECTING;
+    // the session is not touched after this, see arm_upstream()
+    arm_upstream(EPOLLOUT);
+    return true;
+}
+
+void Proxy_session::arm_upstream(int ev) {
+    // the deadline starts again with every wait, a slow upstream that keeps sending is not cut off
+    // it is armed first: from start() this runs in a worker, and once the socket is in the epoll
+    // the event loop may handle it, or even end the session, before epoll_ctl() returns
+    m_waiting_upstream = true;
+    if (m_timeout > 0 && m_timerfd < 0) {
+        m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (m_timerfd >= 0) {
+            epoll_event timer;
+            timer.data.u64 = m_client_data | UPSTREAM_TIMER_TAG;
+            timer.events = EPOLLIN;
+            epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_timerfd, &timer);
+        }
+    }
+    if (m_timeout > 0 && m_timerfd >= 0) {
+        struct itimerspec deadline;
+        memset(&deadline, 0, sizeof(deadline));
+        deadline.it_value.tv_sec = m_timeout;
+        timerfd_settime(m_timerfd, 0, &deadline, NULL);
+    }
+
+    epoll_event event;
+    event.data.u64 = m_client_data | UPSTREAM_TAG;
+    event.events = ev | EPOLLONESHOT;
+    int op = m_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    m_registered = true;
+    int epollfd = m_epollfd;
+    int upfd = m_upfd;
+
+    // the last access to the session: the event loop owns it from here on
+    epoll_ctl(epollfd, op, upfd, &event);
+}
+
+void Proxy_session::release_upstream(bool reusable) {
+    if (m_upfd < 0) {
+        return;
+    }
+    // a pooled connection is in no epoll
+    if (m_registered) {
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_upfd, 0);
+    }
+    m_proxy->release(m_upstream, m_upfd, reusable);
+    m_upfd = -1;
+    m_upstream = -1;
+}
+
+Proxy_session::RESULT Proxy_session::retry_or_fail() {
+    // the upstream may have closed an idle connection, a new one is tried once
+    if (!m_reused) {
+        release_upstream(false);
+        return BAD_GATEWAY;
+    }
+    release_upstream(false);
+
+    m_pending = m_out;
+    m_pending_len = strlen(m_out);
+    m_in_len = 0;
+    return connect_upstream(false) ? WAIT : BAD_GATEWAY;
+}
+
+Proxy_session::RESULT Proxy_session::on_upstream() {
+    m_waiting_upstream = false;
+    switch (m_state) {
+        case CONNECTING : {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(m_upfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+                release_upstream(false);
+                return BAD_GATEWAY;
+            }
+            m_state = SENDING;
+            return send_request();
+        }
+        case SENDING : {
+            return send_request();
+        }
+        case READING_HEAD : {
+            return read_head();
+        }
+        case RELAY : {
+            return relay();
+        }
+    }
+    return CLOSE;
+}
+
+Proxy_session::RESULT Proxy_session::on_client() {
+    if (m_state != RELAY) {
+        return WAIT;
+    }
+    return relay();
+}
+
+Proxy_session::RESULT Proxy_session::on_timeout() {
+    uint64_t expirations;
+    read(m_timerfd, &expirations, sizeof(expirations));
+    if (!m_waiting_upstream || m_upfd < 0) {
+        // armed for an earlier wait, the session waits for the client now
+        return WAIT;
+    }
+    release_upstream(false);
+    // the requests waiting for this response fetch it by themselves
+    finish_capture(false);
+    return m_state == RELAY ? CLOSE : BAD_GATEWAY;
+}
+
+bool Proxy_session::keep_client() const {
+    return m_client_keep;
+}
+
+Proxy_session::RESULT Proxy_session::send_request() {
+    while (m_pending_len > 0) {
+        int n = send(m_upfd, m_pending, m_pending_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                arm_upstream(EPOLLOUT);
+                return WAIT;
+            }
+            return retry_or_fail();
+        }
+        m_pending += n;
+        m_pending_len -= n;
+    }
+
+    m_state = READING_HEAD;
+    m_in_len = 0;
+    arm_upstream(EPOLLIN);
+    return WAIT;
+}
+
+Proxy_session::RESULT Proxy_session::read_head() {
+    while (true) {
+        int n = recv(m_upfd, m_in + m_in_len, BUFFER_SIZE - 1 - m_in_len, 0);
+        if (n < 0 && errno == EAGAIN) {
+            arm_upstream(EPOLLIN);
+            return WAIT;
+        }
+        if (n <= 0) {
+            // closed before the first byte, a stale pooled connection
+            if (m_in_len == 0) {
+                return retry_or_fail();
+            }
+            release_upstream(false);
+            return BAD_GATEWAY;
+        }
+        m_in_len += n;
+        m_in[m_in_len] = '\0';
+
+        char *end = strstr(m_in, "\r\n\r\n");
+        if (end) {
+            if (!parse_head(end + 4 - m_in)) {
+                release_upstream(false);
+                return BAD_GATEWAY;
+            }
+            m_state = RELAY;
+            return relay();
+        }
+        if (m_in_len == BUFFER_SIZE - 1) {
+            // the head is too large
+            release_upstream(false);
+            return BAD_GATEWAY;
+        }
+    }
+}
+
+bool Proxy_session::parse_head(int head_len) {
+    // HTTP/1.1 200 OK
+    if (strncmp(m_in, "HTTP/1.", 7) != 0 || head_len < 12) {
+        return false;
+    }
+    bool http10 = m_in[7] == '0';
+    int status = atoi(m_in + 9);
+    if (status < 100 || status > 999) {
+        return false;
+    }
+
+    m_upstream_keep = !http10;
+    bool has_length = false;
+    bool chunked = false;
+    bool shared = true;
+
+    // the copy for the cache gets its own Content-Length when the body is complete
+    if (m_fill) {
+        m_capture_size = head_len + BUFFER_SIZE;
+        m_capture = (char*)malloc(m_capture_size);
+        m_capture_len = 0;
+    }
+
+    // copy the head for the client without the headers about the upstream connection
+    char *line = strstr(m_in, "\r\n") + 2;
+    int out = line - m_in;
+    memcpy(m_out, m_in, out);
+    if (m_capture) {
+        // the stored status line does not depend on the version the upstream was asked with
+        memcpy(m_capture, "HTTP/1.1", 8);
+        memcpy(m_capture + 8, m_in + 8, out - 8);
+        m_capture_len = out;
+    }
+    char *head_end = m_in + head_len - 2;
+    while (line < head_end) {
+        char *next = strstr(line, "\r\n") + 2;
+        bool copy = true;
+        if (strncasecmp(line, "Connection:", 11) == 0) {
+            char *value = line + 11 + strspn(line + 11, " \t");
+            if (strncasecmp(value, "close", 5) == 0) {
+                m_upstream_keep = false;
+            } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+                m_upstream_keep = true;
+            }
+            copy = false;
+        } else if (strncasecmp(line, "Keep-Alive:", 11) == 0 || strncasecmp(line, "Proxy-Connection:", 17) == 0) {
+            copy = false;
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            m_remaining = atoll(line + 15);
+            has_length = true;
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            chunked = strcasestr(line, "chunked") != NULL && strcasestr(line, "chunked") < next;
+        } else if (strncasecmp(line, "Cache-Control:", 14) == 0) {
+            m_max_age = parse_max_age(line + 14, next - 2);
+        } else if (strncasecmp(line, "Set-Cookie:", 11) == 0 || strncasecmp(line, "Vary:", 5) == 0) {
+            // meant for one client, or depending on headers that are not in the key
+            shared = false;
+        }
+        if (copy) {
+            memcpy(m_out + out, line, next - line);
+            out += next - line;
+            if (m_capture && strncasecmp(line, "Content-Length:", 15) != 0 && strncasecmp(line, "Transfer-Encoding:", 18) != 0) {
+                memcpy(m_capture + m_capture_len, line, next - line);
+                m_capture_len += next - line;
+            }
+        }
+        line = next;
+    }
+
+    if (status < 200 || status == 204 || status == 304) {
+        m_body = BODY_NONE;
+    } else if (chunked) {
+        m_body = BODY_CHUNKED;
+    } else if (has_length) {
+        m_body = BODY_LENGTH;
+    } else {
+        // the body ends when the upstream closes, the client cannot know its end otherwise
+        m_body = BODY_EOF;
+        m_upstream_keep = false;
+        m_client_keep = false;
+    }
+
+    out += sprintf(m_out + out, "Connection: %s\r\n\r\n", m_client_keep ? "keep-alive" : "close");
+
+    if (m_fill) {
+        // only successful responses that any client may get are stored,
+        // requests for the others go around the cache for a while
+        if (!m_capture || status != 200 || !shared || m_max_age <= 0) {
+            free(m_capture);
+            m_capture = NULL;
+            m_cache->abandon(m_fill, true);
+            m_fill = NULL;
+        }
+        m_capture_head = m_capture_len;
+    }
+
+    // the part of the body received with the head
+    char *body = m_in + head_len;
+    int body_len = m_in_len - head_len;
+    if (m_body == BODY_NONE) {
+        body_len = 0;
+    } else if (m_body == BODY_LENGTH) {
+        if (body_len > m_remaining) {
+            body_len = m_remaining;
+        }
+        m_remaining -= body_len;
+    } else if (m_body == BODY_CHUNKED) {
+        body_len = scan_chunks(body, body_len);
+    }
+    if (m_body != BODY_CHUNKED) {
+        capture_body(body, body_len);
+    }
+    memcpy(m_out + out, body, body_len);
+    out += body_len;
+
+    // the head is relayed from here on, the client gets the status of the upstream
+    Stats::response(status);
+
+    m_pending = m_out;
+    m_pending_len = out;
+    m_in_len = 0;
+    return true;
+}
+
+int Proxy_session::scan_chunks(const char *p, int len) {
+    int i = 0;
+    while (i < len && m_chunk_state != CHUNK_DONE) {
+        char c = p[i];
+        switch (m_chunk_state) {
+            case CHUNK_SIZE : {
+                if (c >= '0' && c <= '9') {
+                    m_chunk_left = m_chunk_left * 16 + (c - '0');
+                } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+                    m_chunk_left = m_chunk_left * 16 + ((c | 0x20) - 'a' + 10);
+                } else if (c == '\r') {
+                    m_chunk_state = CHUNK_SIZE_LF;
+                } else if (c == '\n') {
+                    m_chunk_state = m_chunk_left ? CHUNK_DATA : CHUNK_TRAILER;
+                } else {
+                    m_chunk_state = CHUNK_EXT;
+                }
+                break;
+            }
+            case CHUNK_EXT :
+            case CHUNK_SIZE_LF : {
+                if (c == '\n') {
+                    m_chunk_state = m_chunk_left ? CHUNK_DATA : CHUNK_TRAILER;
+                }
+                break;
+            }
+            case CHUNK_DATA : {
+                // skip the data at once
+                int64_t n = len - i;
+                if (n > m_chunk_left) {
+                    n = m_chunk_left;
+                }
+                // the copy for the cache gets the data without the chunk framing
+                capture_body(p + i, n);
+                m_chunk_left -= n;
+                i += n;
+                if (m_chunk_left == 0) {
+                    m_chunk_state = CHUNK_DATA_CR;
+                }
+                continue;
+            }
+            case CHUNK_DATA_CR : {
+                m_chunk_state = (c == '\r') ? CHUNK_DATA_LF : CHUNK_SIZE;
+                break;
+            }
+            case CHUNK_DATA_LF : {
+                m_chunk_state = CHUNK_SIZE;
+                break;
+            }
+            case CHUNK_TRAILER : {
+                if (c == '\r') {
+                    m_chunk_state = CHUNK_END_LF;
+                } else if (c == '\n') {
+                    m_chunk_state = CHUNK_DONE;
+                } else {
+                    m_chunk_state = CHUNK_TRAILER_LINE;
+                }
+                break;
+            }
+            case CHUNK_TRAILER_LINE : {
+                if (c == '\n') {
+                    m_chunk_state = CHUNK_TRAILER;
+                }
+                break;
+            }
+            case CHUNK_END_LF : {
+                m_chunk_state = CHUNK_DONE;
+                break;
+            }
+            case CHUNK_DONE : {
+                break;
+            }
+        }
+        ++i;
+    }
+    return i;
+}
+
+Proxy_session::RESULT Proxy_session::relay() {
+    while (true) {
+        // the upstream is done before the client has everything,
+        // the cache and the pool of connections get their part at once
+        bool complete = (m_body == BODY_NONE) || (m_body == BODY_LENGTH && m_remaining == 0) ||
+                        (m_body == BODY_CHUNKED && m_chunk_state == CHUNK_DONE) || (m_body == BODY_EOF && m_eof);
+        if (complete) {
+            finish_capture(true);
+            release_upstream(m_upstream_keep);
+        }
+
+        // data in memory goes first
+        while (m_pending_len > 0) {
+            int n = send(m_clientfd, m_pending, m_pending_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    modfd(m_epollfd, m_clientfd, EPOLLOUT, m_client_data);
+                    return WAIT;
+                }
+                return CLOSE;
+            }
+            m_pending += n;
+            m_pending_len -= n;
+        }
+
+        // then the data in the pipe
+        while (m_pipe_bytes > 0) {
+            int n = splice(m_pipe[0], NULL, m_clientfd, NULL, m_pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EAGAIN) {
+                    modfd(m_epollfd, m_clientfd, EPOLLOUT, m_client_data);
+                    return WAIT;
+                }
+                return CLOSE;
+            }
+            m_pipe_bytes -= n;
+        }
+
+        if (complete) {
+            return m_client_keep ? DONE : CLOSE;
+        }
+
+        // a body copied for the cache is received into user space anyway
+        bool use_pipe = m_body != BODY_CHUNKED && !m_capture;
+        if (use_pipe && m_pipe[0] < 0 && pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            m_pipe[0] = m_pipe[1] = -1;
+        }
+
+        int n;
+        if (use_pipe && m_pipe[0] >= 0) {
+            // the body moves from socket to socket without being copied to user space
+            int size = SPLICE_SIZE;
+            if (m_body == BODY_LENGTH && m_remaining < size) {
+                size = m_remaining;
+            }
+            n = splice(m_upfd, NULL, m_pipe[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                m_pipe_bytes += n;
+            }
+        } else {
+            n = recv(m_upfd, m_in, BUFFER_SIZE, 0);
+            if (n > 0) {
+                int len = n;
+                if (m_body == BODY_CHUNKED) {
+                    len = scan_chunks(m_in, n);
+                } else {
+                    if (m_body == BODY_LENGTH && len > m_remaining) {
+                        len = m_remaining;
+                    }
+                    capture_body(m_in, len);
+                }
+                m_pending = m_in;
+                m_pending_len = len;
+            }
+        }
+
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                arm_upstream(EPOLLIN);
+                return WAIT;
+            }
+            return CLOSE;
+        }
+        if (n == 0) {
+            // the end of a BODY_EOF response, any other body is cut short
+            if (m_body != BODY_EOF) {
+                return CLOSE;
+            }
+            m_eof = true;
+            continue;
+        }
+        if (m_body == BODY_LENGTH) {
+            m_remaining -= (use_pipe && m_pipe[0] >= 0) ? n : m_pending_len;
+        }
+    }
+}
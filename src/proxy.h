@@ -0,0 +1,250 @@
+#ifndef __PROXY__H
+#define __PROXY__H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+
+#include "locker.h"
+#include "cache.h"
+
+// events of an upstream socket are registered in the epoll of its client
+// with the epoll data of the client and this tag in the lowest bit
+#define UPSTREAM_TAG 1ULL
+
+// and the deadline of the upstream with this one
+#define UPSTREAM_TIMER_TAG 2ULL
+
+// a path prefix forwarded to a group of upstream servers
+struct Proxy_route
+{
+    static const int PREFIX_LEN = 64;
+
+    char prefix[PREFIX_LEN];
+    int prefix_len;
+
+    // the upstreams of the route are m_upstreams[first, first + count)
+    int first;
+    int count;
+
+    // where the search for the least loaded upstream starts, so ties rotate
+    int next;
+};
+
+// class Proxy holds the routes and a pool of idle keep-alive connections per upstream
+// it is shared by all threads and protected by a locker
+class Proxy
+{
+public:
+    static const int MAX_ROUTES = 32;
+    static const int MAX_UPSTREAMS = 64;
+    static const int MAX_IDLE = 64;
+
+    Proxy();
+
+    ~Proxy();
+
+    // parse the routes, as "/api/=127.0.0.1:8080,127.0.0.1:8081;/app/=backend:80"
+    // max_idle is the number of idle connections kept per upstream
+    bool init(const char *routes, int max_idle);
+
+    // the routes, each is added to the router under its prefix
+    int route_count() const { return m_route_count; }
+    const Proxy_route* route(int i) const { return m_routes + i; }
+
+    // choose the upstream of route with the fewest connections in use and count one more
+    // *fd is an idle connection to it, or -1 if a new one has to be made
+    int acquire(const Proxy_route *route, int *fd);
+
+    // a connection to upstream is not used any more, keep it for the next request if it is reusable
+    void release(int upstream, int fd, bool reusable);
+
+    // open a non-blocking connection to upstream, return -1 if it fails at once
+    int connect_to(int upstream) const;
+
+private:
+    // one backend server
+    struct Upstream
+    {
+        sockaddr_in addr;
+
+        // connections in use
+        int active;
+
+        // idle keep-alive connections
+        int idle[MAX_IDLE];
+        int idle_count;
+    };
+
+    bool add_route(const char *prefix, int prefix_len, const char *servers, int servers_len);
+
+    Proxy_route m_routes[MAX_ROUTES];
+    int m_route_count;
+
+    Upstream m_upstreams[MAX_UPSTREAMS];
+    int m_upstream_count;
+
+    int m_max_idle;
+
+    Locker m_locker;
+};
+
+// class Proxy_session forwards one request to an upstream and relays the response to the client
+// it runs in the event loop of the client, driven by the events of both sockets
+// bodies with a known length or ending with the connection go through a pipe with splice(),
+// chunked bodies are copied so their end can be found
+// a response that fills the cache is copied as well, with its chunked body decoded
+class Proxy_session
+{
+public:
+    // what the connection of the client does after an event
+    // WAIT: nothing, an event has been armed
+    // DONE: the response is complete
+    // CLOSE: the connection has to be closed
+    // BAD_GATEWAY: nothing has been sent to the client, it gets 502
+    enum RESULT {WAIT = 0, DONE, CLOSE, BAD_GATEWAY};
+
+    static const int BUFFER_SIZE = 16384;
+
+    Proxy_session(Proxy *proxy, const Proxy_route *route);
+
+    ~Proxy_session();
+
+    // send the request for the decoded path and the query, NULL if there is none, to an upstream
+    // the events of the upstream go to epollfd and carry client_data, the epoll data of the client
+    // the upstream gets timeout seconds to connect and for every read, 0 for no limit
+    // return false if no upstream can be reached
+    bool start(int epollfd, int clientfd, uint64_t client_data, const char *path, const char *query, const char *host,
+               bool http10, uint32_t client_ip, bool keep_alive, int timeout);
+
+    RESULT on_upstream();
+
+    RESULT on_client();
+
+    // the deadline of the upstream has passed, BAD_GATEWAY if nothing has been sent to the client yet
+    RESULT on_timeout();
+
+    // whether the client connection can be kept alive after DONE
+    bool keep_client() const;
+
+    // the request is a MISS of cache, the response is stored in entry if it is cacheable
+    // called before start()
+    void capture(Response_cache *cache, Cache_entry *entry);
+
+private:
+    enum STATE {CONNECTING, SENDING, READING_HEAD, RELAY};
+
+    // how the end of the response body is found
+    enum BODY {BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_EOF};
+
+    // states of the scanner of a chunked body
+    enum CHUNK_STATE {CHUNK_SIZE, CHUNK_EXT, CHUNK_SIZE_LF, CHUNK_DATA, CHUNK_DATA_CR, CHUNK_DATA_LF,
+                      CHUNK_TRAILER, CHUNK_TRAILER_LINE, CHUNK_END_LF, CHUNK_DONE};
+
+    // connect to an upstream, a pooled connection if allow_pooled
+    bool connect_upstream(bool allow_pooled);
+
+    // a pooled connection that failed before answering is replaced by a new one
+    RESULT retry_or_fail();
+
+    RESULT send_request();
+    RESULT read_head();
+    RESULT relay();
+
+    // parse the head of the response in m_in and put the head for the client into m_out
+    bool parse_head(int head_len);
+
+    // follow the chunked body in p, return the number of bytes up to the end of the body
+    int scan_chunks(const char *p, int len);
+
+    // append body bytes to the copy for the cache, give up when it grows too large
+    void capture_body(const char *data, int len);
+
+    // hand the copy to the cache, or tell the cache the response is not stored
+    void finish_capture(bool complete);
+
+    // start the deadline of the wait, then register or re-arm the upstream socket,
+    // which hands the session to the event loop, the caller does not touch it afterwards
+    void arm_upstream(int ev);
+
+    // give the upstream connection back
+    void release_upstream(bool reusable);
+
+    Proxy *m_proxy;
+    const Proxy_route *m_route;
+
+    int m_epollfd;
+    int m_clientfd;
+    uint64_t m_client_data;
+
+    // the upstream connection, the index of its upstream, whether it is in the epoll,
+    // whether it came from the pool
+    int m_upfd;
+    int m_upstream;
+    bool m_registered;
+    bool m_reused;
+
+    STATE m_state;
+    BODY m_body;
+
+    // whether the upstream and the client connections stay alive after the response
+    bool m_upstream_keep;
+    bool m_client_keep;
+
+    // bytes of the body not received yet with BODY_LENGTH
+    int64_t m_remaining;
+
+    // scanner of a chunked body
+    CHUNK_STATE m_chunk_state;
+    int64_t m_chunk_left;
+
+    // the upstream closed a BODY_EOF response
+    bool m_eof;
+
+    // data received from the upstream
+    char m_in[BUFFER_SIZE];
+    int m_in_len;
+
+    // the request for the upstream, then the head of the response for the client
+    char m_out[BUFFER_SIZE + 256];
+
+    // data waiting to be sent, to the upstream while sending the request, to the client after
+    const char *m_pending;
+    int m_pending_len;
+
+    // the cache entry the response fills, NULL if it is not stored
+    Response_cache *m_cache;
+    Cache_entry *m_fill;
+    int m_max_age;
+
+    // copy of the response for the cache, the head without the headers about the length, then the body
+    char *m_capture;
+    int m_capture_len;
+    int m_capture_size;
+    int m_capture_head;
+
+    // pipe of splice() and the bytes in it
+    int m_pipe[2];
+    int m_pipe_bytes;
+
+    // seconds the upstream gets for one wait, and the timerfd of the deadline, -1 until the first wait
+    int m_timeout;
+    int m_timerfd;
+
+    // whether the session waits for the upstream rather than the client, a deadline passing otherwise is stale
+    bool m_waiting_upstream;
+};
+
+#endif
@@ -0,0 +1,277 @@
+#include "request.h"
+
+// the names of the known headers, in the order of HTTP_HEADER
+static const char *header_names[HEADER_COUNT] = {
+    "Host",
+    "Connection",
+    "Content-Length",
+    "Content-Type",
+    "Transfer-Encoding",
+    "If-None-Match",
+    "If-Modified-Since",
+    "Range",
+    "Accept",
+    "Accept-Encoding",
+    "User-Agent",
+    "Referer",
+    "Cookie",
+    "Authorization",
+    "Upgrade",
+    "Expect"
+};
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+Http_request::Http_request() {
+    clear();
+}
+
+void Http_request::clear() {
+    method = std::string_view();
+    path = std::string_view();
+    query = std::string_view();
+    version = std::string_view();
+    m_header_count = 0;
+    memset(m_index, -1, sizeof(m_index));
+}
+
+bool Http_request::equals_nocase(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+HTTP_HEADER Http_request::known_header(std::string_view name) {
+    if (name.empty()) {
+        return HEADER_COUNT;
+    }
+
+    // the length and the first letter leave at most one candidate
+    HTTP_HEADER candidate = HEADER_COUNT;
+    char first = name[0] | 0x20;
+    switch (name.size()) {
+        case 4 : candidate = HEADER_HOST; break;
+        case 5 : candidate = HEADER_RANGE; break;
+        case 6 : {
+            candidate = first == 'a' ? HEADER_ACCEPT : first == 'c' ? HEADER_COOKIE : HEADER_EXPECT;
+            break;
+        }
+        case 7 : candidate = first == 'r' ? HEADER_REFERER : HEADER_UPGRADE; break;
+        case 10 : candidate = first == 'c' ? HEADER_CONNECTION : HEADER_USER_AGENT; break;
+        case 12 : candidate = HEADER_CONTENT_TYPE; break;
+        case 13 : candidate = first == 'i' ? HEADER_IF_NONE_MATCH : HEADER_AUTHORIZATION; break;
+        case 14 : candidate = HEADER_CONTENT_LENGTH; break;
+        case 15 : candidate = HEADER_ACCEPT_ENCODING; break;
+        case 17 : candidate = first == 't' ? HEADER_TRANSFER_ENCODING : HEADER_IF_MODIFIED_SINCE; break;
+        default : return HEADER_COUNT;
+    }
+    return equals_nocase(name, header_names[candidate]) ? candidate : HEADER_COUNT;
+}
+
+long Http_request::normalize_path(char *path, size_t len) {
+    // %XX to the byte, in place, the result is never longer
+    size_t n = 0;
+    for (size_t i = 0; i < len; ++i) {
+        char c = path[i];
+        if (c == '%') {
+            int high = i + 2 < len ? hex_value(path[i + 1]) : -1;
+            int low = high >= 0 ? hex_value(path[i + 2]) : -1;
+            if (low < 0 || (high == 0 && low == 0)) {
+                return -1;
+            }
+            c = (char)(high * 16 + low);
+            i += 2;
+        }
+        path[n++] = c;
+    }
+
+    // drop empty and "." segments, ".." removes the one before, each output segment is written as "/seg"
+    size_t out = 0;
+    size_t i = 0;
+    bool dir = false;
+    while (i < n) {
+        while (i < n && path[i] == '/') {
+            ++i;
+        }
+        size_t start = i;
+        while (i < n && path[i] != '/') {
+            ++i;
+        }
+        size_t seg = i - start;
+        if (seg == 0) {
+            dir = true;
+            break;
+        }
+        if (seg == 1 && path[start] == '.') {
+            dir = true;
+            continue;
+        }
+        if (seg == 2 && path[start] == '.' && path[start + 1] == '.') {
+            if (out == 0) {
+                return -1;
+            }
+            while (path[out - 1] != '/') {
+                --out;
+            }
+            --out;
+            dir = true;
+            continue;
+        }
+        path[out++] = '/';
+        memmove(path + out, path + start, seg);
+        out += seg;
+        dir = false;
+    }
+    if (out == 0 || dir) {
+        path[out++] = '/';
+    }
+    path[out] = '\0';
+    return out;
+}
+
+bool Http_request::parse_request_line(char *text) {
+    // GET /index.html HTTP/1.1
+    char *target = strpbrk(text, " \t");
+    if (!target) {
+        return false;
+    }
+    method = std::string_view(text, target - text);
+    *target++ = '\0';
+    target += strspn(target, " \t");
+
+    char *ver = strpbrk(target, " \t");
+    if (!ver) {
+        return false;
+    }
+    *ver++ = '\0';
+    ver += strspn(ver, " \t");
+    version = std::string_view(ver);
+
+    // http://192.168.110.129:10000/index.html
+    if (strncasecmp(target, "http://", 7) == 0) {
+        target = strchr(target + 7, '/');
+        if (!target) {
+            return false;
+        }
+    }
+    if (target[0] != '/') {
+        return false;
+    }
+
+    char *mark = strchr(target, '?');
+    size_t path_len = mark ? (size_t)(mark - target) : strlen(target);
+    if (mark) {
+        *mark = '\0';
+        query = std::string_view(mark + 1);
+    }
+    long len = normalize_path(target, path_len);
+    if (len < 0) {
+        return false;
+    }
+    path = std::string_view(target, len);
+    return true;
+}
+
+bool Http_request::parse_header(char *text) {
+    char *colon = strchr(text, ':');
+    if (!colon || colon == text || is_space(colon[-1])) {
+        return false;
+    }
+    if (m_header_count == MAX_HEADERS) {
+        return false;
+    }
+    *colon = '\0';
+
+    char *value = colon + 1;
+    value += strspn(value, " \t");
+    char *end = value + strlen(value);
+    while (end > value && is_space(end[-1])) {
+        --end;
+    }
+    *end = '\0';
+
+    Header& header = m_headers[m_header_count];
+    header.name = std::string_view(text, colon - text);
+    header.value = std::string_view(value, end - value);
+
+    HTTP_HEADER known = known_header(header.name);
+    if (known != HEADER_COUNT) {
+        if (m_index[known] >= 0) {
+            // two lengths of one body are how requests are smuggled past a proxy
+            if (known == HEADER_CONTENT_LENGTH && m_headers[m_index[known]].value != header.value) {
+                return false;
+            }
+        } else {
+            m_index[known] = m_header_count;
+        }
+    }
+    ++m_header_count;
+    return true;
+}
+
+std::string_view Http_request::header(std::string_view name) const {
+    HTTP_HEADER known = known_header(name);
+    if (known != HEADER_COUNT) {
+        return header(known);
+    }
+    for (int i = 0; i < m_header_count; ++i) {
+        if (equals_nocase(m_headers[i].name, name)) {
+            return m_headers[i].value;
+        }
+    }
+    return std::string_view();
+}
+
+long Http_request::content_length(long max) const {
+    if (!has(HEADER_CONTENT_LENGTH)) {
+        return 0;
+    }
+    // digits only, atol() would take "-1", "+5" or "12abc" and wrap around past LONG_MAX
+    std::string_view value = header(HEADER_CONTENT_LENGTH);
+    if (value.empty()) {
+        return -1;
+    }
+    long length = 0;
+    for (char c : value) {
+        if (c < '0' || c > '9' || length > max / 10 || length * 10 > max - (c - '0')) {
+            return -1;
+        }
+        length = length * 10 + (c - '0');
+    }
+    return length;
+}
+
+bool Http_request::header_has_token(HTTP_HEADER h, std::string_view token) const {
+    std::string_view value = header(h);
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        while (!item.empty() && is_space(item.front())) {
+            item.remove_prefix(1);
+        }
+        while (!item.empty() && is_space(item.back())) {
+            item.remove_suffix(1);
+        }
+        if (equals_nocase(item, token)) {
+            return true;
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
@@ -0,0 +1,112 @@
+#ifndef __REQUEST__H
+#define __REQUEST__H
+
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <string_view>
+
+// the headers the server looks up, each has a place in the index of a request
+enum HTTP_HEADER {
+    HEADER_HOST = 0,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_RANGE,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_USER_AGENT,
+    HEADER_REFERER,
+    HEADER_COOKIE,
+    HEADER_AUTHORIZATION,
+    HEADER_UPGRADE,
+    HEADER_EXPECT,
+    HEADER_COUNT
+};
+
+// class Http_request is a parsed request, every part of it is a view into the reading buffer
+// the parser writes '\0' after each part and decodes the path where it is, nothing is copied,
+// so the views also work as C strings and live as long as the buffer holds the request
+class Http_request
+{
+public:
+    // headers kept per request, a request with more is refused
+    static const int MAX_HEADERS = 48;
+
+    struct Header
+    {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    Http_request();
+
+    // forget the request, before the next one is parsed
+    void clear();
+
+    // "GET /a%20b/../c?x=1 HTTP/1.1", text is a line of the reading buffer ending with '\0'
+    // the path is percent-decoded and normalized, false if the line is malformed
+    // or the path leaves the root
+    bool parse_request_line(char *text);
+
+    // "Name: value", false if the line is malformed, there are too many headers,
+    // or Content-Length is given twice with different values
+    bool parse_header(char *text);
+
+    // a header by its enum, empty if the request does not have it
+    std::string_view header(HTTP_HEADER h) const {
+        return m_index[h] < 0 ? std::string_view() : m_headers[m_index[h]].value;
+    }
+
+    // the value of a header as a C string, NULL if the request does not have it
+    const char* header_cstr(HTTP_HEADER h) const {
+        return m_index[h] < 0 ? NULL : m_headers[m_index[h]].value.data();
+    }
+
+    // any header by its name, the first one if it is repeated
+    std::string_view header(std::string_view name) const;
+
+    bool has(HTTP_HEADER h) const { return m_index[h] >= 0; }
+
+    int header_count() const { return m_header_count; }
+
+    const Header& header_at(int i) const { return m_headers[i]; }
+
+    // the value of Content-Length, 0 if the request has none, -1 if it is not a number of at most max
+    long content_length(long max) const;
+
+    // whether the value of header h, a comma-separated list, has token
+    bool header_has_token(HTTP_HEADER h, std::string_view token) const;
+
+    // the enum of a header name, HEADER_COUNT if the server does not look it up
+    static HTTP_HEADER known_header(std::string_view name);
+
+    // whether a and b are equal ignoring the case of ASCII letters
+    static bool equals_nocase(std::string_view a, std::string_view b);
+
+public:
+    std::string_view method;
+
+    // decoded and normalized, it always starts with '/'
+    std::string_view path;
+
+    // after '?', still encoded, empty if there is none
+    std::string_view query;
+
+    std::string_view version;
+
+private:
+    // decode and normalize the len bytes of path in place, return the new length, -1 if it is invalid
+    static long normalize_path(char *path, size_t len);
+
+    Header m_headers[MAX_HEADERS];
+    int m_header_count;
+
+    // where each known header is in m_headers, -1 if the request does not have it
+    int8_t m_index[HEADER_COUNT];
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include <algorithm>
+
+#include "router.h"
+
+std::string_view Route_match::param(std::string_view name) const {
+    for (int i = 0; i < count; ++i) {
+        if (names[i] == name) {
+            return values[i];
+        }
+    }
+    return std::string_view();
+}
+
+Router::Router() : m_root(new Node), m_route_count(0), m_node_count(1) {}
+
+Router::~Router() {
+    destroy(m_root);
+    for (size_t i = 0; i < m_handlers.size(); ++i) {
+        delete m_handlers[i];
+    }
+}
+
+void Router::destroy(Node *node) {
+    for (size_t i = 0; i < node->children.size(); ++i) {
+        destroy(node->children[i]);
+    }
+    if (node->param) {
+        destroy(node->param);
+    }
+    delete node;
+}
+
+Router::Node* Router::insert(Node *node, std::string_view s) {
+    while (!s.empty()) {
+        size_t slot = node->first.find(s[0]);
+        if (slot == std::string::npos) {
+            Node *child = new Node;
+            child->label = std::string(s);
+            node->first.push_back(s[0]);
+            node->children.push_back(child);
+            ++m_node_count;
+            return child;
+        }
+
+        Node *child = node->children[slot];
+        size_t common = 0;
+        while (common < child->label.size() && common < s.size() && child->label[common] == s[common]) {
+            ++common;
+        }
+        if (common < child->label.size()) {
+            // the route leaves the label in the middle, the label is split there
+            Node *split = new Node;
+            split->label = child->label.substr(0, common);
+            child->label.erase(0, common);
+            split->first.push_back(child->label[0]);
+            split->children.push_back(child);
+            node->children[slot] = split;
+            ++m_node_count;
+            child = split;
+        }
+        node = child;
+        s.remove_prefix(common);
+    }
+    return node;
+}
+
+bool Router::add(const char *pattern, KIND kind, Route_handler *handler) {
+    if (std::find(m_handlers.begin(), m_handlers.end(), handler) == m_handlers.end()) {
+        m_handlers.push_back(handler);
+    }
+    if (pattern[0] != '/') {
+        printf("router: %s does not start with /\n", pattern);
+        return false;
+    }
+
+    // the static bytes up to each ":name" segment, then the parameter
+    Node *node = m_root;
+    int params = 0;
+    const char *p = pattern;
+    while (*p) {
+        const char *colon = p;
+        while ((colon = strchr(colon, ':')) && colon[-1] != '/') {
+            ++colon;
+        }
+        if (!colon) {
+            node = insert(node, p);
+            break;
+        }
+        node = insert(node, std::string_view(p, colon - p));
+
+        const char *name_end = strchrnul(colon, '/');
+        std::string name(colon + 1, name_end - colon - 1);
+        if (name.empty() || ++params > Route_match::MAX_PARAMS) {
+            printf("router: bad parameter in %s\n", pattern);
+            return false;
+        }
+        if (!node->param) {
+            node->param = new Node;
+            node->param_name = name;
+            ++m_node_count;
+        } else if (node->param_name != name) {
+            printf("router: %s names the parameter :%s\n", pattern, node->param_name.c_str());
+            return false;
+        }
+        node = node->param;
+        p = name_end;
+    }
+
+    Route_handler *&slot = kind == EXACT ? node->exact : node->prefix;
+    if (slot) {
+        printf("router: %s is routed twice\n", pattern);
+        return false;
+    }
+    slot = handler;
+    ++m_route_count;
+    return true;
+}
+
+Route_handler* Router::find(std::string_view path, Route_match *match) const {
+    match->count = 0;
+    match->rest = std::string_view();
+    Route_handler *handler = find(m_root, path.data(), path.data() + path.size(), false, match);
+    if (!handler) {
+        handler = find(m_root, path.data(), path.data() + path.size(), true, match);
+    }
+    return handler;
+}
+
+Route_handler* Router::find(const Node *node, const char *p, const char *end, bool prefix, Route_match *match) const {
+    if (!prefix && p == end && node->exact) {
+        return node->exact;
+    }
+    if (p < end) {
+        // at most one child starts with the next byte
+        const char *hit = (const char*)memchr(node->first.data(), *p, node->first.size());
+        if (hit) {
+            const Node *child = node->children[hit - node->first.data()];
+            size_t len = child->label.size();
+            if ((size_t)(end - p) >= len && memcmp(p, child->label.data(), len) == 0) {
+                Route_handler *handler = find(child, p + len, end, prefix, match);
+                if (handler) {
+                    return handler;
+                }
+            }
+        }
+
+        // a parameter takes the segment up to the next '/', it is never empty
+        if (node->param && *p != '/') {
+            const char *seg_end = (const char*)memchr(p, '/', end - p);
+            if (!seg_end) {
+                seg_end = end;
+            }
+            int slot = match->count++;
+            match->names[slot] = node->param_name;
+            match->values[slot] = std::string_view(p, seg_end - p);
+            Route_handler *handler = find(node->param, seg_end, end, prefix, match);
+            if (handler) {
+                return handler;
+            }
+            match->count = slot;
+        }
+    }
+    if (prefix && node->prefix) {
+        match->rest = std::string_view(p, end - p);
+        return node->prefix;
+    }
+    return NULL;
+}
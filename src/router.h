@@ -0,0 +1,110 @@
+#ifndef __ROUTER__H
+#define __ROUTER__H
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <string_view>
+
+#include "http_conn.h"
+
+// what a route captured from the path of a request
+struct Route_match
+{
+    static const int MAX_PARAMS = 8;
+
+    // the ":name" segments of the route and the segments of the path they matched
+    std::string_view names[MAX_PARAMS];
+    std::string_view values[MAX_PARAMS];
+    int count;
+
+    // the part of the path after the pattern of a prefix route, empty for the other routes
+    std::string_view rest;
+
+    // the value of a parameter by its name, empty if the route does not have it
+    std::string_view param(std::string_view name) const;
+};
+
+// a handler of the requests of some routes
+// it runs in the thread handling the request, a worker or an event loop, so it has to be thread safe
+class Route_handler
+{
+public:
+    virtual ~Route_handler() {}
+
+    // answer the request of conn, the result is what do_request() returns
+    virtual Http_conn::HTTP_CODE handle(Http_conn *conn, const Route_match& match) = 0;
+
+    // the lane of the thread pool its requests are queued in
+    virtual Http_conn::LANE lane() const { return Http_conn::LANE_NORMAL; }
+};
+
+// class Router maps the paths of requests to handlers with a compressed radix tree
+// the tree is built once at startup and never changed after, so lookups from any thread take no lock
+// a pattern is matched byte by byte, a segment written ":name" matches one segment of the path
+// when several routes match, an exact one wins over a parameter, and a parameter over a prefix,
+// among prefix routes the longest wins
+class Router
+{
+public:
+    // EXACT: the whole path is the pattern
+    // PREFIX: the path starts with the pattern
+    enum KIND {EXACT = 0, PREFIX};
+
+    Router();
+
+    ~Router();
+
+    // add a route, the router owns handler from then on, one handler can serve several routes
+    // false if the pattern is invalid or the route already has a handler
+    bool add(const char *pattern, KIND kind, Route_handler *handler);
+
+    // the handler of path, NULL if no route matches and the request is for a file
+    Route_handler* find(std::string_view path, Route_match *match) const;
+
+    int route_count() const { return m_route_count; }
+
+    // number of nodes of the tree
+    int node_count() const { return m_node_count; }
+
+private:
+    struct Node
+    {
+        // the bytes of the path this node stands for, after its parent
+        std::string label;
+
+        // the first byte of the label of each child, children[i] starts with first[i]
+        std::string first;
+        std::vector<Node*> children;
+
+        // the ":name" segment following the node, NULL if there is none
+        Node *param;
+        std::string param_name;
+
+        // the handlers of the routes ending at the node
+        Route_handler *exact;
+        Route_handler *prefix;
+
+        Node() : param(NULL), exact(NULL), prefix(NULL) {}
+    };
+
+    // the node at the end of the bytes of s below node, nodes are split and added on the way
+    Node* insert(Node *node, std::string_view s);
+
+    // the exact routes are searched first, the prefix routes only when none of them matches,
+    // else a prefix met on the way down would win over a parameter on another branch
+    Route_handler* find(const Node *node, const char *p, const char *end, bool prefix, Route_match *match) const;
+
+    static void destroy(Node *node);
+
+    Node *m_root;
+    int m_route_count;
+    int m_node_count;
+
+    std::vector<Route_handler*> m_handlers;
+
+    Router(const Router&) = delete;
+    Router& operator=(const Router&) = delete;
+};
+
+#endif
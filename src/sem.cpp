@@ -23,6 +23,10 @@ bool Sem::wait() {
     return sem_wait(&m_sem) == 0;
 }
 
+bool Sem::try_wait() {
+    return sem_trywait(&m_sem) == 0;
+}
+
 bool Sem::post() {
     return sem_post(&m_sem) == 0;
 }
\ No newline at end of file
@@ -19,6 +19,9 @@ public:
     ~Sem();
 
     bool wait();
+
+    // take the semaphore if it is posted, without blocking
+    bool try_wait();
     
     bool post();
 
@@ -0,0 +1,113 @@
+#include "spin.h"
+
+// from linux/eventpoll.h of Linux 6.9, older headers do not have it
+#ifndef EPIOCSPARAMS
+struct epoll_params
+{
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+// packets taken from a device queue per busy poll, the kernel default
+#define BUSY_POLL_BUDGET 8
+
+// the shortest spin worth adapting, below it the spin stops
+#define MIN_SPIN_US 4
+
+bool busy_poll_socket(int fd, int usecs) {
+    int prefer = 1;
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+    return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == 0;
+}
+
+bool busy_poll_epoll(int epollfd, int usecs) {
+    struct epoll_params params;
+    params.busy_poll_usecs = usecs;
+    params.busy_poll_budget = BUSY_POLL_BUDGET;
+    params.prefer_busy_poll = usecs > 0;
+    params.__pad = 0;
+    return ioctl(epollfd, EPIOCSPARAMS, &params) == 0;
+}
+
+Adaptive_spin::Adaptive_spin(int max_us) :
+m_max_us(max_us),
+m_budget_us(max_us) {}
+
+long Adaptive_spin::now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void Adaptive_spin::on_spin_hit() {
+    // busy, keep spinning as long as allowed
+    m_budget_us *= 2;
+    if (m_budget_us > m_max_us || m_budget_us < MIN_SPIN_US) {
+        m_budget_us = m_max_us;
+    }
+}
+
+void Adaptive_spin::on_sleep(long slept_us) {
+    if (slept_us <= m_max_us) {
+        // a longer spin would have caught it
+        on_spin_hit();
+    } else {
+        // quiet, the cpu is better given back
+        m_budget_us /= 2;
+        if (m_budget_us < MIN_SPIN_US) {
+            m_budget_us = 0;
+        }
+    }
+}
+
+int Adaptive_spin::epoll_wait(int epollfd, epoll_event *events, int max_events, int timeout) {
+    if (m_budget_us > 0 && timeout != 0) {
+        long start = now_us();
+        do {
+            int number = ::epoll_wait(epollfd, events, max_events, 0);
+            if (number != 0) {
+                if (number > 0) {
+                    on_spin_hit();
+                }
+                return number;
+            }
+        } while (now_us() - start < m_budget_us);
+    }
+
+    long start = now_us();
+    int number = ::epoll_wait(epollfd, events, max_events, timeout);
+    if (m_max_us > 0 && number > 0) {
+        on_sleep(now_us() - start);
+    }
+    return number;
+}
+
+void Adaptive_spin::wait(Futex_sem& sem) {
+    if (m_budget_us > 0) {
+        long start = now_us();
+        do {
+            // the count is in user memory, trying it costs no syscall
+            for (int i = 0; i < 64; ++i) {
+                if (sem.try_wait()) {
+                    on_spin_hit();
+                    return;
+                }
+                cpu_relax();
+            }
+        } while (now_us() - start < m_budget_us);
+    }
+
+    long start = now_us();
+    sem.wait();
+    if (m_max_us > 0) {
+        on_sleep(now_us() - start);
+    }
+}
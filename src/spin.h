@@ -0,0 +1,56 @@
+#ifndef __SPIN__H
+#define __SPIN__H
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include "futex.h"
+
+// waiting without sleeping in the kernel, for deployments that trade cpu for latency
+// the kernel busy polls the device queues of the sockets when it supports it,
+// the event loops and the workers spin before they sleep
+
+// let the kernel busy poll the device queue of the socket for usecs on a blocking read
+// raising it above net.core.busy_read needs CAP_NET_ADMIN
+bool busy_poll_socket(int fd, int usecs);
+
+// let epoll_wait() busy poll the device queues of its sockets for usecs, 0 to stop, Linux 6.9 and later
+bool busy_poll_epoll(int epollfd, int usecs);
+
+// class Adaptive_spin waits for events by spinning first and sleeping after
+// the time it spins adapts to the load: a wait that ended while spinning, or soon after it gave up,
+// makes the next spin longer, a long sleep makes it shorter
+// one object per thread
+class Adaptive_spin
+{
+public:
+    // max_us is the longest spin, 0 never spins
+    Adaptive_spin(int max_us);
+
+    // epoll_wait() that spins with a zero timeout before it blocks with timeout
+    int epoll_wait(int epollfd, epoll_event *events, int max_events, int timeout);
+
+    // Futex_sem::wait() that tries the semaphore before it blocks on it
+    void wait(Futex_sem& sem);
+
+    int budget_us() const { return m_budget_us; }
+
+private:
+    // the wait ended while spinning
+    void on_spin_hit();
+
+    // the spin gave up and the thread slept slept_us
+    void on_sleep(long slept_us);
+
+    static long now_us();
+
+    int m_max_us;
+    int m_budget_us;
+};
+
+#endif
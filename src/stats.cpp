@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <new>
+
+#include "stats.h"
+#include "trace.h"
+
+Stats_segment *Stats::m_segment = NULL;
+int Stats::m_process = 0;
+double Stats::m_us_per_tick = 0;
+char Stats::m_name[64] = "";
+
+static const char *histogram_names[STATS_HISTOGRAMS] = {"request", "queue", "parse", "disk"};
+
+// "/name" as shm_open() wants it
+static bool shm_name(const char *name, char *buf, size_t size) {
+    int len = snprintf(buf, size, "%s%s", name[0] == '/' ? "" : "/", name);
+    return len > 1 && (size_t)len < size && !strchr(buf + 1, '/');
+}
+
+uint64_t Stats::monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+bool Stats::open(const char *name, int port) {
+    // the rate of the clock of Tracer::now(), the histograms are in microseconds
+    uint64_t us = monotonic_us();
+    uint64_t ticks = Tracer::now();
+    struct timespec wait = {0, 10000000};
+    nanosleep(&wait, NULL);
+    m_us_per_tick = (double)(monotonic_us() - us) / (Tracer::now() - ticks);
+
+    size_t size = sizeof(Stats_segment);
+    void *addr = NULL;
+    if (name[0] == '\0') {
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    } else {
+        if (!shm_name(name, m_name, sizeof(m_name))) {
+            printf("stats: invalid segment name %s\n", name);
+            return false;
+        }
+        // a segment left by a server that died is replaced, one of a running server is taken over,
+        // its readers keep the old mapping
+        shm_unlink(m_name);
+        int fd = shm_open(m_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 || ftruncate(fd, size) < 0) {
+            printf("stats: cannot create %s: %s\n", m_name, strerror(errno));
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            m_name[0] = '\0';
+            return false;
+        }
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+    }
+    if (addr == MAP_FAILED) {
+        printf("stats: cannot map the segment\n");
+        return false;
+    }
+
+    // the pages are zero, the counters start there
+    Stats_segment *s = new (addr) Stats_segment;
+    s->pid = getpid();
+    s->port = port;
+    s->started = time(NULL);
+    s->size = size;
+    s->version = STATS_VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    s->magic = STATS_MAGIC;
+    m_segment = s;
+    return true;
+}
+
+void Stats::close() {
+    if (!m_segment) {
+        return;
+    }
+    if (m_name[0]) {
+        // an upgraded server may own the name now
+        int fd = shm_open(m_name, O_RDONLY, 0);
+        if (fd >= 0) {
+            int32_t pid = 0;
+            if (pread(fd, &pid, sizeof(pid), offsetof(Stats_segment, pid)) == sizeof(pid) && pid == getpid()) {
+                shm_unlink(m_name);
+            }
+            ::close(fd);
+        }
+    }
+    munmap(m_segment, sizeof(Stats_segment));
+    m_segment = NULL;
+}
+
+void Stats::forget(int i) {
+    Stats_gauges& g = m_segment->gauges[i];
+    g.pid.store(0, std::memory_order_relaxed);
+    g.connections.store(0, std::memory_order_relaxed);
+    g.queue_depth.store(0, std::memory_order_relaxed);
+    g.workers.store(0, std::memory_order_relaxed);
+    g.shed.store(0, std::memory_order_relaxed);
+}
+
+void Stats::observe(STATS_HISTOGRAM h, uint64_t us) {
+    Stats_histogram& hist = m_segment->histograms[h];
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+    hist.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    hist.count.fetch_add(1, std::memory_order_relaxed);
+    hist.sum_us.fetch_add(us, std::memory_order_relaxed);
+}
+
+// a copy of the segment at one moment, what top shows is the difference between two
+struct Stats_snapshot
+{
+    uint64_t at_us;
+    uint64_t accepted;
+    uint64_t rejected;
+    uint64_t requests;
+    uint64_t proxied;
+    uint64_t bytes_sent;
+    uint64_t responses[6];
+    uint64_t buckets[STATS_HISTOGRAMS][STATS_BUCKETS];
+    uint64_t count[STATS_HISTOGRAMS];
+    uint64_t sum_us[STATS_HISTOGRAMS];
+};
+
+static void take_snapshot(const Stats_segment *s, Stats_snapshot *snap) {
+    snap->at_us = Stats::monotonic_us();
+    snap->accepted = s->accepted.load(std::memory_order_relaxed);
+    snap->rejected = s->rejected.load(std::memory_order_relaxed);
+    snap->requests = s->requests.load(std::memory_order_relaxed);
+    snap->proxied = s->proxied.load(std::memory_order_relaxed);
+    snap->bytes_sent = s->bytes_sent.load(std::memory_order_relaxed);
+    for (int i = 0; i < 6; ++i) {
+        snap->responses[i] = s->responses[i].load(std::memory_order_relaxed);
+    }
+    for (int h = 0; h < STATS_HISTOGRAMS; ++h) {
+        for (int b = 0; b < STATS_BUCKETS; ++b) {
+            snap->buckets[h][b] = s->histograms[h].buckets[b].load(std::memory_order_relaxed);
+        }
+        snap->count[h] = s->histograms[h].count.load(std::memory_order_relaxed);
+        snap->sum_us[h] = s->histograms[h].sum_us.load(std::memory_order_relaxed);
+    }
+}
+
+// the upper bound of the bucket holding quantile q of the interval, as "<512us"
+static void format_quantile(const uint64_t *now, const uint64_t *before, uint64_t total, double q, char *buf, size_t size) {
+    if (total == 0) {
+        snprintf(buf, size, "-");
+        return;
+    }
+    uint64_t rank = (uint64_t)(q * total);
+    uint64_t seen = 0;
+    int b = 0;
+    for ( ; b < STATS_BUCKETS - 1; ++b) {
+        seen += now[b] - before[b];
+        if (seen > rank) {
+            break;
+        }
+    }
+    if (b == STATS_BUCKETS - 1) {
+        snprintf(buf, size, "longer");
+        return;
+    }
+    uint64_t bound = b == 0 ? 1 : 1ULL << b;
+    if (bound < 1000) {
+        snprintf(buf, size, "<%lluus", (unsigned long long)bound);
+    } else if (bound < 1000000) {
+        snprintf(buf, size, "<%.1fms", bound / 1e3);
+    } else {
+        snprintf(buf, size, "<%.1fs", bound / 1e6);
+    }
+}
+
+int Stats::top(const char *name, int interval_ms, int count) {
+    char path[64];
+    if (!shm_name(name, path, sizeof(path))) {
+        printf("stats: invalid segment name %s\n", name);
+        return 1;
+    }
+    int fd = shm_open(path, O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Stats_segment)) {
+        printf("stats: no segment %s, is the server running with --stats-shm=%s?\n", path, name);
+        return 1;
+    }
+    const Stats_segment *s = (const Stats_segment*)mmap(NULL, sizeof(Stats_segment), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (s == MAP_FAILED || s->magic != STATS_MAGIC || s->version != STATS_VERSION || s->size != sizeof(Stats_segment)) {
+        printf("stats: %s has another layout, the server and this binary differ\n", path);
+        return 1;
+    }
+
+    Stats_snapshot *before = new Stats_snapshot;
+    Stats_snapshot *now = new Stats_snapshot;
+    take_snapshot(s, before);
+    bool tty = isatty(1);
+    for (int frame = 0; count == 0 || frame < count; ++frame) {
+        struct timespec wait = {interval_ms / 1000, (interval_ms % 1000) * 1000000L};
+        nanosleep(&wait, NULL);
+        if (kill(s->pid, 0) < 0 && errno == ESRCH) {
+            printf("stats: the server %d is gone\n", s->pid);
+            break;
+        }
+        take_snapshot(s, now);
+        double secs = (now->at_us - before->at_us) / 1e6;
+        long up = time(NULL) - s->started;
+
+        if (tty) {
+            printf("\033[H\033[2J");
+        }
+        printf("server %d on port %d, up %ld:%02ld:%02ld\n", s->pid, s->port, up / 3600, up / 60 % 60, up % 60);
+        // the gauges of every process add up
+        long long connections = 0, queue = 0, workers = 0, shed = 0;
+        for (int i = 0; i < STATS_PROCESSES; ++i) {
+            const Stats_gauges& g = s->gauges[i];
+            connections += g.connections.load(std::memory_order_relaxed);
+            queue += g.queue_depth.load(std::memory_order_relaxed);
+            workers += g.workers.load(std::memory_order_relaxed);
+            shed += g.shed.load(std::memory_order_relaxed);
+        }
+        long long processes = s->processes.load(std::memory_order_relaxed);
+        if (processes > 0) {
+            printf("processes %lld  ", processes);
+        }
+        printf("connections %lld  queue %lld  workers %lld  shed %lld\n", connections, queue, workers, shed);
+        printf("per second: %.0f requests  %.0f accepted  %.0f rejected  %.0f proxied  %.2f MB sent\n",
+               (now->requests - before->requests) / secs, (now->accepted - before->accepted) / secs,
+               (now->rejected - before->rejected) / secs, (now->proxied - before->proxied) / secs,
+               (now->bytes_sent - before->bytes_sent) / secs / (1 << 20));
+        printf("responses per second: 2xx %.0f  3xx %.0f  4xx %.0f  5xx %.0f\n",
+               (now->responses[2] - before->responses[2]) / secs, (now->responses[3] - before->responses[3]) / secs,
+               (now->responses[4] - before->responses[4]) / secs, (now->responses[5] - before->responses[5]) / secs);
+        printf("%-8s %10s %10s %10s %10s %10s\n", "stage", "per second", "mean", "p50", "p90", "p99");
+        for (int h = 0; h < STATS_HISTOGRAMS; ++h) {
+            uint64_t total = now->count[h] - before->count[h];
+            char mean[16], p50[16], p90[16], p99[16];
+            snprintf(mean, sizeof(mean), total ? "%.0fus" : "-", total ? (double)(now->sum_us[h] - before->sum_us[h]) / total : 0.0);
+            format_quantile(now->buckets[h], before->buckets[h], total, 0.5, p50, sizeof(p50));
+            format_quantile(now->buckets[h], before->buckets[h], total, 0.9, p90, sizeof(p90));
+            format_quantile(now->buckets[h], before->buckets[h], total, 0.99, p99, sizeof(p99));
+            printf("%-8s %10.0f %10s %10s %10s %10s\n", histogram_names[h], total / secs, mean, p50, p90, p99);
+        }
+        fflush(stdout);
+
+        Stats_snapshot *t = before;
+        before = now;
+        now = t;
+    }
+    delete before;
+    delete now;
+    munmap((void*)s, sizeof(Stats_segment));
+    return 0;
+}
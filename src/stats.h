@@ -0,0 +1,138 @@
+#ifndef __STATS__H
+#define __STATS__H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+// the layout of the stats segment, a reader checks the magic, the version and the size first
+// fields are only added at the end, anything else changes STATS_VERSION
+#define STATS_MAGIC 0x53544257
+#define STATS_VERSION 2
+
+// buckets of a latency histogram, bucket 0 counts 0 us, bucket k counts [2^(k-1), 2^k) us,
+// the last one counts everything longer
+#define STATS_BUCKETS 32
+
+// REQUEST: from the first byte read to the end of the response
+// QUEUE: from the event loop handing the request to the thread pool to a worker taking it
+// PARSE: parsing the request and do_request() in the worker
+// DISK: a disk thread reading a cold window
+enum STATS_HISTOGRAM {STATS_REQUEST = 0, STATS_QUEUE, STATS_PARSE, STATS_DISK, STATS_HISTOGRAMS};
+
+struct Stats_histogram
+{
+    std::atomic<uint64_t> buckets[STATS_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_us;
+};
+
+// the gauges of one process, sampled ten times a second
+struct Stats_gauges
+{
+    std::atomic<int64_t> pid;
+    std::atomic<int64_t> connections;
+    std::atomic<int64_t> queue_depth;
+    std::atomic<int64_t> workers;
+    std::atomic<uint64_t> shed;
+
+    // the monotonic time in us they were sampled at
+    std::atomic<uint64_t> sampled_us;
+};
+
+// the most processes of a cluster whose gauges are kept
+#define STATS_PROCESSES 64
+
+// the segment, every field is updated with relaxed atomics and read the same way,
+// so a reader may see one field a moment ahead of another but never a torn value
+struct Stats_segment
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    int32_t pid;
+
+    // the port listened and the unix time the server started, pid is the master of a cluster
+    int32_t port;
+    int64_t started;
+
+    // counters, they only grow
+    alignas(64) std::atomic<uint64_t> accepted;
+    std::atomic<uint64_t> rejected;
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> proxied;
+    std::atomic<uint64_t> bytes_sent;
+
+    // responses by status / 100, 0 for anything not in 1xx to 5xx
+    std::atomic<uint64_t> responses[6];
+
+    Stats_histogram histograms[STATS_HISTOGRAMS];
+
+    // the worker processes of a cluster running, 0 for a single process
+    std::atomic<int64_t> processes;
+
+    // a row per process, the worker processes of a cluster each have theirs, a single process row 0
+    alignas(64) Stats_gauges gauges[STATS_PROCESSES];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the segment is shared between processes");
+
+// class Stats publishes the counters of the server in a shared memory segment
+// tools map it read-only and watch the server without a request or a syscall on its side
+// without a name the segment is anonymous memory, so the counters are updated the same way either way
+// the segment is opened before the workers of a cluster are forked, they all add to the same counters
+class Stats
+{
+public:
+    // create the segment /dev/shm/name, or private memory if name is empty
+    static bool open(const char *name, int port);
+
+    // unmap the segment, and remove it unless another server has taken the name since
+    static void close();
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    static void set(std::atomic<int64_t>& gauge, int64_t value) {
+        gauge.store(value, std::memory_order_relaxed);
+    }
+
+    // count a response with status
+    static void response(int status) {
+        int group = status / 100;
+        add(m_segment->responses[group >= 1 && group <= 5 ? group : 0]);
+    }
+
+    // the gauges of the calling process
+    static Stats_gauges& gauges() { return m_segment->gauges[m_process]; }
+
+    // clear the gauges of the process in row i, which has exited
+    static void forget(int i);
+
+    // add a latency of us to histogram h
+    static void observe(STATS_HISTOGRAM h, uint64_t us);
+
+    // the same, from ticks of Tracer::now()
+    static void observe_ticks(STATS_HISTOGRAM h, uint64_t ticks) {
+        observe(h, (uint64_t)(ticks * m_us_per_tick));
+    }
+
+    static uint64_t monotonic_us();
+
+    // print the segment name like top, every interval_ms, count times or until the server is gone if count is 0
+    static int top(const char *name, int interval_ms, int count);
+
+    static Stats_segment *m_segment;
+
+    // the row of the gauges of this process
+    static int m_process;
+
+private:
+    // microseconds per tick of Tracer::now(), measured by open()
+    static double m_us_per_tick;
+
+    static char m_name[64];
+};
+
+#endif
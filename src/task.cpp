@@ -0,0 +1,36 @@
+#include "task.h"
+
+Task::Task(Task&& other) :
+m_ops(other.m_ops) {
+    if (m_ops) {
+        m_ops(MOVE, this, &other);
+        other.m_ops = NULL;
+    }
+}
+
+Task& Task::operator=(Task&& other) {
+    if (this == &other) {
+        return *this;
+    }
+    if (m_ops) {
+        m_ops(DESTROY, this, NULL);
+    }
+    m_ops = other.m_ops;
+    if (m_ops) {
+        m_ops(MOVE, this, &other);
+        other.m_ops = NULL;
+    }
+    return *this;
+}
+
+Task::~Task() {
+    if (m_ops) {
+        m_ops(DESTROY, this, NULL);
+    }
+}
+
+void Task::run() {
+    if (m_ops) {
+        m_ops(RUN, this, NULL);
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef __TASK__H
+#define __TASK__H
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+// class Task is any work for the thread pool: a function, or a lambda with what it captured
+// callables up to INLINE_SIZE bytes are kept inside the task, so making and queueing one does not allocate,
+// bigger ones are moved to the heap
+// a task is moved, never copied, and runs at most once per run()
+class Task
+{
+public:
+    // room for a lambda capturing a few pointers and integers
+    static const size_t INLINE_SIZE = 48;
+
+    Task() : m_ops(NULL) {}
+
+    template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f) {
+        typedef typename std::decay<F>::type Fn;
+        if (sizeof(Fn) <= INLINE_SIZE && alignof(Fn) <= alignof(max_align_t) && std::is_nothrow_move_constructible<Fn>::value) {
+            new (m_storage) Fn(std::forward<F>(f));
+            m_ops = inline_ops<Fn>;
+        } else {
+            *(Fn**)m_storage = new Fn(std::forward<F>(f));
+            m_ops = heap_ops<Fn>;
+        }
+    }
+
+    Task(Task&& other);
+
+    Task& operator=(Task&& other);
+
+    ~Task();
+
+    // call the callable
+    void run();
+
+    bool empty() const { return m_ops == NULL; }
+
+private:
+    enum OP {RUN, MOVE, DESTROY};
+
+    // what the task does with its callable: call it, move it from another task, or destroy it
+    typedef void (*Ops)(OP op, Task *self, Task *from);
+
+    template<typename Fn>
+    static void inline_ops(OP op, Task *self, Task *from) {
+        switch (op) {
+            case RUN : {
+                (*(Fn*)self->m_storage)();
+                break;
+            }
+            case MOVE : {
+                new (self->m_storage) Fn(std::move(*(Fn*)from->m_storage));
+                ((Fn*)from->m_storage)->~Fn();
+                break;
+            }
+            case DESTROY : {
+                ((Fn*)self->m_storage)->~Fn();
+                break;
+            }
+        }
+    }
+
+    template<typename Fn>
+    static void heap_ops(OP op, Task *self, Task *from) {
+        switch (op) {
+            case RUN : {
+                (**(Fn**)self->m_storage)();
+                break;
+            }
+            case MOVE : {
+                *(Fn**)self->m_storage = *(Fn**)from->m_storage;
+                break;
+            }
+            case DESTROY : {
+                delete *(Fn**)self->m_storage;
+                break;
+            }
+        }
+    }
+
+    alignas(max_align_t) unsigned char m_storage[INLINE_SIZE];
+
+    // NULL for an empty task
+    Ops m_ops;
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+};
+
+#endif
@@ -1,32 +1,69 @@
 #include "threadpool.h"
 
+// every this many takes start from the lowest lane, so a busy HIGH lane cannot stop the others
+#define STARVE_TAKES 16
+
+// a due task refused by a full queue is tried again after this
+#define TIMER_RETRY_US 1000
+
+// the pool is resized at most once per interval
+#define RESIZE_INTERVAL_US 100000
+
+// share of the time the workers work above which more are added
+#define GROW_BUSY 0.85
+
+// a worker is retired when the others could do its work at most this busy, and the requests do not wait,
+// for QUIET_INTERVALS intervals in a row, the gap to GROW_BUSY keeps the size from swinging
+#define SHRINK_BUSY 0.5
+#define QUIET_INTERVALS 50
+
 
 template<typename T>
-Threadpool<T>::Threadpool(int thread_number, int max_requests) : 
-m_thread_number(thread_number),
+Threadpool<T>::Threadpool(int thread_number, int max_requests, int target_delay_us, int interval_us, int spin_us,
+                         int min_threads, int max_threads) :
+m_min_threads(min_threads > 0 && min_threads < thread_number ? min_threads : thread_number),
+m_max_threads(max_threads > thread_number ? max_threads : thread_number),
+m_threads(NULL),
+m_running(0),
+m_retiring(0),
 m_max_requests(max_requests),
+m_queued(0),
+m_takes(0),
+m_codel(target_delay_us, interval_us),
 m_stop(false),
-m_threads(NULL) {
+m_spin_us(spin_us),
+m_wait_us(0),
+m_waits(0),
+m_busy_us(0),
+m_active(0),
+m_interval_start(Codel::now_us()),
+m_quiet(0),
+m_grow_wait_us(target_delay_us / 4),
+m_timer_stop(false) {
     if ((thread_number <= 0) || (max_requests <= 0)) {
         throw std::exception();
     }
 
-    m_threads = new pthread_t[m_thread_number];
-    if (!m_threads) {
+    m_threads = new Worker_slot[m_max_threads];
+    for (int i = 0; i < m_max_threads; ++i) {
+        m_threads[i].pool = this;
+        m_threads[i].state = Worker_slot::FREE;
+    }
+
+    if (pthread_create(&m_timer_thread, NULL, timer, this) != 0) {
+        delete[] m_threads;
         throw std::exception();
     }
 
-    // create thread_number threads, and set them as detached threads
+    // create thread_number threads, they stay joinable so the destructor can wait for them
     for (int i = 0; i < thread_number; ++i) {
         printf("create the thread %d\n", i);
 
-        if (pthread_create(m_threads + i, NULL, worker, this) != 0) {
-            delete[] m_threads;
-            throw std::exception();
-        }
-
-        if (pthread_detach(m_threads[i])) {
-            delete[] m_threads;
+        m_queuelocker.lock();
+        bool ok = start_worker();
+        m_queuelocker.unlock();
+        if (!ok) {
+            stop();
             throw std::exception();
         }
     }
@@ -34,58 +71,411 @@ m_threads(NULL) {
 
 template<typename T>
 Threadpool<T>::~Threadpool() {
+    stop();
+}
+
+template<typename T>
+void Threadpool<T>::stop() {
+    // no delayed task is queued any more, the periodic ones end after their current run
+    m_timer_locker.lock();
+    m_timer_stop = true;
+    m_timer_cond.signal();
+    m_timer_locker.unlock();
+    pthread_join(m_timer_thread, NULL);
+
+    {
+        Lock_guard<Futex_mutex> guard(m_queuelocker);
+        m_stop = true;
+    }
+
+    // wake every thread, each one sees m_stop once the queue is empty
+    for (int i = 0; i < m_max_threads; ++i) {
+        m_queuestat.post();
+    }
+    for (int i = 0; i < m_max_threads; ++i) {
+        if (m_threads[i].state != Worker_slot::FREE) {
+            pthread_join(m_threads[i].thread, NULL);
+        }
+    }
     delete[] m_threads;
-    m_stop = true;
+    m_threads = NULL;
+
+    for (size_t i = 0; i < m_timers.size(); ++i) {
+        delete m_timers[i].task;
+    }
+    m_timers.clear();
 }
 
 template<typename T>
-bool Threadpool<T>::append(T* request) {
-    // The queue is shared by all threads, so use locker
-    m_queuelocker.lock();
+bool Threadpool<T>::append(T* request, PRIORITY priority) {
+    Queue_item item;
+    item.request = request;
+    item.enqueue_us = Codel::now_us();
+    {
+        // The queue is shared by all threads, so use locker
+        Lock_guard<Futex_mutex> guard(m_queuelocker);
 
-    // cannot append if size of queue is larger than m_max_requests
-    if (m_workqueue.size() > m_max_requests) {
-        m_queuelocker.unlock();
-        return false;
+        // cannot append if size of queue is larger than m_max_requests
+        // or if requests already wait too long, a new one would only wait longer
+        if (m_queued > m_max_requests || (m_codel.overloaded() && m_queued > 0)) {
+            m_codel.count_shed();
+            return false;
+        }
+        m_lanes[priority].push_back(std::move(item));
+        m_queued.fetch_add(1, std::memory_order_relaxed);
     }
-    
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
     m_queuestat.post();
     return true;
 }
 
+template<typename T>
+bool Threadpool<T>::submit(Task task, PRIORITY priority) {
+    return enqueue(task, priority);
+}
+
+template<typename T>
+bool Threadpool<T>::enqueue(Task& task, PRIORITY priority) {
+    {
+        Lock_guard<Futex_mutex> guard(m_queuelocker);
+        if (m_queued > m_max_requests) {
+            return false;
+        }
+        Queue_item item;
+        item.request = NULL;
+        item.task = std::move(task);
+        item.enqueue_us = Codel::now_us();
+        m_lanes[priority].push_back(std::move(item));
+        m_queued.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_queuestat.post();
+    return true;
+}
+
+template<typename T>
+void Threadpool<T>::submit_after(long delay_ms, Task task, PRIORITY priority) {
+    schedule(Codel::now_us() + delay_ms * 1000, new Task(std::move(task)), 0, priority);
+}
+
+template<typename T>
+void Threadpool<T>::submit_every(long period_ms, Task task, PRIORITY priority) {
+    schedule(Codel::now_us() + period_ms * 1000, new Task(std::move(task)), period_ms * 1000, priority);
+}
+
+template<typename T>
+void Threadpool<T>::schedule(uint64_t due_us, Task *task, long period_us, PRIORITY priority) {
+    Lock_guard<Locker> guard(m_timer_locker);
+    if (m_timer_stop) {
+        delete task;
+        return;
+    }
+
+    Timer_item item;
+    item.due_us = due_us;
+    item.task = task;
+    item.period_us = period_us;
+    item.priority = priority;
+    m_timers.push_back(item);
+    std::push_heap(m_timers.begin(), m_timers.end());
+
+    // the timer sleeps until the earliest task, which may be this one now
+    if (m_timers.front().task == task) {
+        m_timer_cond.signal();
+    }
+}
+
 template<typename T>
 void* Threadpool<T>::worker(void* arg) {
-    Threadpool *pool = (Threadpool*)arg;
-    pool->run();
-    return pool;
+    Worker_slot *slot = (Worker_slot*)arg;
+    slot->pool->run(slot);
+    return slot;
 }
 
 template<typename T>
-void Threadpool<T>::run() {
-    while (!m_stop) {
-        m_queuestat.wait();
+bool Threadpool<T>::start_worker() {
+    for (int i = 0; i < m_max_threads; ++i) {
+        Worker_slot& slot = m_threads[i];
+        if (slot.state != Worker_slot::FREE) {
+            continue;
+        }
+        if (pthread_create(&slot.thread, NULL, worker, &slot) != 0) {
+            return false;
+        }
+        slot.state = Worker_slot::RUNNING;
+        ++m_running;
+        if (!m_cpus.empty()) {
+            pin_thread(slot.thread, m_cpus[i % m_cpus.size()]);
+        }
+        return true;
+    }
+    return false;
+}
+
+template<typename T>
+void Threadpool<T>::join_ended() {
+    for (int i = 0; i < m_max_threads; ++i) {
+        if (m_threads[i].state == Worker_slot::ENDED) {
+            pthread_join(m_threads[i].thread, NULL);
+            m_threads[i].state = Worker_slot::FREE;
+        }
+    }
+}
+
+template<typename T>
+void Threadpool<T>::resize() {
+    uint64_t busy = __atomic_exchange_n(&m_busy_us, 0, __ATOMIC_RELAXED);
+    uint64_t now = Codel::now_us();
+    int before = 0;
+    int after = 0;
+    uint64_t wait = 0;
+    double busy_share = 0;
+    {
+        Lock_guard<Futex_mutex> guard(m_queuelocker);
+        if (m_stop) {
+            return;
+        }
+        join_ended();
+
+        uint64_t elapsed = now - m_interval_start;
+        m_interval_start = now;
+
+        // the requests still queued have waited too, a pool stuck on long work has no dequeues to measure
+        wait = m_waits ? m_wait_us / m_waits : 0;
+        for (int i = 0; i < LANES; ++i) {
+            if (!m_lanes[i].empty() && now - m_lanes[i].front().enqueue_us > wait) {
+                wait = now - m_lanes[i].front().enqueue_us;
+            }
+        }
+        m_wait_us = 0;
+        m_waits = 0;
+
+        before = m_running - m_retiring;
+        after = before;
+        // work still running has not been added to busy yet, the workers busy now are counted as busy the whole interval
+        busy_share = elapsed > 0 && before > 0 ? (double)busy / ((double)elapsed * before) : 0;
+        double active_share = before > 0 ? (double)__atomic_load_n(&m_active, __ATOMIC_RELAXED) / before : 0;
+        if (active_share > busy_share) {
+            busy_share = active_share;
+        }
+
+        // requests that wait while the workers idle wait for a cpu, not for a worker, more workers would not help
+        bool short_of_workers = busy_share > GROW_BUSY || (wait > m_grow_wait_us && busy_share > SHRINK_BUSY);
+        if (short_of_workers && before < m_max_threads) {
+            // a quarter more at once, a spike is not absorbed one thread per interval
+            int add = before / 4 > 1 ? before / 4 : 1;
+            if (add > m_max_threads - before) {
+                add = m_max_threads - before;
+            }
+            for (int i = 0; i < add; ++i) {
+                // a worker asked to end and still working is kept instead of starting a new one
+                if (m_retiring > 0) {
+                    --m_retiring;
+                } else if (!start_worker()) {
+                    break;
+                }
+                ++after;
+            }
+            m_quiet = 0;
+        } else if (before > m_min_threads && wait < m_grow_wait_us / 4
+                   && (double)busy < (double)elapsed * (before - 1) * SHRINK_BUSY) {
+            if (++m_quiet >= QUIET_INTERVALS) {
+                // the first worker to wake up ends
+                ++m_retiring;
+                m_queuestat.post();
+                --after;
+                m_quiet = 0;
+            }
+        } else {
+            m_quiet = 0;
+        }
+    }
+
+    if (after != before) {
+        printf("pool: %d -> %d workers, wait %lu us, busy %.0f%%\n", before, after, (unsigned long)wait, busy_share * 100);
+    }
+}
+
+template<typename T>
+bool Threadpool<T>::take(Queue_item& item) {
+    bool starve = ++m_takes % STARVE_TAKES == 0;
+    for (int i = 0; i < LANES; ++i) {
+        std::deque<Queue_item>& lane = m_lanes[starve ? LANES - 1 - i : i];
+        if (!lane.empty()) {
+            item = std::move(lane.front());
+            lane.pop_front();
+            m_queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename T>
+void Threadpool<T>::run(Worker_slot *slot) {
+    Adaptive_spin spin(m_spin_us);
+    Queue_item item;
+
+    // a pool of a fixed size does not measure its work
+    bool elastic = m_min_threads < m_max_threads;
+    while (true) {
+        spin.wait(m_queuestat);
 
         // here we have task
         m_queuelocker.lock();
-        // if the queue is empty, continue
-        if (m_workqueue.empty()) {
+        if (m_retiring > 0 && !m_stop) {
+            // the pool shrinks, the timer joins the thread
+            --m_retiring;
+            --m_running;
+            slot->state = Worker_slot::ENDED;
             m_queuelocker.unlock();
+            break;
+        }
+
+        // if the queue is empty, continue, or end the thread if the pool stops
+        if (!take(item)) {
+            bool stop = m_stop;
+            m_queuelocker.unlock();
+            if (stop) {
+                break;
+            }
             continue;
         }
 
         // here we have data to process
-        T *request = m_workqueue.front();
-        m_workqueue.pop_front();
+        // only the wait of the requests tells whether the clients are served in time
+        bool shed = false;
+        uint64_t now = 0;
+        if (item.request) {
+            now = Codel::now_us();
+            m_wait_us += now - item.enqueue_us;
+            ++m_waits;
+            shed = m_codel.on_dequeue(now - item.enqueue_us, now);
+            if (shed) {
+                m_codel.count_shed();
+            }
+        }
 
         // after unlocking, we can process it
         m_queuelocker.unlock();
+        if (elastic) {
+            if (!now) {
+                now = Codel::now_us();
+            }
+            __atomic_add_fetch(&m_active, 1, __ATOMIC_RELAXED);
+        }
+
+        T *request = item.request;
         if (!request) {
+            item.task.run();
+            item.task = Task();
+        } else if (shed) {
+            // the client has waited too long, tell it to come back later
+            request->reject(503);
+        } else {
+            // process it, this function is in the task class
+            request->process();
+        }
+
+        if (elastic) {
+            __atomic_add_fetch(&m_busy_us, Codel::now_us() - now, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&m_active, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+template<typename T>
+void* Threadpool<T>::timer(void* arg) {
+    Threadpool *pool = (Threadpool*)arg;
+    pool->run_timer();
+    return pool;
+}
+
+template<typename T>
+void Threadpool<T>::run_timer() {
+    // the timer also resizes the pool, it runs when the workers may all be stuck
+    bool elastic = m_min_threads < m_max_threads;
+    uint64_t next_resize = Codel::now_us() + RESIZE_INTERVAL_US;
+
+    m_timer_locker.lock();
+    while (!m_timer_stop) {
+        uint64_t now = Codel::now_us();
+        if (elastic && now >= next_resize) {
+            m_timer_locker.unlock();
+            resize();
+            next_resize = now + RESIZE_INTERVAL_US;
+            m_timer_locker.lock();
+            continue;
+        }
+
+        uint64_t due = elastic ? next_resize : UINT64_MAX;
+        if (!m_timers.empty() && m_timers.front().due_us < due) {
+            due = m_timers.front().due_us;
+        }
+        if (due == UINT64_MAX) {
+            m_timer_cond.wait(m_timer_locker.get());
+            continue;
+        }
+        if (due > now) {
+            // the condition waits on the realtime clock
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            uint64_t ns = until.tv_nsec + (due - now) * 1000;
+            until.tv_sec += ns / 1000000000;
+            until.tv_nsec = ns % 1000000000;
+            m_timer_cond.timewait(m_timer_locker.get(), until);
+            continue;
+        }
+        if (m_timers.empty() || m_timers.front().due_us > now) {
             continue;
         }
 
-        // process it, this function is in the task class
-        request->process();
+        Timer_item next = m_timers.front();
+        std::pop_heap(m_timers.begin(), m_timers.end());
+        m_timers.pop_back();
+        m_timer_locker.unlock();
+
+        Task task;
+        if (next.period_us > 0) {
+            // the run schedules the next one, with the same task
+            Task *periodic = next.task;
+            long period_us = next.period_us;
+            PRIORITY priority = next.priority;
+            task = Task([this, periodic, period_us, priority]() {
+                periodic->run();
+                schedule(Codel::now_us() + period_us, periodic, period_us, priority);
+            });
+        } else {
+            task = std::move(*next.task);
+            delete next.task;
+        }
+        if (!enqueue(task, next.priority)) {
+            schedule(Codel::now_us() + TIMER_RETRY_US, new Task(std::move(task)), 0, next.priority);
+        }
+
+        m_timer_locker.lock();
     }
-}
\ No newline at end of file
+    m_timer_locker.unlock();
+}
+
+template<typename T>
+uint64_t Threadpool<T>::shed_count() {
+    Lock_guard<Futex_mutex> guard(m_queuelocker);
+    return m_codel.shed_count();
+}
+template<typename T>
+bool Threadpool<T>::pin(const int *cpus, int count) {
+    Lock_guard<Futex_mutex> guard(m_queuelocker);
+    m_cpus.assign(cpus, cpus + count);
+    bool ok = true;
+    for (int i = 0; i < m_max_threads && count > 0; ++i) {
+        if (m_threads[i].state == Worker_slot::RUNNING) {
+            ok = pin_thread(m_threads[i].thread, cpus[i % count]) && ok;
+        }
+    }
+    return ok;
+}
+
+template<typename T>
+int Threadpool<T>::thread_count() {
+    Lock_guard<Futex_mutex> guard(m_queuelocker);
+    return m_running - m_retiring;
+}
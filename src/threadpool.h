@@ -3,12 +3,19 @@
 
 #include <pthread.h>
 #include <exception>
-#include <list>
+#include <deque>
+#include <atomic>
+#include <vector>
+#include <algorithm>
 #include <cstdio>
 
 #include "locker.h"
 #include "cond.h"
-#include "sem.h"
+#include "futex.h"
+#include "task.h"
+#include "codel.h"
+#include "affinity.h"
+#include "spin.h"
 
 
 #define THREAD_NUM 8
@@ -16,45 +23,182 @@
 
 // class of thread pool
 // use template to design
+// T provides process() to handle a request, and reject(status) to answer it without handling it
+// other work shares the workers as a Task, now, after a delay or periodically
+// the queue has a lane per priority, a worker takes the highest lane first
+// the number of workers follows the load between min_threads and max_threads
 template<typename T>
 class Threadpool
 {
 public:
-    Threadpool(int thread_number = 8, int max_requests = 10000);
+    // HIGH for work a client waits for and that is short, LOW for housekeeping and long work
+    enum PRIORITY {HIGH = 0, NORMAL, LOW};
+
+    static const int LANES = 3;
+
+    // target_delay_us and interval_us configure the overload control, see Codel
+    // an idle worker spins up to spin_us before it sleeps, see Adaptive_spin
+    // the pool starts thread_number workers, it adds some when the requests wait or the workers are busy
+    // and retires them when they are idle, 0 for min_threads or max_threads is thread_number
+    Threadpool(int thread_number = 8, int max_requests = 10000, int target_delay_us = 5000, int interval_us = 100000, int spin_us = 0,
+               int min_threads = 0, int max_threads = 0);
 
     ~Threadpool();
 
-    bool append(T* request);
+    // return false if the request is refused because the queue is full or overloaded,
+    // the caller answers it with 503
+    // requests are queued as they are, without a Task around them
+    bool append(T* request, PRIORITY priority = NORMAL);
+
+    // queue task, return false if the queue is full
+    // tasks are not shed when the requests are, and their wait does not count as overload
+    bool submit(Task task, PRIORITY priority = NORMAL);
+
+    // queue task after delay_ms
+    void submit_after(long delay_ms, Task task, PRIORITY priority = NORMAL);
+
+    // queue task every period_ms, the next run is counted from the end of the previous one
+    // so the runs never overlap, it runs until the pool stops
+    void submit_every(long period_ms, Task task, PRIORITY priority = NORMAL);
+
+    // number of requests refused by append() or shed by the workers
+    uint64_t shed_count();
+
+    // pin thread i to cpus[i % count], the threads started later too
+    bool pin(const int *cpus, int count);
+
+    // number of workers running
+    int thread_count();
+
+    // number of requests and tasks in the queue, read without the lock for the stats
+    int queued() const { return m_queued.load(std::memory_order_relaxed); }
 
 private:
+    // a place for a worker, it is reused once its thread has ended and been joined
+    struct Worker_slot
+    {
+        Threadpool *pool;
+        pthread_t thread;
+
+        // FREE: no thread, RUNNING: its thread works, ENDED: its thread has returned and can be joined
+        enum {FREE, RUNNING, ENDED} state;
+    };
+
     // working function of the working thread
     // it excecutes a task from the queue
     static void* worker(void* arg);
 
     // helper function
-    void run();
+    void run(Worker_slot *slot);
+
+    // start a worker in a free slot, with the queue locked
+    bool start_worker();
+
+    // join the workers that have ended, with the queue locked
+    void join_ended();
+
+    // measure the last interval and add or retire workers, called by the timer thread
+    void resize();
+
+    // the thread moving the delayed tasks to the queue when they are due
+    static void* timer(void* arg);
+
+    void run_timer();
+
+    // add a delayed task, task is owned by the timer until it is due
+    void schedule(uint64_t due_us, Task *task, long period_us, PRIORITY priority);
+
+    // end the threads after the queue is processed and join them
+    void stop();
 
 private:
-    // number of all threads
-    int m_thread_number;
+    // bounds of the number of workers
+    int m_min_threads;
+    int m_max_threads;
+
+    // m_max_threads slots, the threads are joined when they end and by the destructor
+    Worker_slot* m_threads;
 
-    // array for thread pool, size: m_thread_number
-    pthread_t* m_threads;
+    // workers running, and workers asked to end that have not yet
+    int m_running;
+    int m_retiring;
 
     // the maximum number of requests in the queue
     int m_max_requests;
 
-    // work queue
-    std::list<T*> m_workqueue;
+    // a request or a task in the queue, and the time it was appended
+    struct Queue_item
+    {
+        T *request;
+        Task task;
+        uint64_t enqueue_us;
+    };
+
+    // take the next item of the lanes, with the queue locked
+    bool take(Queue_item& item);
+
+    // queue task, it is moved from only if it is queued
+    bool enqueue(Task& task, PRIORITY priority);
+
+    // work queue, a lane per priority
+    std::deque<Queue_item> m_lanes[LANES];
+
+    // number of items in all lanes, changed under m_queuelocker, read without it by queued()
+    std::atomic<int> m_queued;
+
+    // items taken so far, every STARVE_TAKES-th take starts from the lowest lane so it keeps moving
+    unsigned m_takes;
     
-    // the locker for protecting work queue
-    Locker m_queuelocker;
+    // the locker for protecting work queue, held for a few instructions by every append and take
+    Futex_mutex m_queuelocker;
 
-    // semaphore for detecting whether there is any task
-    Sem m_queuestat;
+    // semaphore for detecting whether there is any task, a post wakes a worker only if one sleeps
+    Futex_sem m_queuestat;
 
-    // whether to end the thread
+    // overload control fed with the time requests wait in the queue, protected by m_queuelocker
+    Codel m_codel;
+
+    // whether to end the thread, the threads end once the queue is empty
     bool m_stop;
+
+    // the longest spin of an idle worker
+    int m_spin_us;
+
+    // the cpus of pin(), a new worker is pinned like the one before it in its slot
+    std::vector<int> m_cpus;
+
+    // measures of the current resize interval: the wait of the requests, with the queue locked,
+    // and the time the workers spent on work, added atomically
+    uint64_t m_wait_us;
+    uint64_t m_waits;
+    uint64_t m_busy_us;
+
+    // workers working right now, added atomically
+    int m_active;
+
+    // the time the interval started, and the consecutive quiet intervals seen
+    uint64_t m_interval_start;
+    int m_quiet;
+
+    // the wait above which workers are added
+    uint64_t m_grow_wait_us;
+
+    // a delayed task, the earliest is on top of m_timers
+    struct Timer_item
+    {
+        uint64_t due_us;
+        Task *task;
+        long period_us;
+        PRIORITY priority;
+
+        bool operator<(const Timer_item& other) const { return due_us > other.due_us; }
+    };
+
+    std::vector<Timer_item> m_timers;
+    Locker m_timer_locker;
+    Cond m_timer_cond;
+    pthread_t m_timer_thread;
+    bool m_timer_stop;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,167 @@
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <vector>
+
+#include "trace.h"
+#include "futex.h"
+
+static const char *stage_names[TRACE_STAGES] = {
+    "request",
+    "read",
+    "queue",
+    "parse",
+    "handle",
+    "respond",
+    "wait",
+    "write",
+    "disk"
+};
+
+// the events of one thread, written only by it
+// a ring whose thread has exited is taken by the next new thread, its old events are dropped
+struct Tracer::Ring
+{
+    Event events[RING_SIZE];
+
+    // events ever written, and the first one of the thread owning the ring now
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> base;
+
+    int tid;
+    bool in_use;
+    Ring *next;
+};
+
+// the rings are never freed, a dump may be reading one while its thread exits
+static Tracer::Ring *rings = NULL;
+static Futex_mutex rings_locker;
+
+// gives the ring of a thread back when it exits
+struct Ring_owner
+{
+    Tracer::Ring *ring = NULL;
+
+    ~Ring_owner() {
+        if (ring) {
+            Lock_guard<Futex_mutex> guard(rings_locker);
+            ring->in_use = false;
+        }
+    }
+};
+
+static thread_local Ring_owner owner;
+static thread_local int countdown = 0;
+
+std::atomic<int> Tracer::m_sample(0);
+std::atomic<uint32_t> Tracer::m_next_id(0);
+uint64_t Tracer::m_start_ticks = 0;
+double Tracer::m_start_us = 0;
+
+static double monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void Tracer::start(int sample) {
+    m_start_ticks = now();
+    m_start_us = monotonic_us();
+    set_sample(sample);
+}
+
+uint32_t Tracer::sample_slow(int every) {
+    // every thread counts down on its own, so sampling shares no cache line
+    if (--countdown > 0) {
+        return 0;
+    }
+    countdown = every;
+    uint32_t id = m_next_id.fetch_add(1, std::memory_order_relaxed) + 1;
+    return id ? id : m_next_id.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+Tracer::Ring* Tracer::ring() {
+    if (owner.ring) {
+        return owner.ring;
+    }
+
+    Lock_guard<Futex_mutex> guard(rings_locker);
+    Ring *r = rings;
+    while (r && r->in_use) {
+        r = r->next;
+    }
+    if (!r) {
+        r = new Ring;
+        r->head.store(0);
+        r->next = rings;
+        rings = r;
+    }
+    r->base.store(r->head.load());
+    r->tid = syscall(SYS_gettid);
+    r->in_use = true;
+    owner.ring = r;
+    return r;
+}
+
+void Tracer::record(uint32_t id, TRACE_STAGE stage, uint64_t start, uint64_t end) {
+    Ring *r = ring();
+    uint64_t h = r->head.load(std::memory_order_relaxed);
+    Event& e = r->events[h % RING_SIZE];
+    e.start = start;
+    e.end = end;
+    e.id = id;
+    e.stage = stage;
+    r->head.store(h + 1, std::memory_order_release);
+}
+
+void Tracer::dump(FILE *out) {
+    // the ticks per microsecond since start()
+    double per_us = (now() - m_start_ticks) / (monotonic_us() - m_start_us);
+    int pid = getpid();
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"server\"}}", pid);
+
+    Lock_guard<Futex_mutex> guard(rings_locker);
+    std::vector<Event> events;
+    for (Ring *r = rings; r; r = r->next) {
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        uint64_t first = r->base.load();
+        if (head - first > (uint64_t)RING_SIZE) {
+            first = head - RING_SIZE;
+        }
+        events.clear();
+        for (uint64_t i = first; i < head; ++i) {
+            events.push_back(r->events[i % RING_SIZE]);
+        }
+
+        // the thread may have written over the oldest ones while they were copied
+        uint64_t written = r->head.load(std::memory_order_acquire);
+        size_t skip = written - first > (uint64_t)RING_SIZE ? written - RING_SIZE - first : 0;
+
+        for (size_t i = skip; i < events.size(); ++i) {
+            const Event& e = events[i];
+            double ts = (double)(int64_t)(e.start - m_start_ticks) / per_us;
+            double dur = (double)(e.end - e.start) / per_us;
+            if (e.stage == TRACE_REQUEST) {
+                // a request spans threads, it goes on a track of its own
+                fprintf(out, ",\n{\"name\":\"request\",\"cat\":\"http\",\"ph\":\"b\",\"id\":%u,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                        e.id, ts, pid, r->tid);
+                fprintf(out, ",\n{\"name\":\"request\",\"cat\":\"http\",\"ph\":\"e\",\"id\":%u,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                        e.id, ts + dur, pid, r->tid);
+            } else {
+                fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"request\":%u}}",
+                        stage_names[e.stage], ts, dur, pid, r->tid, e.id);
+            }
+        }
+    }
+    fprintf(out, "\n]}\n");
+}
+
+bool Tracer::dump(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        return false;
+    }
+    dump(out);
+    return fclose(out) == 0;
+}
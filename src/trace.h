@@ -0,0 +1,111 @@
+#ifndef __TRACE__H
+#define __TRACE__H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// the stages of a request a span can cover
+// REQUEST: from the first byte read to the end of the response, the other spans are inside it
+// QUEUE: from the event loop handing the request to the thread pool to a worker taking it
+// PARSE: the request line and the headers, with HANDLE inside
+// HANDLE: do_request(), the filesystem calls or the handler of the route
+// RESPOND: building the response and reading its first window
+// WAIT: from arming EPOLLOUT to the event loop writing, the socket or the disk is waited for
+// DISK: a disk thread reading a cold window
+enum TRACE_STAGE {TRACE_REQUEST = 0, TRACE_READ, TRACE_QUEUE, TRACE_PARSE, TRACE_HANDLE, TRACE_RESPOND, TRACE_WAIT, TRACE_WRITE, TRACE_DISK, TRACE_STAGES};
+
+// class Tracer records the spans of sampled requests into a ring buffer per thread
+// a sampled request gets a non-zero id, every span of it carries the id, 0 means not sampled,
+// so with sampling off a span costs a branch on the id
+// the rings are dumped as the JSON of chrome://tracing and Perfetto, the spans of one request
+// can be found by their request argument
+class Tracer
+{
+public:
+    // events kept per thread, older ones are overwritten
+    static const int RING_SIZE = 16384;
+
+    // remember where the clock starts, before any span is recorded
+    static void start(int sample);
+
+    // trace one request in sample, 0 turns tracing off
+    static void set_sample(int sample) { m_sample.store(sample, std::memory_order_relaxed); }
+
+    // the id of a new request, 0 if it is not sampled
+    static uint32_t sample() {
+        int every = m_sample.load(std::memory_order_relaxed);
+        return every == 0 ? 0 : sample_slow(every);
+    }
+
+    // a timestamp in ticks of the TSC, or in nanoseconds without it
+    static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+    // keep the span [start, end] of stage of request id in the ring of the calling thread
+    static void record(uint32_t id, TRACE_STAGE stage, uint64_t start, uint64_t end);
+
+    // write the spans in the rings as trace JSON, the rings keep running meanwhile
+    static void dump(FILE *out);
+
+    // write them to path, false if it cannot be written
+    static bool dump(const char *path);
+
+    // a span as it is kept in a ring
+    struct Event
+    {
+        uint64_t start;
+        uint64_t end;
+        uint32_t id;
+        uint32_t stage;
+    };
+
+    // the events of one thread, see trace.cpp
+    struct Ring;
+
+private:
+    static uint32_t sample_slow(int every);
+
+    static Ring* ring();
+
+    static std::atomic<int> m_sample;
+    static std::atomic<uint32_t> m_next_id;
+
+    // the clock when tracing started, the ticks per microsecond are measured against it when dumping
+    static uint64_t m_start_ticks;
+    static double m_start_us;
+};
+
+// class Trace_span records a stage of a sampled request from its construction to its end of scope
+class Trace_span
+{
+public:
+    Trace_span(uint32_t id, TRACE_STAGE stage) : m_id(id), m_stage(stage), m_start(id ? Tracer::now() : 0) {}
+
+    ~Trace_span() {
+        if (m_id) {
+            Tracer::record(m_id, m_stage, m_start, Tracer::now());
+        }
+    }
+
+private:
+    uint32_t m_id;
+    TRACE_STAGE m_stage;
+    uint64_t m_start;
+
+    Trace_span(const Trace_span&) = delete;
+    Trace_span& operator=(const Trace_span&) = delete;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include "upgrade.h"
+
+bool send_fd(int sock, int fd) {
+    // one byte of data has to go with the control message
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+int recv_fd(int sock) {
+    char byte;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, 0) != 1) {
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+int spawn_upgrade(char *argv[]) {
+    int sv[2];
+    if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // the child must not keep the client connections and the epoll of its parent alive,
+        // everything except stdio and the channel is closed before exec
+        if (sv[1] != 3) {
+            dup2(sv[1], 3);
+        }
+        if (syscall(SYS_close_range, 4, ~0U, 0) < 0) {
+            long max_fd = sysconf(_SC_OPEN_MAX);
+            for (long fd = 4; fd < max_fd; ++fd) {
+                close(fd);
+            }
+        }
+        setenv(UPGRADE_ENV, "3", 1);
+        execvp(argv[0], argv);
+
+        // exec failed, the parent sees the channel closed
+        _exit(1);
+    }
+
+    close(sv[1]);
+    return sv[0];
+}
+
+int upgrade_channel() {
+    const char *value = getenv(UPGRADE_ENV);
+    if (!value) {
+        return -1;
+    }
+    int fd = atoi(value);
+    unsetenv(UPGRADE_ENV);
+    return fd;
+}
@@ -0,0 +1,33 @@
+#ifndef __UPGRADE__H
+#define __UPGRADE__H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// zero-downtime binary upgrade
+// the running server execs a new binary and hands its listening socket over a unix socket
+// with SCM_RIGHTS, the new one acknowledges when it accepts connections, then the old one drains
+
+// name of the environment variable telling the new binary which fd is the channel to its parent
+#define UPGRADE_ENV "WEBSERVER_UPGRADE_FD"
+
+// send fd over the unix socket sock
+bool send_fd(int sock, int fd);
+
+// receive a fd sent by send_fd(), return -1 on failure
+int recv_fd(int sock);
+
+// fork and exec argv with only stdio and the channel open
+// return the parent side of the channel, or -1 if the child cannot be started
+int spawn_upgrade(char *argv[]);
+
+// the channel to the parent if this process is the new binary of an upgrade, otherwise -1
+int upgrade_channel();
+
+#endif
@@ -0,0 +1,213 @@
+#include "vhost.h"
+
+Vhost_table::Vhost_table() :
+m_hosts(NULL),
+m_count(0),
+m_capacity(0),
+m_slots(NULL),
+m_mask(0) {}
+
+Vhost_table::~Vhost_table() {
+    for (int i = 0; i < m_count; ++i) {
+        delete m_hosts[i]->assets;
+        delete m_hosts[i]->bundle;
+        delete m_hosts[i]->limiter;
+        delete m_hosts[i];
+    }
+    free(m_hosts);
+    delete[] m_slots;
+}
+
+// FNV-1a
+uint64_t Vhost_table::hash_name(const char *name, int len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < len; ++i) {
+        unsigned char c = name[i];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool Vhost_table::load(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        printf("vhosts: cannot open %s\n", path);
+        return false;
+    }
+
+    char line[1024];
+    int line_number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), fp)) {
+        ++line_number;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        if (!parse_line(line, path, line_number)) {
+            ok = false;
+        }
+    }
+    fclose(fp);
+    if (!ok) {
+        return false;
+    }
+
+    uint64_t capacity = 16;
+    while (capacity < (uint64_t)m_count * 2) {
+        capacity *= 2;
+    }
+    m_slots = new Vhost*[capacity];
+    memset(m_slots, 0, sizeof(Vhost*) * capacity);
+    m_mask = capacity - 1;
+    for (int i = 0; i < m_count; ++i) {
+        if (!insert(m_hosts[i])) {
+            printf("vhosts: %s is listed twice\n", m_hosts[i]->name);
+            return false;
+        }
+    }
+    printf("vhosts: %d hosts from %s\n", m_count, path);
+    return true;
+}
+
+bool Vhost_table::parse_line(char *line, const char *path, int line_number) {
+    char *save = NULL;
+    char *name = strtok_r(line, " \t\r\n", &save);
+    if (!name) {
+        return true;
+    }
+    char *root = strtok_r(NULL, " \t\r\n", &save);
+    if (!root) {
+        printf("vhosts: %s:%d: expected name root\n", path, line_number);
+        return false;
+    }
+
+    Vhost *vhost = new Vhost;
+    vhost->name_len = strlen(name);
+    vhost->assets = NULL;
+    vhost->bundle = NULL;
+    vhost->rate = 0;
+    vhost->burst = 0;
+    vhost->limiter = NULL;
+    // the url is appended to the root in the buffer of a connection, so it is held to the length of doc_root
+    if (vhost->name_len >= (int)sizeof(vhost->name) || !realpath(root, vhost->root) || strlen(vhost->root) >= Config::PATH_LEN) {
+        printf("vhosts: %s:%d: invalid name or root\n", path, line_number);
+        delete vhost;
+        return false;
+    }
+    strcpy(vhost->name, name);
+
+    bool preload = false;
+    const char *bundle = NULL;
+    int ip_rate = 0;
+    int ip_burst = 0;
+    char *option;
+    while ((option = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        if (strcmp(option, "preload") == 0) {
+            preload = true;
+        } else if (strncmp(option, "bundle=", 7) == 0) {
+            bundle = option + 7;
+        } else if (strncmp(option, "rate=", 5) == 0) {
+            vhost->rate = atoi(option + 5);
+        } else if (strncmp(option, "burst=", 6) == 0) {
+            vhost->burst = atoi(option + 6);
+        } else if (strncmp(option, "ip_rate=", 8) == 0) {
+            ip_rate = atoi(option + 8);
+        } else if (strncmp(option, "ip_burst=", 9) == 0) {
+            ip_burst = atoi(option + 9);
+        } else {
+            printf("vhosts: %s:%d: unknown option %s\n", path, line_number, option);
+            delete vhost;
+            return false;
+        }
+    }
+    if (vhost->burst < vhost->rate) {
+        vhost->burst = vhost->rate;
+    }
+    vhost->bucket.tokens = vhost->burst;
+    vhost->bucket.last_ms = Rate_limiter::now_ms();
+
+    // one client of the site has a bucket of its own, apart from its buckets on other sites and the global one
+    if (ip_rate > 0) {
+        vhost->limiter = new Rate_limiter(LIMIT_TABLE_SIZE, ip_rate, ip_burst < ip_rate ? ip_rate : ip_burst, 0, 0, 0);
+    }
+
+    // each host keeps its own files, the memory of one site does not serve another
+    if (preload) {
+        vhost->assets = new Asset_store;
+        if (!vhost->assets->load(vhost->root)) {
+            delete vhost->assets;
+            delete vhost->limiter;
+            delete vhost;
+            return false;
+        }
+    }
+    if (bundle) {
+        vhost->bundle = new Asset_bundle;
+        if (!vhost->bundle->open(bundle)) {
+            delete vhost->assets;
+            delete vhost->bundle;
+            delete vhost->limiter;
+            delete vhost;
+            return false;
+        }
+    }
+
+    if (m_count == m_capacity) {
+        m_capacity = m_capacity ? m_capacity * 2 : 16;
+        m_hosts = (Vhost**)realloc(m_hosts, sizeof(Vhost*) * m_capacity);
+    }
+    m_hosts[m_count++] = vhost;
+    return true;
+}
+
+bool Vhost_table::insert(Vhost *vhost) {
+    uint64_t index = hash_name(vhost->name, vhost->name_len) & m_mask;
+    while (m_slots[index]) {
+        if (m_slots[index]->name_len == vhost->name_len && strncasecmp(m_slots[index]->name, vhost->name, vhost->name_len) == 0) {
+            return false;
+        }
+        index = (index + 1) & m_mask;
+    }
+    m_slots[index] = vhost;
+    return true;
+}
+
+Vhost* Vhost_table::find(const char *host) const {
+    if (!host || !m_slots) {
+        return NULL;
+    }
+
+    // example.com:9006 and example.com. name example.com
+    int len = strcspn(host, ": \t");
+    if (len > 0 && host[len - 1] == '.') {
+        --len;
+    }
+
+    uint64_t index = hash_name(host, len) & m_mask;
+    while (m_slots[index]) {
+        Vhost *vhost = m_slots[index];
+        if (vhost->name_len == len && strncasecmp(vhost->name, host, len) == 0) {
+            return vhost;
+        }
+        index = (index + 1) & m_mask;
+    }
+    return NULL;
+}
+
+bool Vhost_table::admit(Vhost *vhost, uint32_t ip) {
+    if (vhost->limiter && vhost->limiter->on_request(ip) != Rate_limiter::ADMIT) {
+        return false;
+    }
+    if (vhost->rate <= 0) {
+        return true;
+    }
+    vhost->locker.lock();
+    bool ok = Rate_limiter::take(vhost->bucket, Rate_limiter::now_ms(), vhost->rate, vhost->burst);
+    vhost->locker.unlock();
+    return ok;
+}
@@ -0,0 +1,79 @@
+#ifndef __VHOST__H
+#define __VHOST__H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "locker.h"
+#include "limiter.h"
+#include "assets.h"
+#include "config.h"
+
+// a site served by name, chosen by the Host header of the request
+struct Vhost
+{
+    char name[256];
+    int name_len;
+
+    // absolute, the url is appended to it
+    char root[PATH_MAX];
+
+    // the files of this site kept in memory, NULL if they are read from root
+    Asset_store *assets;
+    Asset_bundle *bundle;
+
+    // requests per second to this site from all clients, 0 for no limit
+    int rate;
+    int burst;
+    Token_bucket bucket;
+    Locker locker;
+
+    // requests per second to this site from one client, NULL for no limit
+    Rate_limiter *limiter;
+};
+
+// class Vhost_table holds the virtual hosts of the vhosts file
+// each line is "name root [preload] [bundle=FILE] [rate=N] [burst=N] [ip_rate=N] [ip_burst=N]", # starts a comment
+// the names are hashed once when the file is loaded, a lookup hashes the Host header and probes
+// a table at most half full that is never written afterwards, so the event loops and workers read it without a lock
+class Vhost_table
+{
+public:
+    Vhost_table();
+
+    ~Vhost_table();
+
+    // load the hosts of the file at path, their files are loaded too when they are preloaded or packed
+    bool load(const char *path);
+
+    // the host named by the Host header, the port and a final dot are ignored, NULL if there is none
+    Vhost* find(const char *host) const;
+
+    // source IPs a site with ip_rate tracks at the same time
+    static const int LIMIT_TABLE_SIZE = 4096;
+
+    // whether a request to vhost from the client ip is under the rate of the site and the rate of one client
+    static bool admit(Vhost *vhost, uint32_t ip);
+
+private:
+    bool parse_line(char *line, const char *path, int line_number);
+
+    bool insert(Vhost *vhost);
+
+    // FNV-1a of the name in lower case
+    static uint64_t hash_name(const char *name, int len);
+
+    Vhost **m_hosts;
+    int m_count;
+    int m_capacity;
+
+    // open addressing with linear probing over m_hosts
+    Vhost **m_slots;
+    uint64_t m_mask;
+};
+
+#endif
@@ -0,0 +1,248 @@
+// multi-process stress test of the file cache shared by the workers of a cluster
+// worker processes look up and store more files than the cache has slots, so slots are taken again all the time,
+// and check every body they hold against the file, before they use it and again before they release it
+// crasher processes leave refs behind and a slot FILLING, then die, the parent forgets them like the master does
+// at the end no ref and no FILLING slot may be left and no body may have been torn
+//
+// usage: ./file_cache_stress [workers] [operations per worker] [crashes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <atomic>
+
+#include "file_cache.h"
+
+static const int FILES = 64;
+
+// two probe windows of slots for FILES files
+static const int SLOTS = File_cache::PROBES * 2;
+
+static char g_dir[64];
+
+// failures found by any process, in shared memory
+struct Results
+{
+    std::atomic<long> torn;
+    std::atomic<long> hits;
+    std::atomic<long> stores;
+};
+
+static Results *g_results;
+
+static void file_path(int index, char *buf, size_t size) {
+    snprintf(buf, size, "%s/f%02d", g_dir, index);
+}
+
+static int file_size(int index) {
+    return 100 + index * 211 % (Cached_file::BODY_LEN - 100);
+}
+
+static unsigned char file_byte(int index, int i) {
+    return (index * 131 + i * 7) & 0xff;
+}
+
+static bool make_files() {
+    snprintf(g_dir, sizeof(g_dir), "/tmp/file_cache_stress.%d", getpid());
+    if (mkdir(g_dir, 0755) < 0) {
+        return false;
+    }
+    static char body[Cached_file::BODY_LEN];
+    for (int f = 0; f < FILES; ++f) {
+        char path[128];
+        file_path(f, path, sizeof(path));
+        int size = file_size(f);
+        for (int i = 0; i < size; ++i) {
+            body[i] = file_byte(f, i);
+        }
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || write(fd, body, size) != size) {
+            return false;
+        }
+        close(fd);
+    }
+    return true;
+}
+
+static void remove_files() {
+    for (int f = 0; f < FILES; ++f) {
+        char path[128];
+        file_path(f, path, sizeof(path));
+        unlink(path);
+    }
+    rmdir(g_dir);
+}
+
+// whether file holds file f as it is on the disk
+static bool intact(const Cached_file *file, int f) {
+    if (file->size != file_size(f)) {
+        return false;
+    }
+    for (int i = 0; i < file->size; ++i) {
+        if ((unsigned char)file->body[i] != file_byte(f, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// read file f and store it, the way a response that has sent it does
+static void store(File_cache *cache, int f) {
+    char path[128];
+    file_path(f, path, sizeof(path));
+    static char body[Cached_file::BODY_LEN];
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || read(fd, body, st.st_size) != st.st_size) {
+        printf("cannot read %s\n", path);
+        exit(1);
+    }
+    close(fd);
+    cache->store(path, st, body);
+    g_results->stores.fetch_add(1, std::memory_order_relaxed);
+}
+
+// look files up and store them, holding a few hits for a while like slow responses
+static void run_worker(File_cache *cache, int process, long ops, bool crash) {
+    cache->set_process(process);
+    srand(getpid());
+
+    static const int HELD = 4;
+    Cached_file *held[HELD] = {NULL};
+    int held_file[HELD] = {0};
+    for (long op = 0; op < ops; ++op) {
+        int f = rand() % FILES;
+        char path[128];
+        file_path(f, path, sizeof(path));
+
+        int slot = rand() % HELD;
+        if (held[slot]) {
+            if (!intact(held[slot], held_file[slot])) {
+                g_results->torn.fetch_add(1, std::memory_order_relaxed);
+            }
+            cache->release(held[slot]);
+            held[slot] = NULL;
+        }
+
+        Cached_file *file = cache->lookup(path);
+        if (!file) {
+            store(cache, f);
+            continue;
+        }
+        g_results->hits.fetch_add(1, std::memory_order_relaxed);
+        if (!intact(file, f)) {
+            g_results->torn.fetch_add(1, std::memory_order_relaxed);
+        }
+        held[slot] = file;
+        held_file[slot] = f;
+    }
+
+    if (crash) {
+        // dies with its refs, and in the middle of filling a slot
+        for (int i = 0; i < HELD; ++i) {
+            if (held[i]) {
+                uint32_t word = held[i]->state.load();
+                if ((word & 0xff) == Cached_file::READY) {
+                    held[i]->state.compare_exchange_strong(word, Cached_file::FILLING | (uint32_t)process << 8);
+                    break;
+                }
+            }
+        }
+        _exit(0);
+    }
+    for (int i = 0; i < HELD; ++i) {
+        if (held[i]) {
+            cache->release(held[i]);
+        }
+    }
+    _exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    int workers = argc > 1 ? atoi(argv[1]) : 4;
+    long ops = argc > 2 ? atol(argv[2]) : 200000;
+    int crashes = argc > 3 ? atoi(argv[3]) : 20;
+    if (workers < 1 || workers + 1 > FILE_CACHE_PROCESSES || ops < 1 || crashes < 0) {
+        printf("usage: %s [workers < %d] [operations per worker] [crashes]\n", argv[0], FILE_CACHE_PROCESSES);
+        return 1;
+    }
+    if (!make_files()) {
+        printf("cannot create the files\n");
+        return 1;
+    }
+    g_results = (Results*)mmap(NULL, sizeof(Results), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    File_cache cache;
+    if (g_results == MAP_FAILED || !cache.open((long)SLOTS * sizeof(Cached_file))) {
+        remove_files();
+        return 1;
+    }
+
+    // the workers take rows 0 to workers - 1, the crashers come one after another in the last row
+    for (int i = 0; i < workers; ++i) {
+        if (fork() == 0) {
+            run_worker(&cache, i, ops, false);
+        }
+    }
+    int crasher = workers;
+    int crashed = 0;
+    pid_t crasher_pid = crashes > 0 ? fork() : -1;
+    if (crasher_pid == 0) {
+        run_worker(&cache, crasher, ops / 10 + 1, true);
+    }
+
+    int running = workers + (crasher_pid > 0 ? 1 : 0);
+    while (running > 0) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            break;
+        }
+        if (pid != crasher_pid) {
+            // a worker released what it held
+            --running;
+            continue;
+        }
+        cache.forget(crasher);
+        if (++crashed < crashes) {
+            crasher_pid = fork();
+            if (crasher_pid == 0) {
+                run_worker(&cache, crasher, ops / 10 + 1, true);
+            }
+        } else {
+            --running;
+        }
+    }
+
+    // every process has released or been forgotten
+    int leaked = 0;
+    int filling = 0;
+    for (int i = 0; i < cache.slots(); ++i) {
+        const Cached_file *file = cache.at(i);
+        for (int p = 0; p < FILE_CACHE_PROCESSES; ++p) {
+            leaked += file->refs[p].load() != 0;
+        }
+        filling += (file->state.load() & 0xff) == Cached_file::FILLING;
+    }
+
+    // and the slots can be taken again
+    cache.set_process(0);
+    for (int f = 0; f < FILES; ++f) {
+        store(&cache, f);
+    }
+    int kept = cache.count();
+
+    long torn = g_results->torn.load();
+    printf("%d workers, %ld operations each, %d crashes: %ld hits, %ld stores, %d slots of %d kept at the end\n",
+           workers, ops, crashed, g_results->hits.load(), g_results->stores.load(), kept, cache.slots());
+    printf("torn bodies %ld, refs left %d, slots left filling %d\n", torn, leaked, filling);
+    remove_files();
+
+    bool ok = torn == 0 && leaked == 0 && filling == 0 && kept > 0;
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
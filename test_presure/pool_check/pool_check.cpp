@@ -0,0 +1,173 @@
+// checks of the scheduling of the thread pool of the server
+// the order a worker takes the lanes in, requests and tasks alike, that a busy HIGH lane still lets LOW through,
+// and when the delayed and periodic tasks run
+//
+// usage: ./pool_check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "threadpool.h"
+#include "threadpool.cpp"
+
+// a request that notes when it was processed
+struct Fake_request
+{
+    char lane;
+    std::vector<char> *order;
+
+    void process() { order->push_back(lane); }
+
+    void reject(int /*status*/) { order->push_back('x'); }
+};
+
+typedef Threadpool<Fake_request> Pool;
+
+static int g_failed = 0;
+
+static void expect(bool ok, const char *what) {
+    printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok) {
+        ++g_failed;
+    }
+}
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// hold the only worker of pool until gate is opened, so what is queued meanwhile is taken in lane order
+static void block(Pool *pool, std::atomic<bool> *gate, std::atomic<bool> *blocked) {
+    pool->submit([gate, blocked]() {
+        blocked->store(true);
+        while (!gate->load()) {
+            usleep(1000);
+        }
+    }, Pool::HIGH);
+    while (!blocked->load()) {
+        usleep(1000);
+    }
+}
+
+// wait until pool has taken everything
+static void drain(Pool *pool) {
+    for (int i = 0; i < 2000 && pool->queued() > 0; ++i) {
+        usleep(1000);
+    }
+    usleep(20000);
+}
+
+static void check_lanes() {
+    // one worker and a large queue, the overload control never sheds here
+    Pool pool(1, 1000, 1000000, 1000000);
+    std::vector<char> order;
+    std::atomic<bool> gate(false);
+    std::atomic<bool> blocked(false);
+    block(&pool, &gate, &blocked);
+
+    // interleaved, requests and tasks, the lanes hold 3 of each
+    Fake_request requests[6];
+    const Pool::PRIORITY priorities[3] = {Pool::LOW, Pool::NORMAL, Pool::HIGH};
+    const char names[3] = {'L', 'N', 'H'};
+    for (int i = 0; i < 3; ++i) {
+        for (int p = 0; p < 3; ++p) {
+            if (p < 2) {
+                Fake_request& r = requests[i * 2 + p];
+                r.lane = names[p];
+                r.order = &order;
+                pool.append(&r, priorities[p]);
+            } else {
+                char name = names[p];
+                pool.submit([&order, name]() { order.push_back(name); }, priorities[p]);
+            }
+        }
+    }
+    gate.store(true);
+    drain(&pool);
+    expect(std::string(order.begin(), order.end()) == "HHHNNNLLL", "lanes are taken HIGH, NORMAL, LOW, each in order");
+}
+
+static void check_starvation() {
+    Pool pool(1, 1000, 1000000, 1000000);
+    std::vector<char> order;
+    std::atomic<bool> gate(false);
+    std::atomic<bool> blocked(false);
+    block(&pool, &gate, &blocked);
+
+    // far more HIGH work than STARVE_TAKES
+    for (int i = 0; i < 3; ++i) {
+        pool.submit([&order]() { order.push_back('L'); }, Pool::LOW);
+    }
+    for (int i = 0; i < 60; ++i) {
+        pool.submit([&order]() { order.push_back('H'); }, Pool::HIGH);
+    }
+    gate.store(true);
+    drain(&pool);
+
+    int last_low = -1;
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (order[i] == 'L') {
+            last_low = i;
+        }
+    }
+    expect(order.size() == 63 && last_low >= 0 && last_low < 62, "LOW moves while HIGH stays busy");
+}
+
+static void check_after() {
+    Pool pool(2, 1000, 1000000, 1000000);
+    std::atomic<uint64_t> ran(0);
+    uint64_t start = now_ms();
+    pool.submit_after(200, [&ran]() { ran.store(now_ms()); });
+    usleep(100000);
+    expect(ran.load() == 0, "submit_after does not run before its delay");
+    usleep(300000);
+    uint64_t at = ran.load();
+    expect(at >= start + 200 && at < start + 300, "submit_after runs once its delay has passed");
+
+    // the earlier one runs first, whatever order they were given in
+    std::vector<char> order;
+    pool.submit_after(100, [&order]() { order.push_back('2'); });
+    pool.submit_after(50, [&order]() { order.push_back('1'); });
+    usleep(250000);
+    expect(std::string(order.begin(), order.end()) == "12", "delayed tasks run in the order they are due");
+}
+
+static void check_every() {
+    Pool pool(4, 1000, 1000000, 1000000);
+    std::atomic<int> runs(0);
+    std::atomic<int> running(0);
+    std::atomic<bool> overlapped(false);
+
+    // each run takes longer than the period, the next one is counted from its end
+    pool.submit_every(20, [&]() {
+        if (running.fetch_add(1) > 0) {
+            overlapped.store(true);
+        }
+        runs.fetch_add(1);
+        usleep(30000);
+        running.fetch_sub(1);
+    });
+    usleep(520000);
+    int n = runs.load();
+    char what[80];
+    snprintf(what, sizeof(what), "submit_every runs once per period after the last run (%d runs)", n);
+    expect(n >= 8 && n <= 11, what);
+    expect(!overlapped.load(), "submit_every runs never overlap");
+}
+
+int main() {
+    check_lanes();
+    check_starvation();
+    check_after();
+    check_every();
+    printf("%s\n", g_failed == 0 ? "ok" : "FAILED");
+    return g_failed == 0 ? 0 : 1;
+}
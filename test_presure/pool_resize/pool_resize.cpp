@@ -0,0 +1,100 @@
+// driver of the elastic thread pool of the server
+// a pool of min..max workers is kept busy until it has grown to max, left idle until it has shrunk back to min,
+// then kept busy again: the second growth only reaches max if the slots of the retired workers were joined and reused
+// every task queued has to run once, whatever the pool does meanwhile
+//
+// usage: ./pool_resize [min] [max]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+
+#include "threadpool.h"
+#include "threadpool.cpp"
+
+// the pool only runs tasks here
+struct No_request
+{
+    void process() {}
+
+    void reject(int /*status*/) {}
+};
+
+typedef Threadpool<No_request> Pool;
+
+// what is kept queued while the pool is busy, and how long a task works
+static const int BACKLOG = 64;
+static const int TASK_US = 2000;
+
+static std::atomic<long> g_ran(0);
+static long g_submitted = 0;
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// keep the pool busy, or idle, until it has want workers or timeout_s has passed
+// return how long it took, -1 on timeout
+static double wait_for(Pool *pool, bool busy, int want, double timeout_s) {
+    double start = now_s();
+    while (now_s() - start < timeout_s) {
+        if (pool->thread_count() == want) {
+            return now_s() - start;
+        }
+        while (busy && pool->queued() < BACKLOG) {
+            if (pool->submit([]() { usleep(TASK_US); g_ran.fetch_add(1, std::memory_order_relaxed); })) {
+                ++g_submitted;
+            }
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
+static int g_failed = 0;
+
+static void report(Pool *pool, const char *phase, int from, int to, double took) {
+    if (took < 0) {
+        printf("%-8s %d -> %d workers: FAILED, %d after the timeout\n", phase, from, to, pool->thread_count());
+        ++g_failed;
+    } else {
+        printf("%-8s %d -> %d workers in %.1f s\n", phase, from, to, took);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int min = argc > 1 ? atoi(argv[1]) : 1;
+    int max = argc > 2 ? atoi(argv[2]) : 4;
+    if (min < 1 || max <= min) {
+        printf("usage: %s [min >= 1] [max > min]\n", argv[0]);
+        return 1;
+    }
+
+    // starts one over min, so min is taken as the lower bound
+    Pool pool(min + 1, 100000, 5000, 100000, 0, min, max);
+
+    // a quarter more per interval of 100 ms
+    report(&pool, "grow", min + 1, max, wait_for(&pool, true, max, 3.0));
+
+    // one worker less per 50 quiet intervals
+    double shrink_s = (max - min) * 5.0 + 5.0;
+    report(&pool, "shrink", max, min, wait_for(&pool, false, min, shrink_s));
+
+    // every slot but min has held a thread that ended
+    report(&pool, "regrow", min, max, wait_for(&pool, true, max, 3.0));
+
+    // the backlog runs out
+    wait_for(&pool, false, -1, 1.0);
+    long ran = g_ran.load();
+    printf("%ld tasks queued, %ld ran\n", g_submitted, ran);
+    if (ran != g_submitted) {
+        ++g_failed;
+    }
+
+    printf("%s\n", g_failed == 0 ? "ok" : "FAILED");
+    return g_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+// checks of the request parser: how paths are decoded and normalized, which ones are refused
+// for leaving the root, and which Content-Length values are taken
+//
+// usage: ./request_check
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "request.h"
+
+static int g_failed = 0;
+
+// the path a request line for target is parsed to, NULL if the line is refused
+static const char* parse_target(Http_request *request, const char *target) {
+    static char line[1024];
+    snprintf(line, sizeof(line), "GET %s HTTP/1.1", target);
+    request->clear();
+    if (!request->parse_request_line(line)) {
+        return NULL;
+    }
+    return request->path.data();
+}
+
+// want is the normalized path, NULL if the target has to be refused
+static void check_path(const char *target, const char *want) {
+    Http_request request;
+    const char *got = parse_target(&request, target);
+    bool ok = want ? got && strcmp(got, want) == 0 : got == NULL;
+    if (!ok) {
+        printf("FAILED %s: got %s, want %s\n", target, got ? got : "refused", want ? want : "refused");
+        ++g_failed;
+    }
+}
+
+// want is what content_length(max) returns for the values of Content-Length, -1 if the request is refused
+static void check_length(const char *first, const char *second, long max, long want) {
+    Http_request request;
+    char line1[128];
+    char line2[128];
+    snprintf(line1, sizeof(line1), "Content-Length: %s", first);
+    long got = request.parse_header(line1) ? 0 : -1;
+    if (got == 0 && second) {
+        snprintf(line2, sizeof(line2), "Content-Length: %s", second);
+        got = request.parse_header(line2) ? 0 : -1;
+    }
+    if (got == 0) {
+        got = request.content_length(max);
+    }
+    if (got != want) {
+        printf("FAILED Content-Length %s%s%s up to %ld: got %ld, want %ld\n",
+               first, second ? ", " : "", second ? second : "", max, got, want);
+        ++g_failed;
+    }
+}
+
+int main() {
+    // normalized
+    check_path("/", "/");
+    check_path("/index.html", "/index.html");
+    check_path("//a///b", "/a/b");
+    check_path("/a/./b/.", "/a/b/");
+    check_path("/a/b/../c", "/a/c");
+    check_path("/a/b/..", "/a/");
+    check_path("/a/..", "/");
+    check_path("/a/b/", "/a/b/");
+    check_path("/a%20b.html", "/a b.html");
+    check_path("/a%2Fb", "/a/b");
+    check_path("/x?y=%41&z=../..", "/x");
+    check_path("http://example.com/a/../b", "/b");
+
+    // above the root
+    check_path("/..", NULL);
+    check_path("/../etc/passwd", NULL);
+    check_path("/a/../../etc/passwd", NULL);
+    check_path("/%2e%2e/etc/passwd", NULL);
+    check_path("/%2E%2E/etc/passwd", NULL);
+    check_path("/a/..%2f..%2fetc/passwd", NULL);
+    check_path("/./../x", NULL);
+
+    // malformed
+    check_path("/a%00b", NULL);
+    check_path("/a%zzb", NULL);
+    check_path("/a%2", NULL);
+    check_path("index.html", NULL);
+    check_path("http://example.com", NULL);
+
+    // Content-Length
+    check_length("0", NULL, 1024, 0);
+    check_length("42", NULL, 1024, 42);
+    check_length("1024", NULL, 1024, 1024);
+    check_length("1025", NULL, 1024, -1);
+    check_length("9", NULL, 3, -1);
+    check_length("-1", NULL, 1024, -1);
+    check_length("+5", NULL, 1024, -1);
+    check_length("12abc", NULL, 1024, -1);
+    check_length("", NULL, 1024, -1);
+    check_length("9223372036854775807", NULL, LONG_MAX, LONG_MAX);
+    check_length("9223372036854775808", NULL, LONG_MAX, -1);
+    check_length("18446744073709551617", NULL, 1024, -1);
+    check_length("5", "5", 1024, 5);
+    check_length("5", "6", 1024, -1);
+
+    printf("%s\n", g_failed == 0 ? "ok" : "FAILED");
+    return g_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+// lookup benchmark of the router of the server
+// a radix tree of routes against a scan over the same prefixes, the way the proxy routes used to be matched
+//
+// usage: ./route_bench [routes] [lookups]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "router.h"
+
+// counts what it is asked to handle, nothing is answered
+class Count_handler : public Route_handler
+{
+public:
+    Http_conn::HTTP_CODE handle(Http_conn *conn, const Route_match& match) {
+        return Http_conn::NO_REQUEST;
+    }
+};
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int routes = argc > 1 ? atoi(argv[1]) : 3000;
+    long lookups = argc > 2 ? atol(argv[2]) : 2000000;
+    if (routes < 3 || lookups < 1) {
+        printf("usage: %s [routes >= 3] [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    // a third of each kind, the services share the leading bytes like the routes of a real site
+    Router router;
+    Count_handler *handler = new Count_handler;
+    std::vector<std::string> prefixes;
+    std::vector<std::string> paths;
+    char pattern[128];
+    for (int i = 0; i < routes / 3; ++i) {
+        snprintf(pattern, sizeof(pattern), "/api/v1/service%d/status", i);
+        router.add(pattern, Router::EXACT, handler);
+        prefixes.push_back(pattern);
+        paths.push_back(pattern);
+
+        snprintf(pattern, sizeof(pattern), "/api/v1/service%d/users/:id", i);
+        router.add(pattern, Router::EXACT, handler);
+        snprintf(pattern, sizeof(pattern), "/api/v1/service%d/users/", i);
+        prefixes.push_back(pattern);
+        snprintf(pattern, sizeof(pattern), "/api/v1/service%d/users/%d", i, i * 7);
+        paths.push_back(pattern);
+
+        snprintf(pattern, sizeof(pattern), "/static/bucket%d/", i);
+        router.add(pattern, Router::PREFIX, handler);
+        prefixes.push_back(pattern);
+        snprintf(pattern, sizeof(pattern), "/static/bucket%d/css/site.css", i);
+        paths.push_back(pattern);
+    }
+    // and paths no route has, they go to the files
+    for (int i = 0; i < routes / 3; ++i) {
+        snprintf(pattern, sizeof(pattern), "/images/photo%d.jpg", i);
+        paths.push_back(pattern);
+    }
+    printf("%d routes in %d nodes, %d paths\n", router.route_count(), router.node_count(), (int)paths.size());
+
+    // the paths are visited in a scrambled order, so the caches do not see one route again and again
+    std::vector<int> order(lookups < 1 << 20 ? lookups : 1 << 20);
+    unsigned seed = 12345;
+    for (size_t i = 0; i < order.size(); ++i) {
+        seed = seed * 1103515245 + 12345;
+        order[i] = (seed >> 8) % paths.size();
+    }
+
+    Route_match match;
+    long hits = 0;
+    double start = now_s();
+    for (long i = 0; i < lookups; ++i) {
+        const std::string& path = paths[order[i % order.size()]];
+        hits += router.find(path, &match) != NULL;
+    }
+    double spent = now_s() - start;
+    printf("%-28s %8.1f ns per lookup, %.0f%% routed\n", "radix tree", spent * 1e9 / lookups, 100.0 * hits / lookups);
+
+    // the longest matching prefix by a scan, over fewer lookups as it is slow
+    long scans = lookups / 20 > 0 ? lookups / 20 : 1;
+    hits = 0;
+    start = now_s();
+    for (long i = 0; i < scans; ++i) {
+        const std::string& path = paths[order[i % order.size()]];
+        size_t best = 0;
+        for (size_t j = 0; j < prefixes.size(); ++j) {
+            const std::string& prefix = prefixes[j];
+            if (prefix.size() > best && strncmp(path.c_str(), prefix.c_str(), prefix.size()) == 0) {
+                best = prefix.size();
+            }
+        }
+        hits += best > 0;
+    }
+    spent = now_s() - start;
+    printf("%-28s %8.1f ns per lookup, %.0f%% routed\n", "scan of the prefixes", spent * 1e9 / scans, 100.0 * hits / scans);
+    return 0;
+}
@@ -0,0 +1,90 @@
+// checks of which route of the router of the server a path goes to
+// an exact route wins over a parameter, a parameter over a prefix, and the longest prefix over a shorter one,
+// wherever in the tree each of them is
+//
+// usage: ./route_check
+
+#include <stdio.h>
+#include <string.h>
+
+#include "router.h"
+
+// stands for one route, find() is only asked which handler it returns
+class Named_handler : public Route_handler
+{
+public:
+    explicit Named_handler(const char *name) : m_name(name) {}
+
+    Http_conn::HTTP_CODE handle(Http_conn * /*conn*/, const Route_match& /*match*/) {
+        return Http_conn::NO_REQUEST;
+    }
+
+    const char *m_name;
+};
+
+static int g_failed = 0;
+
+// want is the name of the handler path goes to, NULL for none, param and rest what it captures
+static void check(const Router& router, const char *path, const char *want, const char *param, const char *rest) {
+    Route_match match;
+    Named_handler *handler = (Named_handler*)router.find(path, &match);
+    const char *got = handler ? handler->m_name : NULL;
+    bool ok = want ? got && strcmp(got, want) == 0 : got == NULL;
+    std::string got_param = match.count > 0 ? std::string(match.values[0]) : std::string();
+    std::string got_rest = std::string(match.rest);
+    if (ok && want) {
+        ok = got_param == (param ? param : "") && got_rest == (rest ? rest : "");
+    }
+    if (!ok) {
+        printf("FAILED %s: got %s (%s, %s), want %s (%s, %s)\n", path, got ? got : "none", got_param.c_str(),
+               got_rest.c_str(), want ? want : "none", param ? param : "", rest ? rest : "");
+        ++g_failed;
+    }
+}
+
+static void add(Router *router, const char *pattern, Router::KIND kind) {
+    if (!router->add(pattern, kind, new Named_handler(pattern))) {
+        printf("FAILED cannot add %s\n", pattern);
+        ++g_failed;
+    }
+}
+
+int main() {
+    Router router;
+    add(&router, "/a/b/", Router::PREFIX);
+    add(&router, "/a/:id/x", Router::EXACT);
+    add(&router, "/a/b/y", Router::EXACT);
+    add(&router, "/a/:id", Router::EXACT);
+    add(&router, "/a/", Router::PREFIX);
+    add(&router, "/users/:id/posts/:post", Router::EXACT);
+    add(&router, "/users/me/posts/", Router::PREFIX);
+    add(&router, "/static/", Router::PREFIX);
+    add(&router, "/static/css/", Router::PREFIX);
+    add(&router, "/health", Router::EXACT);
+
+    // a parameter on one branch wins over a prefix on the static one
+    check(router, "/a/b/x", "/a/:id/x", "b", NULL);
+    check(router, "/a/c/x", "/a/:id/x", "c", NULL);
+    check(router, "/users/me/posts/7", "/users/:id/posts/:post", "me", NULL);
+
+    // an exact route wins over a parameter
+    check(router, "/a/b/y", "/a/b/y", NULL, NULL);
+    check(router, "/a/b", "/a/:id", "b", NULL);
+
+    // what no exact route takes goes to the longest prefix
+    check(router, "/a/b/z", "/a/b/", NULL, "z");
+    check(router, "/a/b/", "/a/b/", NULL, "");
+    check(router, "/a/c/y", "/a/", NULL, "c/y");
+    check(router, "/users/me/posts/7/comments", "/users/me/posts/", NULL, "7/comments");
+    check(router, "/static/css/site.css", "/static/css/", NULL, "site.css");
+    check(router, "/static/js/site.js", "/static/", NULL, "js/site.js");
+
+    // no route
+    check(router, "/health/x", NULL, NULL, NULL);
+    check(router, "/users/me", NULL, NULL, NULL);
+    check(router, "/index.html", NULL, NULL, NULL);
+
+    printf("%d routes, %d nodes\n", router.route_count(), router.node_count());
+    printf("%s\n", g_failed == 0 ? "ok" : "FAILED");
+    return g_failed == 0 ? 0 : 1;
+}
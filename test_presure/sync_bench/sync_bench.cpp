@@ -0,0 +1,149 @@
+// contention benchmark of the synchronization of the server
+// the pthread wrappers (Locker, Sem) against the futex ones (Futex_mutex, Futex_sem)
+//
+// usage: ./sync_bench [threads] [operations per thread]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <list>
+
+#include "locker.h"
+#include "sem.h"
+#include "futex.h"
+
+static int g_threads = 4;
+static long g_ops = 1000000;
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// every thread increments one counter under the lock
+template<typename M>
+struct Lock_test
+{
+    M mutex;
+    long counter;
+
+    static void* run(void *arg) {
+        Lock_test *t = (Lock_test*)arg;
+        for (long i = 0; i < g_ops; ++i) {
+            t->mutex.lock();
+            ++t->counter;
+            t->mutex.unlock();
+        }
+        return NULL;
+    }
+};
+
+template<typename M>
+static void bench_lock(const char *name) {
+    Lock_test<M> t;
+    t.counter = 0;
+    pthread_t *threads = new pthread_t[g_threads];
+    double start = now_s();
+    for (int i = 0; i < g_threads; ++i) {
+        pthread_create(threads + i, NULL, Lock_test<M>::run, &t);
+    }
+    for (int i = 0; i < g_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    double spent = now_s() - start;
+    printf("%-28s %8.1f ns per lock%s\n", name, spent * 1e9 / (g_ops * g_threads),
+           t.counter == g_ops * g_threads ? "" : "  WRONG COUNT");
+    delete[] threads;
+}
+
+// post and take with nobody waiting, what append() pays when the workers are busy
+template<typename S>
+static void bench_post(const char *name) {
+    S sem;
+    double start = now_s();
+    for (long i = 0; i < g_ops; ++i) {
+        sem.post();
+        sem.try_wait();
+    }
+    double spent = now_s() - start;
+    printf("%-28s %8.1f ns per post and take\n", name, spent * 1e9 / g_ops);
+}
+
+// the queue of Threadpool: one producer appends under the lock and posts, the workers wait and take
+template<typename M, typename S>
+struct Queue_test
+{
+    M mutex;
+    S sem;
+    std::list<long> queue;
+    long taken;
+
+    static void* work(void *arg) {
+        Queue_test *t = (Queue_test*)arg;
+        while (true) {
+            t->sem.wait();
+            t->mutex.lock();
+            long item = t->queue.front();
+            t->queue.pop_front();
+            ++t->taken;
+            t->mutex.unlock();
+            if (item < 0) {
+                break;
+            }
+        }
+        return NULL;
+    }
+};
+
+template<typename M, typename S>
+static void bench_queue(const char *name) {
+    Queue_test<M, S> t;
+    t.taken = 0;
+    pthread_t *threads = new pthread_t[g_threads];
+    for (int i = 0; i < g_threads; ++i) {
+        pthread_create(threads + i, NULL, Queue_test<M, S>::work, &t);
+    }
+    double start = now_s();
+    for (long i = 0; i < g_ops; ++i) {
+        t.mutex.lock();
+        t.queue.push_back(i);
+        t.mutex.unlock();
+        t.sem.post();
+    }
+    for (int i = 0; i < g_threads; ++i) {
+        t.mutex.lock();
+        t.queue.push_back(-1);
+        t.mutex.unlock();
+        t.sem.post();
+    }
+    for (int i = 0; i < g_threads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    double spent = now_s() - start;
+    printf("%-28s %8.1f ns per item\n", name, spent * 1e9 / g_ops);
+    delete[] threads;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        g_threads = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        g_ops = atol(argv[2]);
+    }
+    if (g_threads < 1 || g_ops < 1) {
+        printf("usage: %s [threads] [operations per thread]\n", argv[0]);
+        return 1;
+    }
+    printf("%d threads, %ld operations each, %ld cpus\n", g_threads, g_ops, sysconf(_SC_NPROCESSORS_ONLN));
+
+    bench_lock<Locker>("lock Locker");
+    bench_lock<Futex_mutex>("lock Futex_mutex");
+    bench_post<Sem>("post Sem");
+    bench_post<Futex_sem>("post Futex_sem");
+    bench_queue<Locker, Sem>("queue Locker + Sem");
+    bench_queue<Futex_mutex, Futex_sem>("queue Futex_mutex + Futex_sem");
+    return 0;
+}
@@ -0,0 +1,427 @@
+// syscall budget of the request types of the server
+// the server runs under ptrace, every syscall of every thread is counted while canned requests
+// are sent to it, and the syscalls per request of each scenario are checked against a budget
+// the syscalls the server makes when idle (timers, log flushes) are measured first and taken out
+//
+// usage: ./syscall_budget [server binary] [requests per scenario]
+// it exits with 1 if a scenario goes over its budget
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <atomic>
+
+#define MAX_SYSCALL 512
+
+// counted by the tracer, read by the driver while the server runs
+static std::atomic<long> g_total(0);
+static std::atomic<long> g_counts[MAX_SYSCALL];
+
+static const char *g_server = "../../server";
+static int g_requests = 200;
+static char g_root[64];
+
+struct Scenario
+{
+    const char *name;
+
+    // what the server is started with, after its doc_root and port
+    const char *args;
+
+    const char *path;
+
+    // all requests on one connection, or one connection per request
+    bool keep_alive;
+
+    // most syscalls of the server per request
+    double budget;
+};
+
+// the budgets are what the path costs today with a little room, lower one when an optimization lands
+static const Scenario g_scenarios[] = {
+    {"keep-alive GET", "", "/index.html", true, 16},
+    {"keep-alive GET, preloaded", "--preload", "/index.html", true, 10},
+    {"keep-alive 404", "", "/missing.html", true, 11},
+    {"GET per connection", "", "/index.html", false, 23},
+    {"keep-alive GET of 4 MB", "", "/big.bin", true, 25},
+};
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+static const char* syscall_name(int nr) {
+    switch (nr) {
+        case SYS_read : return "read";
+        case SYS_write : return "write";
+        case SYS_close : return "close";
+        case SYS_openat : return "openat";
+        case SYS_fstat : return "fstat";
+        case SYS_newfstatat : return "newfstatat";
+#ifdef SYS_stat
+        case SYS_stat : return "stat";
+#endif
+        case SYS_statx : return "statx";
+        case SYS_mmap : return "mmap";
+        case SYS_munmap : return "munmap";
+        case SYS_madvise : return "madvise";
+        case SYS_fadvise64 : return "fadvise64";
+        case SYS_mincore : return "mincore";
+        case SYS_epoll_ctl : return "epoll_ctl";
+#ifdef SYS_epoll_wait
+        case SYS_epoll_wait : return "epoll_wait";
+#endif
+        case SYS_epoll_pwait : return "epoll_pwait";
+        case SYS_accept : return "accept";
+        case SYS_accept4 : return "accept4";
+        case SYS_recvfrom : return "recvfrom";
+        case SYS_sendto : return "sendto";
+        case SYS_writev : return "writev";
+        case SYS_setsockopt : return "setsockopt";
+        case SYS_getsockopt : return "getsockopt";
+        case SYS_fcntl : return "fcntl";
+        case SYS_futex : return "futex";
+        case SYS_clock_nanosleep : return "clock_nanosleep";
+        case SYS_sched_yield : return "sched_yield";
+        case SYS_shutdown : return "shutdown";
+    }
+    return NULL;
+}
+
+// start the server stopped before exec, with the tracer options set
+static pid_t start_server(const Scenario& s, int port) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+
+        char port_arg[16];
+        snprintf(port_arg, sizeof(port_arg), "%d", port);
+        const char *argv[8];
+        int argc = 0;
+        argv[argc++] = g_server;
+        argv[argc++] = "-r";
+        argv[argc++] = g_root;
+        if (s.args[0]) {
+            argv[argc++] = s.args;
+        }
+        argv[argc++] = port_arg;
+        argv[argc] = NULL;
+        execv(g_server, (char**)argv);
+        _exit(127);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    ptrace(PTRACE_SETOPTIONS, pid, NULL,
+           PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_TRACEFORK | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+    return pid;
+}
+
+// follow every thread of the server until it exits, counting the syscalls as they are entered
+// runs in the thread that started the server, only it may trace
+static void trace(pid_t server) {
+    for ( ; ; ) {
+        int status;
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == server) {
+                return;
+            }
+            continue;
+        }
+
+        int sig = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                g_total.fetch_add(1, std::memory_order_relaxed);
+                if (info.entry.nr < MAX_SYSCALL) {
+                    g_counts[info.entry.nr].fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+        } else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP && WSTOPSIG(status) != SIGTRAP) {
+            // a signal for the server, it is delivered, the stops of new threads and events are not
+            sig = WSTOPSIG(status);
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void*)(long)sig);
+    }
+}
+
+static int connect_to(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+// send one request and read the whole response, false if the connection fails
+static bool request(int fd, const char *path, bool keep_alive) {
+    char buf[65536];
+    int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: %s\r\n\r\n",
+                       path, keep_alive ? "keep-alive" : "close");
+    if (send(fd, buf, len, 0) != len) {
+        return false;
+    }
+
+    // the headers, then as many bytes of body as they announce
+    int got = 0;
+    char *end = NULL;
+    while (!end) {
+        int ret = recv(fd, buf + got, sizeof(buf) - 1 - got, 0);
+        if (ret <= 0) {
+            return false;
+        }
+        got += ret;
+        buf[got] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    const char *cl = strcasestr(buf, "Content-Length:");
+    long body = cl ? atol(cl + 15) : 0;
+    long left = body - (got - (end + 4 - buf));
+    while (left > 0) {
+        int ret = recv(fd, buf, sizeof(buf), 0);
+        if (ret <= 0) {
+            return false;
+        }
+        left -= ret;
+    }
+    return true;
+}
+
+static void snapshot(long *counts) {
+    for (int i = 0; i < MAX_SYSCALL; ++i) {
+        counts[i] = g_counts[i].load(std::memory_order_relaxed);
+    }
+}
+
+struct Run
+{
+    const Scenario *scenario;
+    int port;
+    pid_t server;
+    double per_request;
+    bool ok;
+};
+
+// drive one scenario against the traced server and stop it
+static void* drive(void *arg) {
+    Run *run = (Run*)arg;
+    const Scenario& s = *run->scenario;
+    run->ok = false;
+
+    // the server is slow to start under the tracer
+    int fd = -1;
+    for (int i = 0; i < 200 && fd < 0; ++i) {
+        sleep_ms(25);
+        fd = connect_to(run->port);
+    }
+    if (fd < 0) {
+        printf("%-28s the server does not accept\n", s.name);
+        kill(run->server, SIGKILL);
+        return NULL;
+    }
+
+    // warm up, the files are mapped and the buffers allocated once
+    bool ok = true;
+    for (int i = 0; i < 3 && ok; ++i) {
+        ok = request(fd, s.path, true);
+    }
+    if (!s.keep_alive) {
+        close(fd);
+        fd = -1;
+    }
+
+    // what the server makes with nothing to do
+    sleep_ms(100);
+    long idle_start = g_total.load();
+    double idle_time = now_s();
+    sleep_ms(500);
+    double idle_rate = (g_total.load() - idle_start) / (now_s() - idle_time);
+
+    long before[MAX_SYSCALL];
+    long after[MAX_SYSCALL];
+    snapshot(before);
+    long start = g_total.load();
+    double start_time = now_s();
+    for (int i = 0; i < g_requests && ok; ++i) {
+        if (!s.keep_alive) {
+            fd = connect_to(run->port);
+            ok = fd >= 0 && request(fd, s.path, false);
+            if (fd >= 0) {
+                close(fd);
+            }
+        } else {
+            ok = request(fd, s.path, true);
+        }
+    }
+    // the last close is handled after the response
+    sleep_ms(20);
+    double spent = now_s() - start_time;
+    long total = g_total.load() - start;
+    snapshot(after);
+
+    if (fd >= 0 && s.keep_alive) {
+        close(fd);
+    }
+    kill(run->server, SIGKILL);
+    if (!ok) {
+        printf("%-28s a request failed\n", s.name);
+        return NULL;
+    }
+
+    run->per_request = (total - idle_rate * spent) / g_requests;
+    run->ok = true;
+    printf("%-28s %6.1f syscalls per request, budget %4.0f  %s\n", s.name, run->per_request, s.budget,
+           run->per_request <= s.budget ? "ok" : "OVER BUDGET");
+
+    // the syscalls made at least once every two requests
+    printf("   ");
+    for (int i = 0; i < MAX_SYSCALL; ++i) {
+        double n = (double)(after[i] - before[i]) / g_requests;
+        if (n >= 0.5) {
+            const char *name = syscall_name(i);
+            if (name) {
+                printf(" %s %.1f", name, n);
+            } else {
+                printf(" #%d %.1f", i, n);
+            }
+        }
+    }
+    printf("\n");
+    return NULL;
+}
+
+// the files served in the scenarios
+static bool make_root() {
+    strcpy(g_root, "/tmp/syscall_budget.XXXXXX");
+    if (!mkdtemp(g_root)) {
+        return false;
+    }
+    char path[128];
+    snprintf(path, sizeof(path), "%s/index.html", g_root);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        return false;
+    }
+    fprintf(f, "<html><body>syscall budget</body></html>\n");
+    fclose(f);
+
+    snprintf(path, sizeof(path), "%s/big.bin", g_root);
+    f = fopen(path, "w");
+    if (!f) {
+        return false;
+    }
+    static char block[65536];
+    memset(block, 'x', sizeof(block));
+    for (int i = 0; i < 64; ++i) {
+        fwrite(block, 1, sizeof(block), f);
+    }
+    fclose(f);
+    chmod(g_root, 0755);
+    return true;
+}
+
+static void remove_root() {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/index.html", g_root);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/big.bin", g_root);
+    unlink(path);
+    rmdir(g_root);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        g_server = argv[1];
+    }
+    if (argc > 2) {
+        g_requests = atoi(argv[2]);
+    }
+    if (access(g_server, X_OK) != 0 || g_requests < 1) {
+        printf("usage: %s [server binary] [requests per scenario]\n", argv[0]);
+        return 1;
+    }
+    if (!make_root()) {
+        printf("cannot make the files to serve\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int over = 0;
+    int failed = 0;
+    int scenarios = sizeof(g_scenarios) / sizeof(g_scenarios[0]);
+    for (int i = 0; i < scenarios; ++i) {
+        for (int j = 0; j < MAX_SYSCALL; ++j) {
+            g_counts[j].store(0);
+        }
+        g_total.store(0);
+
+        Run run;
+        run.scenario = g_scenarios + i;
+        run.port = 20000 + getpid() % 20000 + i;
+        run.server = start_server(g_scenarios[i], run.port);
+
+        pthread_t driver;
+        pthread_create(&driver, NULL, drive, &run);
+        trace(run.server);
+        pthread_join(driver, NULL);
+
+        // the threads of the server that were still stopped are gone with it
+        while (waitpid(-1, NULL, __WALL | WNOHANG) > 0) {
+        }
+        if (!run.ok) {
+            ++failed;
+        } else if (run.per_request > g_scenarios[i].budget) {
+            ++over;
+        }
+    }
+    remove_root();
+
+    if (failed || over) {
+        printf("%d scenarios failed, %d over budget\n", failed, over);
+        return 1;
+    }
+    printf("every scenario is within its budget\n");
+    return 0;
+}
@@ -23,12 +23,16 @@
 #include <strings.h>
 #include <time.h>
 #include <signal.h>
+#include <sys/time.h>
 
 /* values */
 volatile int timerexpired=0;
 int speed=0;
 int failed=0;
 int bytes=0;
+/* latency of the successful requests, 4 buckets per power of two microseconds */
+#define LAT_BUCKETS 128
+int latency[LAT_BUCKETS];
 /* globals */
 int http10=1; /* 0 - http/0.9, 1 - http/1.0, 2 - http/1.1 */
 /* Allow: GET, HEAD, OPTIONS, TRACE */
@@ -69,6 +73,41 @@ static const struct option long_options[]=
  {NULL,0,NULL,0}
 };
 
+static long now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec*1000000L+tv.tv_usec;
+}
+
+static int lat_bucket(long us)
+{
+  int b=0;
+  while(b<LAT_BUCKETS-1 && (1L<<(b/4))*(4+b%4)/4<=us) b++;
+  return b;
+}
+
+/* upper bound of bucket b in microseconds */
+static long lat_bound(int b)
+{
+  return (1L<<(b/4))*(4+b%4)/4;
+}
+
+/* the latency below which q of the requests finished */
+static long lat_quantile(double q)
+{
+  long total=0,seen=0;
+  int b;
+  for(b=0;b<LAT_BUCKETS;b++) total+=latency[b];
+  if(total==0) return 0;
+  for(b=0;b<LAT_BUCKETS;b++)
+  {
+    seen+=latency[b];
+    if(seen>=q*total) return lat_bound(b);
+  }
+  return lat_bound(LAT_BUCKETS-1);
+}
+
 /* prototypes */
 static void benchcore(const char* host,const int port, const char *request);
 static int bench(void);
@@ -354,7 +393,9 @@ static int bench(void)
 		 return 3;
 	 }
 	 /* fprintf(stderr,"Child - %d %d\n",speed,failed); */
-	 fprintf(f,"%d %d %d\n",speed,failed,bytes);
+	 fprintf(f,"%d %d %d",speed,failed,bytes);
+	 for(i=0;i<LAT_BUCKETS;i++) fprintf(f," %d",latency[i]);
+	 fprintf(f,"\n");
 	 fclose(f);
 	 return 0;
   } else
@@ -381,6 +422,10 @@ static int bench(void)
 		  speed+=i;
 		  failed+=j;
 		  bytes+=k;
+		  for(k=0;k<LAT_BUCKETS;k++)
+		  {
+			  if(fscanf(f,"%d",&j)==1) latency[k]+=j;
+		  }
 		  /* fprintf(stderr,"*Knock* %d %d read=%d\n",speed,failed,pid); */
 		  if(--clients==0) break;
 	  }
@@ -391,6 +436,7 @@ static int bench(void)
 		  (int)(bytes/(float)benchtime),
 		  speed,
 		  failed);
+  printf("Latency: median %ld us, p99 %ld us.\n",lat_quantile(0.5),lat_quantile(0.99));
   }
   return i;
 }
@@ -400,6 +446,7 @@ void benchcore(const char *host,const int port,const char *req)
  int rlen;
  char buf[1500];
  int s,i;
+ long start;
  struct sigaction sa;
 
  /* setup alarm signal handler */
@@ -421,6 +468,7 @@ void benchcore(const char *host,const int port,const char *req)
        }
        return;
     }
+    start=now_us();
     s=Socket(host,port);                          
     if(s<0) { failed++;continue;} 
     if(rlen!=write(s,req,rlen)) {failed++;close(s);continue;}
@@ -448,5 +496,6 @@ void benchcore(const char *host,const int port,const char *req)
     }
     if(close(s)) {failed++;continue;}
     speed++;
+    latency[lat_bucket(now_us()-start)]++;
  }
 }